@@ -0,0 +1,654 @@
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "tool61.hh"
+
+// Usage: ./bench61 [-n TRIALS] [-s SIZES] [-b BLOCKSIZES] [-p PROGRAMS]
+//                  [-i IMPLS] [-c CACHES] [-m MAXTIME] [-d DIR]
+//                  [-t THREADS] [-o CSVFILE] [-j JSONFILE]
+//    Runs the pset4 test programs over a grid of input sizes and block
+//    sizes, with a cold and a warm page cache, for each of the io61,
+//    stdio-io61, and slow-io61 builds. Every combination runs TRIALS
+//    times. The results go to CSVFILE (default standard output), one row
+//    per combination, with the mean wall-clock time and its 95%
+//    confidence interval, and the user CPU time per input byte, which is
+//    what byte-at-a-time programs spend in io61. Each run's profile61
+//    record from fd 100 goes to JSONFILE, if given. Lists are
+//    comma-separated; sizes take k, m, and g suffixes. An IMPL of the
+//    form io61:BACKEND runs the io61 build with $IO61_BACKEND set to
+//    BACKEND, e.g. io61:mmap. Given THREADS, the io61 builds of the
+//    programs that take `-k` also copy with io61_copy once per thread
+//    count, with $IO61_COPY_THREADS set to it; the mb_per_s column then
+//    shows how throughput scales. logwrite61, which appends records to
+//    one file from several threads, writes each SIZE and runs once per
+//    thread count with `-j`, in every build, to show how its writers
+//    contend. rmw61, which updates random blocks of a file in place,
+//    gets a fresh copy of the input for every run; the copying is not
+//    timed. The out_bytes column is the size of
+//    the output, so that io61:w:lz shows what compression saves. The
+//    CACHE "mem" runs the programs that take `-m` on io61_memopen
+//    files, and times only their profiled copy, without kernel I/O;
+//    comparing it with "warm" separates library overhead from system
+//    call cost. Input files are generated in DIR (default files/bench),
+//    so nothing depends on /usr/share/dict/words.
+//
+//    Defaults: -n 5 -s 1m,8m,32m -b 1,512,4096,65536 -i io61,stdio,slow
+//    -c cold,warm -m 10, and every program. A combination that times out
+//    is reported with status "timeout", and larger inputs for that
+//    program and build are skipped.
+
+
+// program
+//    How to run one test program.
+
+struct program {
+    const char* name;
+    bool input;         // reads an input file
+    bool blocked;       // takes `-b BLOCKSIZE`
+    const char* extra;  // extra arguments
+    bool copies;        // takes `-k` to copy with io61_copy
+    bool memory;        // takes `-m` to copy between memory files
+    bool writers;       // takes `-j THREADS` and writes `-s SIZE` bytes
+    bool updates;       // updates its input file in place
+};
+
+static const program programs[] = {
+    { "cat61", true, false, "", true, true, false, false },
+    { "blockcat61", true, true, "", true, true, false, false },
+    { "randblockcat61", true, true, "", false, false, false, false },
+    { "reverse61", true, false, "", false, false, false, false },
+    { "reordercat61", true, true, "", false, false, false, false },
+    { "stridecat61", true, true, "-t 1024", false, false, false, false },
+    { "ostridecat61", true, true, "-t 1024", false, false, false, false },
+    { "scattergather61", true, true, "", false, false, false, false },
+    { "pipeexchange61", false, false, "", false, false, false, false },
+    { "logwrite61", false, false, "", false, false, true, false },
+    { "rmw61", true, true, "", false, false, false, true }
+};
+
+static const char* const impl_prefixes[][2] = {
+    { "io61", "./" }, { "stdio", "./stdio-" }, { "slow", "./slow-" }
+};
+
+
+// run_result
+//    What one run of a program did.
+
+struct run_result {
+    enum { OK, FAILED, TIMEOUT } status;
+    double wall;        // seconds
+    double utime;
+    double stime;
+    long maxrss;        // kilobytes
+    std::string profile;
+};
+
+
+// config, summary
+//    One combination in the grid, and what its trials measured.
+
+struct config {
+    const program* prog;
+    std::string impl;
+    size_t size;        // 0 if the program reads no input
+    size_t block;       // 0 if the program takes no block size
+    std::string cache;
+    size_t threads;     // copy or writer threads, or 0 for the default
+
+    // the stdio run to compare with: the same but for copy threads,
+    // which stdio does not have, and with as many writer threads
+    std::string key() const {
+        return std::string(prog->name) + " " + std::to_string(size) + " "
+            + std::to_string(block) + " " + cache
+            + (prog->writers ? " " + std::to_string(threads) : "");
+    }
+};
+
+struct summary {
+    config c;
+    const char* status;
+    std::vector<double> walls;
+    double utime = 0, stime = 0;
+    long maxrss = 0;
+    long long out_bytes = -1;   // output size after the last trial
+};
+
+
+static double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// make_dataset(dir, size)
+//    Return the name of a `size`-byte text file in `dir`, creating it if
+//    necessary. The text is lines of pseudorandom lowercase words from a
+//    fixed seed, so every run sees the same bytes.
+
+static std::string make_dataset(const std::string& dir, size_t size) {
+    std::string fn = dir + "/text" + std::to_string(size) + ".txt";
+    struct stat st;
+    if (stat(fn.c_str(), &st) == 0 && (size_t) st.st_size == size) {
+        return fn;
+    }
+    fprintf(stderr, "bench61: generating %s\n", fn.c_str());
+    FILE* f = fopen(fn.c_str(), "w");
+    if (!f) {
+        perror(fn.c_str());
+        exit(1);
+    }
+    unsigned long x = 61;
+    size_t written = 0;
+    while (written < size) {
+        x = x * 6364136223846793005UL + 1442695040888963407UL;
+        int len = 1 + (x >> 33) % 12;
+        for (int i = 0; i < len && written < size - 1; ++i, ++written) {
+            x = x * 6364136223846793005UL + 1442695040888963407UL;
+            fputc('a' + (x >> 33) % 26, f);
+        }
+        fputc('\n', f);
+        ++written;
+    }
+    fflush(f);
+    fdatasync(fileno(f));
+    fclose(f);
+    return fn;
+}
+
+// decache(fn)
+//    Drop `fn` from the page cache, as check.pl does for cold runs.
+
+static void decache(const std::string& fn) {
+    int fd = open(fn.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+
+// copy_file(from, to)
+//    Make `to` a copy of `from`, for programs that change their input.
+
+static void copy_file(const std::string& from, const std::string& to) {
+    int in = open(from.c_str(), O_RDONLY);
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    char buf[65536];
+    ssize_t n = 0;
+    while (in >= 0 && out >= 0 && (n = read(in, buf, sizeof(buf))) > 0
+           && write(out, buf, n) == n) {
+    }
+    if (in < 0 || out < 0 || n != 0) {
+        perror(to.c_str());
+        exit(1);
+    }
+    close(in);
+    close(out);
+}
+
+
+// run(argv, backend, threads, outfn, maxtime)
+//    Run `argv` with standard output redirected to `outfn` and fd 100
+//    connected to a pipe, and return what happened. If `backend` is
+//    nonempty, $IO61_BACKEND is set to it, and if `threads` is nonzero,
+//    $IO61_COPY_THREADS is set to it. The program and
+//    everything it forks is killed after `maxtime` seconds.
+
+static run_result run(const std::vector<std::string>& argv,
+                      const std::string& backend, size_t threads,
+                      const std::string& outfn, double maxtime) {
+    run_result res = { run_result::OK, 0, 0, 0, 0, "" };
+    int pfd[2];
+    if (pipe(pfd) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    double start = now();
+    pid_t p = fork();
+    if (p == 0) {
+        setpgid(0, 0);
+        int in = open("/dev/null", O_RDONLY);
+        int out = open(outfn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        int err = open("/dev/null", O_WRONLY);
+        if (in < 0 || out < 0 || err < 0) {
+            _exit(126);
+        }
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(err, STDERR_FILENO);
+        dup2(pfd[1], 100);
+        close(pfd[0]);
+        close(pfd[1]);
+        close(in);
+        close(out);
+        close(err);
+        if (!backend.empty()) {
+            setenv("IO61_BACKEND", backend.c_str(), 1);
+        }
+        if (threads) {
+            setenv("IO61_COPY_THREADS", std::to_string(threads).c_str(), 1);
+        }
+        std::vector<char*> args;
+        for (auto& a : argv) {
+            args.push_back(const_cast<char*>(a.c_str()));
+        }
+        args.push_back(nullptr);
+        execv(args[0], args.data());
+        _exit(127);
+    } else if (p < 0) {
+        perror("fork");
+        exit(1);
+    }
+    setpgid(p, p);
+    close(pfd[1]);
+
+    // collect the profile record until the program closes fd 100
+    bool open_pipe = true;
+    while (open_pipe) {
+        double left = start + maxtime - now();
+        if (left <= 0) {
+            res.status = run_result::TIMEOUT;
+            break;
+        }
+        pollfd pf = { pfd[0], POLLIN, 0 };
+        int r = poll(&pf, 1, (int) (left * 1000) + 1);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r > 0) {
+            char buf[8192];
+            ssize_t n = read(pfd[0], buf, sizeof(buf));
+            if (n > 0) {
+                res.profile.append(buf, n);
+            } else if (n == 0 || errno != EINTR) {
+                open_pipe = false;
+            }
+        }
+    }
+    close(pfd[0]);
+
+    int status;
+    struct rusage ru;
+    while (true) {
+        pid_t w = wait4(p, &status, WNOHANG, &ru);
+        if (w == p) {
+            break;
+        } else if (res.status == run_result::TIMEOUT
+                   || now() > start + maxtime) {
+            res.status = run_result::TIMEOUT;
+            kill(-p, SIGKILL);
+            wait4(p, &status, 0, &ru);
+            break;
+        }
+        usleep(1000);
+    }
+    res.wall = now() - start;
+    // a timed-out program's children may linger; take them all down
+    kill(-p, SIGKILL);
+
+    if (res.status == run_result::OK
+        && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+        res.status = run_result::FAILED;
+    }
+    res.utime = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    res.stime = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    res.maxrss = ru.ru_maxrss;
+    while (!res.profile.empty() && res.profile.back() == '\n') {
+        res.profile.pop_back();
+    }
+    return res;
+}
+
+
+// t95(df)
+//    Two-sided 95% critical value of Student's t with `df` degrees of
+//    freedom.
+
+static double t95(size_t df) {
+    static const double table[] = {
+        0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+        2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110,
+        2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056,
+        2.052, 2.048, 2.045, 2.042
+    };
+    if (df < sizeof(table) / sizeof(table[0])) {
+        return table[df];
+    } else {
+        return 1.960;
+    }
+}
+
+
+static void usage() {
+    fprintf(stderr, "Usage: ./bench61 [-n TRIALS] [-s SIZES] [-b BLOCKSIZES]\n"
+            "                 [-p PROGRAMS] [-i IMPLS] [-c CACHES]\n"
+            "                 [-m MAXTIME] [-d DIR] [-t THREADS]\n"
+            "                 [-o CSVFILE] [-j JSONFILE]\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    size_t ntrials = 5;
+    std::vector<std::string> sizes = split("1m,8m,32m");
+    std::vector<std::string> blocks = split("1,512,4096,65536");
+    std::vector<std::string> prognames, impls = split("io61,stdio,slow");
+    std::vector<std::string> caches = split("cold,warm");
+    std::vector<std::string> threads;
+    double maxtime = 10;
+    std::string dir = "files/bench";
+    const char* csvfn = nullptr;
+    const char* jsonfn = nullptr;
+    for (auto& p : programs) {
+        prognames.push_back(p.name);
+    }
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:b:p:i:c:m:d:t:o:j:")) != -1) {
+        switch (opt) {
+        case 'n':
+            ntrials = strtoul(optarg, nullptr, 0);
+            if (ntrials == 0) {
+                usage();
+            }
+            break;
+        case 's':
+            sizes = split(optarg);
+            break;
+        case 'b':
+            blocks = split(optarg);
+            break;
+        case 'p':
+            prognames = split(optarg);
+            break;
+        case 'i':
+            impls = split(optarg);
+            break;
+        case 'c':
+            caches = split(optarg);
+            break;
+        case 'm':
+            maxtime = strtod(optarg, nullptr);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 't':
+            threads = split(optarg);
+            break;
+        case 'o':
+            csvfn = optarg;
+            break;
+        case 'j':
+            jsonfn = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc) {
+        usage();
+    }
+
+    // build the grid; smaller inputs run first so timeouts can prune
+    std::vector<size_t> sizev;
+    for (auto& s : sizes) {
+        sizev.push_back(parse_size("bench61", s));
+    }
+    std::sort(sizev.begin(), sizev.end());
+    std::vector<config> grid;
+    const std::vector<size_t> no_size = {0};
+    const std::vector<std::string> no_block = {"0"}, no_cache = {"warm"};
+    std::vector<size_t> threadv = {0};
+    for (auto& t : threads) {
+        threadv.push_back(parse_size("bench61", t));
+    }
+    for (auto& pn : prognames) {
+        const program* prog = nullptr;
+        for (auto& p : programs) {
+            if (pn == p.name) {
+                prog = &p;
+            }
+        }
+        if (!prog) {
+            fprintf(stderr, "bench61: unknown program '%s'\n", pn.c_str());
+            exit(1);
+        }
+        for (auto& impl : impls) {
+            bool known = false;
+            for (auto& ip : impl_prefixes) {
+                known = known || impl == ip[0];
+            }
+            known = known || impl.compare(0, 5, "io61:") == 0;
+            if (!known) {
+                fprintf(stderr, "bench61: unknown implementation '%s'\n",
+                        impl.c_str());
+                exit(1);
+            }
+            // cache state does not matter without an input file
+            for (size_t size : prog->input || prog->writers ? sizev
+                                                            : no_size) {
+                for (auto& b : prog->blocked ? blocks : no_block) {
+                    for (auto& cache : prog->input ? caches : no_cache) {
+                        if (cache != "cold" && cache != "warm"
+                            && cache != "mem") {
+                            fprintf(stderr, "bench61: unknown cache '%s'\n",
+                                    cache.c_str());
+                            exit(1);
+                        } else if (cache == "mem" && !prog->memory) {
+                            continue;
+                        }
+                        for (size_t t : threadv) {
+                            if (t && !prog->writers
+                                && (!prog->copies
+                                    || impl.compare(0, 4, "io61") != 0)) {
+                                continue;
+                            }
+                            grid.push_back({prog, impl, size,
+                                            parse_size("bench61", b),
+                                            cache, t});
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    mkdir("files", 0777);
+    if (mkdir(dir.c_str(), 0777) < 0 && errno != EEXIST) {
+        perror(dir.c_str());
+        exit(1);
+    }
+    std::map<size_t, std::string> datasets;
+    for (size_t size : sizev) {
+        datasets[size] = make_dataset(dir, size);
+    }
+    std::string outfn = dir + "/out";
+    std::string updatefn = dir + "/update";
+
+    FILE* json = nullptr;
+    if (jsonfn && !(json = fopen(jsonfn, "w"))) {
+        perror(jsonfn);
+        exit(1);
+    }
+
+    // run the grid
+    std::vector<summary> results;
+    std::map<std::string, size_t> timed_out;   // program+impl -> size
+    for (auto& c : grid) {
+        summary s;
+        s.c = c;
+        s.status = "ok";
+        std::string pi = std::string(c.prog->name) + " " + c.impl + " "
+            + std::to_string(c.threads);
+        if (timed_out.count(pi) && c.size > timed_out[pi]) {
+            s.status = "skipped";
+            results.push_back(s);
+            continue;
+        }
+
+        std::vector<std::string> args;
+        std::string backend;
+        for (auto& ip : impl_prefixes) {
+            if (c.impl == ip[0]) {
+                args.push_back(std::string(ip[1]) + c.prog->name);
+            }
+        }
+        if (c.impl.compare(0, 5, "io61:") == 0) {
+            args.push_back(std::string("./") + c.prog->name);
+            backend = c.impl.substr(5);
+        }
+        if (c.threads && c.prog->writers) {
+            args.push_back("-j");
+            args.push_back(std::to_string(c.threads));
+        } else if (c.threads) {
+            args.push_back("-k");
+        }
+        if (c.cache == "mem") {
+            args.push_back("-m");
+        }
+        if (c.block) {
+            args.push_back("-b");
+            args.push_back(std::to_string(c.block));
+        }
+        if (*c.prog->extra) {
+            for (auto& e : split(c.prog->extra, ' ')) {
+                args.push_back(e);
+            }
+        }
+        if (c.prog->writers) {
+            args.push_back("-s");
+            args.push_back(std::to_string(c.size));
+        }
+        std::string infn = c.prog->updates ? updatefn : datasets[c.size];
+        if (c.prog->input) {
+            args.push_back(infn);
+            if (strcmp(c.prog->name, "scattergather61") == 0) {
+                args.push_back(datasets[c.size]);
+            }
+        }
+
+        size_t copy_threads = c.prog->writers ? 0 : c.threads;
+        fprintf(stderr, "bench61: %s %s size %zu block %zu %s threads %zu\n",
+                c.prog->name, c.impl.c_str(), c.size, c.block,
+                c.cache.c_str(), c.threads);
+        if (c.cache != "cold" && c.prog->input) {
+            if (c.prog->updates) {
+                copy_file(datasets[c.size], updatefn);
+            }
+            run(args, backend, copy_threads, outfn, maxtime);
+        }
+        for (size_t t = 0; t != ntrials; ++t) {
+            if (c.prog->updates) {
+                copy_file(datasets[c.size], updatefn);
+            }
+            if (c.cache == "cold") {
+                decache(infn);
+            }
+            run_result r = run(args, backend, copy_threads, outfn, maxtime);
+            if (json) {
+                fprintf(json, "{\"program\":\"%s\", \"impl\":\"%s\", "
+                        "\"size\":%zu, \"block\":%zu, \"cache\":\"%s\", "
+                        "\"threads\":%zu, \"trial\":%zu, \"wall\":%.6f, "
+                        "\"profile\":%s}\n",
+                        c.prog->name, c.impl.c_str(), c.size, c.block,
+                        c.cache.c_str(), c.threads, t, r.wall,
+                        r.profile.empty() ? "null" : r.profile.c_str());
+            }
+            if (r.status == run_result::TIMEOUT) {
+                s.status = "timeout";
+                timed_out[pi] = c.size;
+                break;
+            } else if (r.status == run_result::FAILED) {
+                s.status = "failed";
+                break;
+            }
+            // in memory, the profiled copy is the measurement; loading
+            // and saving the files are kernel I/O
+            const char* tp = strstr(r.profile.c_str(), "\"time\":");
+            if (c.cache == "mem" && tp) {
+                r.wall = strtod(tp + 7, nullptr);
+            }
+            s.walls.push_back(r.wall);
+            s.utime += r.utime / ntrials;
+            s.stime += r.stime / ntrials;
+            s.maxrss = std::max(s.maxrss, r.maxrss);
+            struct stat st;
+            s.out_bytes = stat(outfn.c_str(), &st) == 0 ? st.st_size : -1;
+        }
+        results.push_back(s);
+    }
+
+    // write the CSV
+    FILE* csv = stdout;
+    if (csvfn && !(csv = fopen(csvfn, "w"))) {
+        perror(csvfn);
+        exit(1);
+    }
+    std::map<std::string, double> stdio_means;
+    for (auto& s : results) {
+        if (s.c.impl == "stdio" && !strcmp(s.status, "ok")) {
+            double sum = 0;
+            for (double w : s.walls) {
+                sum += w;
+            }
+            stdio_means[s.c.key()] = sum / s.walls.size();
+        }
+    }
+    fprintf(csv, "program,impl,size,block,cache,threads,status,trials,mean_s,"
+            "stddev_s,ci95_lo_s,ci95_hi_s,min_s,median_s,utime_s,stime_s,"
+            "maxrss_kb,vs_stdio,user_ns_per_byte,mb_per_s,out_bytes\n");
+    for (auto& s : results) {
+        fprintf(csv, "%s,%s,%zu,%zu,%s,%zu,%s,%zu", s.c.prog->name,
+                s.c.impl.c_str(), s.c.size, s.c.block, s.c.cache.c_str(),
+                s.c.threads, s.status, s.walls.size());
+        if (strcmp(s.status, "ok") != 0) {
+            fprintf(csv, ",,,,,,,,,,,,,\n");
+            continue;
+        }
+        size_t n = s.walls.size();
+        double mean = 0, var = 0;
+        for (double w : s.walls) {
+            mean += w / n;
+        }
+        for (double w : s.walls) {
+            var += (w - mean) * (w - mean);
+        }
+        double sd = n > 1 ? sqrt(var / (n - 1)) : 0;
+        double half = n > 1 ? t95(n - 1) * sd / sqrt(n) : 0;
+        std::sort(s.walls.begin(), s.walls.end());
+        double median = n % 2 ? s.walls[n / 2]
+            : (s.walls[n / 2 - 1] + s.walls[n / 2]) / 2;
+        fprintf(csv, ",%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%ld,",
+                mean, sd, mean - half, mean + half, s.walls[0], median,
+                s.utime, s.stime, s.maxrss);
+        auto it = stdio_means.find(s.c.key());
+        if (it != stdio_means.end()) {
+            fprintf(csv, "%.3f", it->second / mean);
+        }
+        fprintf(csv, ",%.3f,%.1f,%lld\n",
+                s.c.size ? s.utime * 1e9 / s.c.size : 0.0,
+                s.c.size / mean / 1e6, s.out_bytes);
+    }
+    if (csv != stdout) {
+        fclose(csv);
+    }
+    if (json) {
+        fclose(json);
+    }
+}
@@ -1,33 +1,77 @@
 #include "io61.hh"
 
-// Usage: ./blockcat61 [-b BLOCKSIZE] [-o OUTFILE] [FILE]
-//    Copies the input FILE to standard output in blocks.
-//    Default BLOCKSIZE is 4096.
+// Usage: ./blockcat61 [-b BLOCKSIZE] [-k] [-c] [-m] [-f] [-o OUTFILE]
+//                     [FILE...]
+//    Copies the input FILEs, one after another, to standard output in
+//    blocks.
+//    Default BLOCKSIZE is 4096. With `-k`, copies each block with
+//    io61_copy instead of reading it into a buffer and writing it out.
+//    With `-c`, checksums the bytes read and written and fails if they
+//    differ. With `-m`, copies between io61_memopen files, loading the
+//    input before the profile starts and saving the output after it
+//    ends, so the profile excludes kernel I/O. With `-f`, flushes the
+//    output after every block.
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_arguments args(argc, argv, "b:o:i:");
+    io61_arguments args(argc, argv, "b:kcmfo:i:#");
     size_t block_size = args.block_size ? args.block_size : 4096;
 
     // Allocate buffer, open files
     char* buf = new char[block_size];
 
-    io61_profile_begin();
-    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
-    io61_file* outf = io61_open_check(args.output_file,
-                                      O_WRONLY | O_CREAT | O_TRUNC);
+    io61_file* inf;
+    io61_file* outf;
+    if (args.memory) {
+        inf = io61_memload(args.input_files);
+        outf = io61_memopen(nullptr, 0, O_WRONLY);
+        io61_profile_begin();
+    } else {
+        io61_profile_begin();
+        inf = io61_open_concat(args.input_files);
+        outf = io61_open_check(args.output_file,
+                               O_WRONLY | O_CREAT | O_TRUNC);
+    }
+    if (args.verify) {
+        io61_checksum_start(inf);
+        io61_checksum_start(outf);
+    }
 
     // Copy file data
-    while (1) {
+    while (args.copy) {
+        ssize_t amount = io61_copy(inf, outf, block_size);
+        if (amount <= 0) {
+            break;
+        }
+    }
+    while (!args.copy) {
         ssize_t amount = io61_read(inf, buf, block_size);
         if (amount <= 0) {
             break;
         }
         io61_write(outf, buf, amount);
+        if (args.flush) {
+            io61_flush(outf);
+        }
+    }
+
+    int status = 0;
+    if (args.verify && io61_checksum(inf) != io61_checksum(outf)) {
+        fprintf(stderr, "%s: checksum mismatch (read %08x, wrote %08x)\n",
+                args.program_name, io61_checksum(inf), io61_checksum(outf));
+        status = 1;
     }
 
     io61_close(inf);
-    io61_close(outf);
-    io61_profile_end();
+    if (args.memory) {
+        io61_profile_end();
+        if (io61_memsave(outf, args.output_file) < 0) {
+            status = 1;
+        }
+    } else {
+        io61_close(outf);
+        io61_profile_end();
+    }
     delete[] buf;
+    return status;
 }
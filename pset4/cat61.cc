@@ -1,16 +1,38 @@
 #include "io61.hh"
 
-// Usage: ./cat61 [-s SIZE] [-o OUTFILE] [FILE]
-//    Copies the input FILE to OUTFILE one character at a time.
+// Usage: ./cat61 [-s SIZE] [-k] [-c] [-m] [-o OUTFILE] [FILE...]
+//    Copies the input FILEs, one after another, to OUTFILE one character
+//    at a time. With `-k`, copies with a single io61_copy call instead.
+//    With `-c`, checksums the bytes read and written and fails if they
+//    differ. With `-m`, copies between io61_memopen files, loading the
+//    input before the profile starts and saving the output after it
+//    ends, so the profile excludes kernel I/O.
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_arguments args(argc, argv, "s:o:i:");
+    io61_arguments args(argc, argv, "s:kcmo:i:#");
 
-    io61_profile_begin();
-    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
-    io61_file* outf = io61_open_check(args.output_file,
-                                      O_WRONLY | O_CREAT | O_TRUNC);
+    io61_file* inf;
+    io61_file* outf;
+    if (args.memory) {
+        inf = io61_memload(args.input_files);
+        outf = io61_memopen(nullptr, 0, O_WRONLY);
+        io61_profile_begin();
+    } else {
+        io61_profile_begin();
+        inf = io61_open_concat(args.input_files);
+        outf = io61_open_check(args.output_file,
+                               O_WRONLY | O_CREAT | O_TRUNC);
+    }
+    if (args.verify) {
+        io61_checksum_start(inf);
+        io61_checksum_start(outf);
+    }
+
+    if (args.copy) {
+        io61_copy(inf, outf, args.input_size);
+        args.input_size = 0;
+    }
 
     while (args.input_size > 0) {
         int ch = io61_readc(inf);
@@ -21,7 +43,22 @@ int main(int argc, char* argv[]) {
         --args.input_size;
     }
 
+    int status = 0;
+    if (args.verify && io61_checksum(inf) != io61_checksum(outf)) {
+        fprintf(stderr, "%s: checksum mismatch (read %08x, wrote %08x)\n",
+                args.program_name, io61_checksum(inf), io61_checksum(outf));
+        status = 1;
+    }
+
     io61_close(inf);
-    io61_close(outf);
-    io61_profile_end();
+    if (args.memory) {
+        io61_profile_end();
+        if (io61_memsave(outf, args.output_file) < 0) {
+            status = 1;
+        }
+    } else {
+        io61_close(outf);
+        io61_profile_end();
+    }
+    return status;
 }
@@ -9,6 +9,11 @@
 #
 #    To add tests of your own, scroll down to the bottom. It should
 #    be relatively clear what to do.
+#
+#    Set IO61_BACKEND to run your code on another io61 backend: buffered
+#    (the default), uring, slow, stdio, mmap, direct, or lz. Prefix a name
+#    with r: or w: to use it only for files read or written, as in
+#    IO61_BACKEND=r:direct,w:uring.
 
 use Time::HiRes qw(gettimeofday);
 use Fcntl qw(F_GETFL F_SETFL O_NONBLOCK);
@@ -71,7 +76,20 @@ sub makefile ($) {
     if (defined($fileinfo{$filename}->[3]) && $fileinfo{$filename}->[3]) {
         $first_offset = " | tail -c +" . $fileinfo{$filename}->[3];
     }
-    if (!-r $filename || !defined(-s $filename) || -s $filename != $size) {
+    if ($filename =~ /sparse/
+        && (!-r $filename || !defined(-s $filename) || -s $filename != $size)) {
+        # 64 KiB of data at the start of every MiB, with holes between
+        open(SRC, "<", "/bin/sh") || die;
+        read(SRC, my $data, 65536);
+        close(SRC);
+        open(SPARSE, ">", $filename) || die;
+        for (my $off = 0; $off < $size; $off += 1 << 20) {
+            seek(SPARSE, $off, 0);
+            print SPARSE $data;
+        }
+        close(SPARSE);
+        truncate($filename, $size);
+    } elsif (!-r $filename || !defined(-s $filename) || -s $filename != $size) {
         while (!defined(-s $filename) || -s $filename < $size) {
             system("$cmd $src$first_offset >> $filename");
             $first_offset = "";
@@ -692,6 +710,7 @@ $fileinfo{"files/text90k-rev.txt"} = [0, 0, 90 << 10, 2 << 10];
 $fileinfo{"files/binary1meg.bin"} = [0, 0, 1 << 20, 3 << 10];
 $fileinfo{"files/text5meg.txt"} = [0, 0, 5 << 20, 4 << 10];
 $fileinfo{"files/text20meg.txt"} = [0, 0, 20 << 20, 5 << 10];
+$fileinfo{"files/sparse8meg.bin"} = [0, 0, 8 << 20, 0];
 
 $SIG{"INT"} = sub {
     kill 9, -$run61_pid if $run61_pid;
@@ -711,6 +730,7 @@ while (@ARGV) {
     shift @ARGV;
 }
 
+print "IO61_BACKEND: ", $ENV{"IO61_BACKEND"}, "\n\n" if nonemptyenv("IO61_BACKEND");
 
 # REGULAR FILES, SEQUENTIAL I/O
 enqueue(1,
@@ -857,6 +877,166 @@ enqueue(31,
     "redirected large file, 1B-4KB block I/O, sequential");
 
 
+# KERNEL-SIDE COPY
+
+enqueue(32,
+    "./cat61 -k -o files/out.txt files/text20meg.txt",
+    "regular large file, io61_copy, sequential");
+
+enqueue(33,
+    "./blockcat61 -k -b 65536 files/text20meg.txt | cat > files/out.txt",
+    "mixed-piped large file, 64KB io61_copy, sequential");
+
+enqueue(34,
+    "cat files/text20meg.txt | ./blockcat61 -k -o files/out.txt",
+    "mixed-piped large file, 4KB io61_copy, sequential");
+
+enqueue(35,
+    "./cat61 -k -s 5242880 -o files/out.txt /dev/zero",
+    "magic zero file, io61_copy, sequential",
+    "insize" => 5242880);
+
+
+
+# LINE I/O
+
+enqueue(36,
+    "./linecat61 -o files/out.txt files/text20meg.txt",
+    "regular large file, line I/O, sequential");
+
+enqueue(37,
+    "./linecat61 -o files/out.bin files/binary1meg.bin",
+    "regular small binary file, line I/O, sequential");
+
+enqueue(38,
+    "cat files/text5meg.txt | ./linecat61 | cat > files/out.txt",
+    "piped medium file, line I/O, sequential");
+
+
+# IO61 BACKENDS
+
+enqueue(39,
+    "IO61_BACKEND=mmap ./reverse61 -o files/out.txt files/text5meg.txt",
+    "regular medium file, mmap backend, character I/O, reverse order");
+
+enqueue(40,
+    "IO61_BACKEND=stdio ./blockcat61 -b 1024 -o files/out.txt files/text5meg.txt",
+    "regular medium file, stdio backend, 1KB block I/O, sequential");
+
+enqueue(41,
+    "IO61_BACKEND=direct ./blockcat61 -o files/out.txt files/text20meg.txt",
+    "regular large file, direct backend, 4KB block I/O, sequential");
+
+enqueue(42,
+    "IO61_BACKEND=w:direct ./blockcat61 -b 5000 -o files/out.txt files/text5meg.txt",
+    "regular medium file, direct writes only, 5000B block I/O, sequential");
+
+
+# PARALLEL COPY
+
+enqueue(43,
+    "IO61_COPY_THREADS=4 ./cat61 -k -o files/out.txt files/text20meg.txt",
+    "regular large file, io61_copy with 4 threads, sequential");
+
+
+# MULTIPLE INPUT FILES
+
+enqueue(44,
+    "./cat61 -o files/out.txt files/text1meg.txt files/text90k-rev.txt files/text5meg.txt files/text90k-rev.txt",
+    "four regular files, character I/O, concatenated");
+
+enqueue(45,
+    "./blockcat61 -b 1000 -o files/out.bin files/text90k-rev.txt files/binary1meg.bin files/text90k-rev.txt",
+    "three regular files, 1000B block I/O, concatenated");
+
+
+# CHECKSUMS
+
+enqueue(46,
+    "./cat61 -c -o files/out.txt files/text5meg.txt",
+    "regular medium file, character I/O, checksummed");
+
+enqueue(47,
+    "./blockcat61 -c -k -b 65536 -o files/out.bin files/binary1meg.bin",
+    "regular small binary file, 65536B io61_copy, checksummed");
+
+
+# COMPRESSED STREAMS
+
+enqueue(48,
+    "IO61_BACKEND=w:lz ./blockcat61 files/text20meg.txt | IO61_BACKEND=r:lz ./cat61 -o files/out.txt",
+    "regular large file, compressed through a pipe and decompressed");
+
+
+# IN-MEMORY FILES
+
+enqueue(49,
+    "./cat61 -m -o files/out.txt files/text5meg.txt",
+    "regular medium file, character I/O, in memory");
+
+enqueue(50,
+    "./blockcat61 -m -b 1000 -o files/out.bin files/text90k-rev.txt files/binary1meg.bin",
+    "two regular files, 1000B block I/O, in memory");
+
+
+# SPARSE FILES
+
+enqueue(51,
+    "./cat61 -k -o files/out.bin files/sparse8meg.bin",
+    "regular sparse file, io61_copy");
+
+enqueue(52,
+    "./blockcat61 -k -b 65536 -o files/out.bin files/sparse8meg.bin",
+    "regular sparse file, 65536B io61_copy");
+
+enqueue(53,
+    "cat files/sparse8meg.bin | IO61_SPARSE=always ./cat61 -k -o files/out.bin",
+    "piped sparse file, io61_copy making holes");
+
+
+# THREADS
+
+enqueue(54,
+    "./logwrite61 -j 4 -b 100 -s 4000000 -o files/out.txt && sort -o files/out.txt files/out.txt",
+    "four threads appending 100B records to one file, sorted",
+    "insize" => 4000000);
+
+
+# READ/WRITE FILES
+
+enqueue(55,
+    "cp files/text5meg.txt files/out.txt && ./rmw61 -b 100 -r 7 files/out.txt",
+    "regular medium file, 100B random updates in place");
+
+enqueue(56,
+    "cp files/text1meg.txt files/out.txt && ./rmw61 -b 20000 -s 4000000 -r 8 files/out.txt",
+    "regular small file, 20000B random updates in place");
+
+
+# BUFFER SIZES
+
+enqueue(57,
+    "IO61_BUFSIZE=1000000 ./reverse61 -o files/out.txt files/text5meg.txt",
+    "regular medium file, 1MB buffers, character I/O, reverse order");
+
+enqueue(58,
+    "IO61_BUFSIZE=4096 IO61_HUGEPAGES=1 ./blockcat61 -b 1000 -o files/out.bin files/text90k-rev.txt files/binary1meg.bin files/text90k-rev.txt",
+    "three regular files, 4KB buffers from huge pages, 1000B block I/O, concatenated");
+
+
+# POSITIONAL WRITES
+
+enqueue(59,
+    "./pwritecat61 -b 100 -o files/out.txt files/text1meg.txt",
+    "regular small file, pieces of 0-100B copied in random order with io61_pwrite");
+
+
+# SEEKS IN COMPRESSED STREAMS
+
+enqueue(60,
+    "IO61_BACKEND=w:lz ./blockcat61 -f -b 10000 -o files/lz\$\$.tmp files/text1meg.txt && IO61_BACKEND=r:lz ./reverse61 -o files/out.txt files/lz\$\$.tmp && rm files/lz\$\$.tmp",
+    "regular small file, compressed in 10000B frames, read in reverse order");
+
 run($sequentially);
 
 summary();
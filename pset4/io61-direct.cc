@@ -0,0 +1,113 @@
+#include "io61-internal.hh"
+#include <sys/stat.h>
+
+// direct backend: O_DIRECT transfers through a second descriptor for the
+// same file, so bulk I/O skips the page cache. Buffers come from the
+// buffer pool. Fills start at the aligned offset at or below `end_tag`;
+// flushes send whole aligned blocks through `dfd` and a run's unaligned
+// head and tail through `fd`.
+
+static constexpr off_t direct_align = 4096;
+static constexpr off_t direct_bufsize = 1 << 20;
+
+bool io61_direct_open(io61_file *f) {
+  struct stat st;
+  if (fstat(f->fd, &st) < 0 || !S_ISREG(st.st_mode) || !f->seekable
+      || (fcntl(f->fd, F_GETFL) & O_APPEND)) {
+    return false;
+  }
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", f->fd);
+  f->dfd = open(path, f->mode | O_DIRECT | O_CLOEXEC);
+  if (f->dfd < 0) {
+    return false;
+  }
+  char *b = io61_pool_get(direct_bufsize);
+  if (!b) {
+    close(f->dfd);
+    f->dfd = -1;
+    return false;
+  }
+  f->cbuf = b;
+  f->bufcap = direct_bufsize;
+  return true;
+}
+
+ssize_t io61_direct_fill(io61_file *f) {
+  if (io61_scattered(f)) {
+    // scattered reads would each go to the disk; the page cache serves
+    // them, one block at a time, as in the buffered backend
+    return io61_timed(f->stats, S_PREAD, [&] {
+      return pread(f->fd, f->cbuf, f->blksize, f->end_tag);
+    });
+  }
+  off_t off = f->end_tag - f->end_tag % direct_align;
+  ssize_t n = io61_timed(f->stats, S_PREAD, [&] {
+    return pread(f->dfd, f->cbuf, f->bufcap, off);
+  });
+  if (n >= 0) {
+    f->beg_tag = off;
+  }
+  return n;
+}
+
+// io61_direct_write(f, fd, buf, len, off)
+//    Write all `len` bytes at `buf` to offset `off`, through `fd`. If the
+//    file system refuses an O_DIRECT write, the page cache takes it.
+
+static int io61_direct_write(io61_file *f, int fd, const char *buf,
+                             size_t len, off_t off) {
+  while (len > 0) {
+    ssize_t n = io61_timed(f->stats, S_PWRITE,
+                           [&] { return pwrite(fd, buf, len, off); });
+    if (n < 0 && errno == EINVAL && fd == f->dfd) {
+      fd = f->fd;
+      continue;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+int io61_direct_flush(io61_file *f, bool wait) {
+  off_t off = f->beg_tag;
+  size_t len = f->pos_tag - off;
+  int r = 0;
+  // the head, up to the first aligned offset, goes through the page
+  // cache; the rest moves down so that it starts on an aligned address
+  size_t head = std::min<size_t>(len, -off & (direct_align - 1));
+  if (head) {
+    r |= io61_direct_write(f, f->fd, f->cbuf, head, off);
+    memmove(f->cbuf, f->cbuf + head, len - head);
+    off += head;
+    len -= head;
+  }
+  size_t body = len - len % direct_align;
+  if (body) {
+    r |= io61_direct_write(f, f->dfd, f->cbuf, body, off);
+  }
+  // the tail waits for the rest of its block unless this is a real flush
+  size_t tail = len - body;
+  if (tail && wait) {
+    r |= io61_direct_write(f, f->fd, f->cbuf + body, tail, off + body);
+  } else if (tail) {
+    memmove(f->cbuf, f->cbuf + body, tail);
+    f->beg_tag = off + body;
+    f->end_tag = f->pos_tag;
+    return r;
+  }
+  f->beg_tag = f->end_tag = f->pos_tag;
+  return r;
+}
+
+int io61_direct_close(io61_file *f) {
+  io61_pool_put(f->cbuf, direct_bufsize);
+  close(f->dfd);
+  return io61_fd_close(f);
+}
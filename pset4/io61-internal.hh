@@ -0,0 +1,299 @@
+#ifndef IO61_INTERNAL_HH
+#define IO61_INTERNAL_HH
+#include "io61.hh"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sys/types.h>
+
+// io61-internal.hh
+//    Definitions shared by io61.cc, which implements the io61 interface,
+//    and the backends in io61-*.cc, which move data between an io61_file's
+//    buffer and the kernel.
+
+// access patterns recognized by io61_observe
+enum io61_pattern { P_SEQUENTIAL, P_REVERSE, P_STRIDED, P_RANDOM };
+
+// io61_stats
+//    Per-file I/O counters, reported by io61_close in the profile record
+//    on fd 100. `hist[c][i]` counts calls of type `c` that took between
+//    2^i and 2^(i+1) nanoseconds.
+
+enum io61_syscall {
+  S_READ, S_PREAD, S_READV, S_PREADV, S_WRITE, S_PWRITE, S_WRITEV,
+  S_PWRITEV, S_COPY_FILE_RANGE, S_SENDFILE, S_SPLICE, // return byte counts
+  S_URING, S_LSEEK, S_FADVISE, S_FALLOCATE, S_FTRUNCATE, NSYSCALLS
+};
+
+struct io61_stats {
+  static constexpr int nbuckets = 32;
+  unsigned long calls[NSYSCALLS] = {};
+  unsigned long long bytes[NSYSCALLS] = {};
+  unsigned long hist[NSYSCALLS][nbuckets] = {};
+  unsigned long refills = 0;  // buffer fills and drains
+  unsigned long seeks = 0;
+  unsigned long flushes = 0;
+  unsigned long long lz_data = 0;   // lz backend: bytes before compression
+  unsigned long long lz_stream = 0; // and after
+  unsigned long long holes = 0;     // bytes io61_copy left as holes
+
+  void record(io61_syscall c, long long r, unsigned long long ns) {
+    ++calls[c];
+    if (c < S_URING && r > 0) {
+      bytes[c] += r;
+    }
+    int b = ns ? 63 - __builtin_clzll(ns) : 0;
+    ++hist[c][std::min(b, nbuckets - 1)];
+  }
+  void merge(const io61_stats &st) {
+    for (int c = 0; c != NSYSCALLS; ++c) {
+      calls[c] += st.calls[c];
+      bytes[c] += st.bytes[c];
+      for (int b = 0; b != nbuckets; ++b) {
+        hist[c][b] += st.hist[c][b];
+      }
+    }
+  }
+};
+
+// io61_timed(st, c, call)
+//    Run `call`, a system call of type `c`, and record it in `st`.
+
+template <typename T>
+auto io61_timed(io61_stats &st, io61_syscall c, T call) {
+  timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  auto r = call();
+  int saved_errno = errno;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  st.record(c, r, (t1.tv_sec - t0.tv_sec) * 1000000000ULL
+                      + t1.tv_nsec - t0.tv_nsec);
+  errno = saved_errno;
+  return r;
+}
+
+// io61_pool_get(sz), io61_pool_put(b, sz)
+//    The buffer pool of io61.cc, which backends with buffers of their own
+//    draw from too.
+
+char *io61_pool_get(size_t sz);
+void io61_pool_put(char *b, size_t sz);
+
+struct io61_async;
+struct io61_append;
+struct io61_uring;
+struct io61_inputs;
+struct io61_lz;
+struct io61_rdwr;
+struct io61_trace;
+struct io61_backend;
+
+// io61_file
+//    Data structure for io61 file wrappers. Add your own stuff. The
+//    buffer window (`cbuf`, the tags and `bufcap`) lives in the
+//    io61_fastpath base so the inline functions in io61.hh can reach it.
+struct io61_file : io61_fastpath {
+  int fd;
+  int mode;
+  static constexpr int prefetch_depth = 4; // buffers hinted ahead of a fill
+  char *buf = nullptr; // from the buffer pool, so aligned for O_DIRECT
+  off_t bufsize;       // bytes in `buf`, chosen by io61_bufsize
+  off_t blksize;       // bytes a scattered fill reads
+  bool seekable;
+  off_t tag;
+
+  // seek history for access-pattern detection
+  off_t seek_tag;   // position of the last seek
+  off_t span;       // bytes read after the seek before that
+  off_t delta;      // distance between the last two seeks
+  int streak;       // number of consecutive seeks that moved by `delta`
+  int misses;       // number of consecutive seeks that broke the streak
+  io61_pattern pattern;
+  bool advised;     // whether the pattern was passed to posix_fadvise
+  off_t hint_tag;   // edge of the bytes hinted as needed soon: their end
+                    // for strided readers, their start for reverse ones
+
+  // write-back cache of dirty extents, keyed by file offset
+  static constexpr size_t extent_overhead = 64; // bytes charged per extent
+  bool positional;  // whether writes may go to any offset with pwrite
+  std::map<off_t, std::vector<char>> dirty;
+  size_t dirty_bytes;
+  size_t dirty_limit;
+
+  // background worker for streaming I/O, if $IO61_ASYNC asks for one
+  std::shared_ptr<io61_async> async;
+  // io_uring submission state, if $IO61_BACKEND is "uring"
+  io61_uring *uring;
+
+  // holds io61_readline lines that span a refill
+  std::vector<char> line;
+
+  // block cache for small io61_pread calls, allocated on first use
+  std::unique_ptr<char[]> pbuf;
+  off_t pbuf_tag;   // file offset of `pbuf`
+  off_t pbuf_end;   // end of valid data in `pbuf`
+
+  // io61_copy left the bytes before `hole_end` as a hole; the file is
+  // extended to cover them when it is next flushed or seeked
+  off_t hole_end = 0;
+
+  // stream mode (io61_stream) for pipes and sockets
+  bool stream = false;
+  int stream_timeout = -1;  // milliseconds a read waits; -1 for ever
+  size_t flush_size = 0;    // writers flush at this many bytes, if set,
+  long long flush_ns = -1;  // or when the oldest is this old, if >= 0
+  long long pending_ns = 0; // when the oldest buffered byte was written
+
+  io61_stats stats;
+
+  // sharing between threads: `lock` guards the file, except that
+  // positional reads of read-only files take no lock and count
+  // themselves in `pread_shards`, and that once `append` is set, writes
+  // reserve space in its buffer instead
+  std::recursive_mutex lock;
+  std::atomic<bool> appendable{false}; // whether `append` may be set
+  std::atomic<io61_append *> append{nullptr};
+  struct alignas(64) pread_shard {
+    std::atomic<unsigned long> requests{0};
+    std::atomic<unsigned long> calls{0};
+    std::atomic<unsigned long long> bytes{0};
+  };
+  static constexpr int npread_shards = 16;
+  pread_shard pread_shards[npread_shards];
+
+  // running CRC32C of the bytes read or written, if enabled; bytes
+  // before `crc_tag` are already in `crc`
+  bool crc_on = false;
+  uint32_t crc = 0;
+  off_t crc_tag;
+
+  // how data moves between `cbuf` and the kernel; the pointers are
+  // copied from `backend` so that a buffer miss costs one indirect call
+  const io61_backend *backend;
+  ssize_t (*fill)(io61_file *f);
+  int (*flush)(io61_file *f, bool wait);
+  off_t (*seek)(io61_file *f, off_t pos);
+  int (*close)(io61_file *f);
+  FILE *stdio = nullptr;  // stdio backend
+  char *map = nullptr;    // mmap backend
+  size_t map_size = 0;
+  off_t map_end = 0;      // mmap writers: end of the bytes written,
+  off_t map_min = 0;      // and the size the file had when mapped
+  int dfd = -1;           // direct backend: `fd` reopened with O_DIRECT
+  std::shared_ptr<io61_inputs> inputs; // concat backend
+  io61_lz *lz = nullptr;  // lz backend
+  bool memory = false;    // mem backend
+  char *mem_data = nullptr;
+  size_t mem_size = 0;
+  size_t mem_cap = 0;
+  io61_rdwr *rdwr = nullptr; // rdwr backend
+
+  io61_trace *trace = nullptr; // access trace, if $IO61_TRACE names one
+
+  ~io61_file() {
+    if (buf) {
+      io61_pool_put(buf, bufsize);
+    }
+  }
+};
+IO61_CHECK_FASTPATH(io61_file);
+
+// io61_backend
+//    How an io61_file moves data between its buffer and the kernel.
+//    `open` prepares a new file and returns false if the file cannot use
+//    the backend. `fill` reads into `cbuf` at `end_tag` and returns the
+//    number of bytes read, or -1; it may move `beg_tag` back, for
+//    instance to an aligned offset. `flush` writes [`beg_tag`, `pos_tag`)
+//    and empties the buffer; unless `wait` is true, the bytes may still
+//    be on their way to the kernel, or a partial block may stay behind
+//    in the buffer with `beg_tag` moved up to it. `seek` moves the file
+//    offset to `pos` and returns it, or -1. `close` releases the backend
+//    and the file descriptor.
+
+struct io61_backend {
+  const char *name;
+  bool (*open)(io61_file *f);
+  ssize_t (*fill)(io61_file *f);
+  int (*flush)(io61_file *f, bool wait);
+  off_t (*seek)(io61_file *f, off_t pos);
+  int (*close)(io61_file *f);
+  bool passthrough; // large transfers may skip the buffer and use `fd`
+};
+
+// io61_run
+//    A run of adjacent write-back cache extents, written by io61_writeback
+//    with a single `pwritev`.
+
+struct io61_run {
+  off_t off;
+  size_t len = 0;
+  std::vector<struct iovec> iov;
+};
+
+// helpers in io61.cc that backends share
+off_t io61_offset_seek(io61_file *f, off_t pos);
+int io61_fd_close(io61_file *f);
+int io61_buffered_flush(io61_file *f, bool wait);
+void io61_iov_skip(struct iovec *&iov, int &niov, size_t n);
+int io61_pwritev_all(io61_file *f, struct iovec *iov, int niov, off_t off);
+void io61_crc_fold(io61_file *f);
+bool io61_scattered(io61_file *f);
+
+// io61-uring.cc
+bool io61_uring_open(io61_file *f);
+ssize_t io61_uring_fill(io61_file *f);
+int io61_uring_give(io61_file *f, bool wait);
+int io61_uring_close(io61_file *f);
+void io61_uring_writeback(io61_file *f, io61_run *runs, size_t nruns,
+                          ssize_t *res);
+
+// io61-mmap.cc
+bool io61_mmap_open(io61_file *f);
+ssize_t io61_mmap_fill(io61_file *f);
+int io61_mmap_flush(io61_file *f, bool wait);
+off_t io61_mmap_seek(io61_file *f, off_t pos);
+int io61_mmap_close(io61_file *f);
+bool io61_mmap_start(io61_file *f, off_t size);
+int io61_mmap_reserve(io61_file *f, off_t size);
+
+// io61-direct.cc
+bool io61_direct_open(io61_file *f);
+ssize_t io61_direct_fill(io61_file *f);
+int io61_direct_flush(io61_file *f, bool wait);
+int io61_direct_close(io61_file *f);
+
+// io61-lz.cc
+bool io61_lz_open(io61_file *f);
+ssize_t io61_lz_fill(io61_file *f);
+int io61_lz_flush(io61_file *f, bool wait);
+off_t io61_lz_seek(io61_file *f, off_t pos);
+int io61_lz_close(io61_file *f);
+off_t io61_lz_size(io61_file *f);
+ssize_t io61_lz_pread(io61_file *f, char *buf, size_t sz, off_t off);
+
+// io61-mem.cc
+bool io61_mem_open(io61_file *f);
+ssize_t io61_mem_fill(io61_file *f);
+int io61_mem_flush(io61_file *f, bool wait);
+off_t io61_mem_seek(io61_file *f, off_t pos);
+int io61_mem_close(io61_file *f);
+int io61_mem_reserve(io61_file *f, size_t n);
+int io61_mem_trim(io61_file *f);
+void io61_mem_window(io61_file *f, off_t pos);
+size_t io61_mem_size(io61_file *f);
+
+// io61-rdwr.cc
+bool io61_rdwr_open(io61_file *f);
+ssize_t io61_rdwr_fill(io61_file *f);
+int io61_rdwr_flush(io61_file *f, bool wait);
+int io61_rdwr_close(io61_file *f);
+off_t io61_rdwr_size(io61_file *f);
+ssize_t io61_rdwr_io(io61_file *f, char *buf, size_t sz, off_t off,
+                     bool writing);
+ssize_t io61_rdwr_write(io61_file *f, const char *buf, size_t sz);
+
+#endif
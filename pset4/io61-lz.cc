@@ -0,0 +1,524 @@
+#include "io61-internal.hh"
+#include <climits>
+#include <endian.h>
+#include <sys/stat.h>
+#include <utility>
+
+// lz backend: a compressed stream. Writes are cut into blocks of up to
+// `io61_lz::block` bytes, and each block is LZ-compressed into a frame;
+// reads undo it. Tags count uncompressed bytes. A trailer indexes the
+// frames so that readers of seekable files can seek. Input that does
+// not start with the stream's magic number is read as is.
+//
+// Stream layout: the magic number, then frames, each an 8-byte header
+// (uncompressed length, stored length; equal lengths mean the block is
+// stored uncompressed) and the stored bytes, then an empty frame, then
+// the index: one (data offset, stream offset) pair of 64-bit numbers
+// per frame, the frame count, the data size, and a second magic number.
+// All numbers are little-endian, whatever the host's byte order.
+//
+// Readers decompress into a small cache of blocks. Until the first seek
+// they reuse one block; after it, the least recently used.
+
+struct io61_lz {
+  static constexpr size_t block = 64 << 10;
+  static constexpr size_t trailer = 24;
+  static constexpr int cache_size = 32;
+  static constexpr char magic[9] = "IO61LZ01";
+  static constexpr char index_magic[9] = "IO61LZIX";
+
+  std::unique_ptr<char[]> data;   // writers' and plain readers' buffer
+  std::unique_ptr<char[]> stream; // magic, header and stored block
+  std::vector<std::pair<off_t, off_t>> index; // one entry per frame
+  off_t next = 0;       // stream offset of the next frame
+  off_t data_next = 0;  // data offset of the next frame
+  off_t fd_pos = 0;     // file offset of `fd`
+  off_t size = -1;      // data size, if the index was read
+  off_t end_frame = 0;  // stream offset of the empty frame, if so
+  char header[8];       // next frame header, if `have_header`
+  bool have_header = false;
+  bool plain = false;   // the input is not an lz stream
+  size_t npending = 0;  // `plain` bytes read while checking the magic
+
+  struct cached {
+    std::unique_ptr<char[]> buf;
+    off_t data_off = -1;  // data offset of the block
+    off_t next = 0;       // stream offset of the frame after it
+    size_t len = 0;
+    unsigned long used = 0;
+  };
+  cached cache[cache_size];
+  unsigned long clock = 0;
+  bool seeked = false;
+};
+
+// io61_lz_get32(p), io61_lz_get64(p), io61_lz_put32(p, x), io61_lz_put64(p, x)
+//    Read or write a little-endian number of the stream layout at `p`.
+
+static uint32_t io61_lz_get32(const char *p) {
+  uint32_t x;
+  memcpy(&x, p, 4);
+  return le32toh(x);
+}
+
+static uint64_t io61_lz_get64(const char *p) {
+  uint64_t x;
+  memcpy(&x, p, 8);
+  return le64toh(x);
+}
+
+static void io61_lz_put32(char *p, uint32_t x) {
+  x = htole32(x);
+  memcpy(p, &x, 4);
+}
+
+static void io61_lz_put64(char *p, uint64_t x) {
+  x = htole64(x);
+  memcpy(p, &x, 8);
+}
+
+// io61_lz_bound(n)
+//    Return the most bytes that io61_lz_compress can produce from `n`.
+
+static size_t io61_lz_bound(size_t n) {
+  return n + n / 255 + 16;
+}
+
+// io61_lz_length(op, len)
+//    Append the extra length bytes for a count of 15 + `len` to `op`.
+
+static unsigned char *io61_lz_length(unsigned char *op, size_t len) {
+  for (; len >= 255; len -= 255) {
+    *op++ = 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+// io61_lz_compress(dst, src, n)
+//    Compress the `n` bytes at `src`, at most 64 KiB, into `dst`, which
+//    has room for io61_lz_bound(n) bytes, and return the compressed
+//    length. The format is LZ4's block format: a sequence of commands,
+//    each a token byte whose high nibble counts literals and whose low
+//    nibble is the match length minus 4 (15 means more length bytes
+//    follow, each adding up to 255), the literals, and a 2-byte
+//    little-endian match offset. The last command has literals only.
+//    Matches are found greedily through a hash table of 4-byte strings;
+//    the search takes longer strides through input that keeps missing.
+
+static size_t io61_lz_compress(char *dst, const char *src, size_t n) {
+  constexpr int hash_bits = 13;
+  assert(n <= 65536);
+  uint16_t table[1 << hash_bits] = {};
+  auto hash = [](uint32_t v) { return (v * 2654435761U) >> (32 - hash_bits); };
+  auto op = reinterpret_cast<unsigned char *>(dst);
+  size_t p = 0, lit = 0;
+  while (p + 4 <= n) {
+    uint32_t v, cv;
+    memcpy(&v, src + p, 4);
+    uint32_t h = hash(v);
+    size_t cand = table[h];
+    table[h] = p;
+    if (cand >= p || (memcpy(&cv, src + cand, 4), cv != v)) {
+      p += 1 + ((p - lit) >> 6);
+      continue;
+    }
+    size_t len = 4;
+    while (p + len + 8 <= n) {
+      uint64_t a, b;
+      memcpy(&a, src + cand + len, 8);
+      memcpy(&b, src + p + len, 8);
+      if (a != b) {
+        // the first differing byte is the lowest in little-endian order
+        len += __builtin_ctzll(le64toh(a ^ b)) >> 3;
+        break;
+      }
+      len += 8;
+    }
+    if (p + len + 8 > n) {
+      while (p + len < n && src[cand + len] == src[p + len]) {
+        ++len;
+      }
+    }
+    size_t nlit = p - lit, off = p - cand;
+    *op++ = std::min(nlit, (size_t)15) << 4 | std::min(len - 4, (size_t)15);
+    if (nlit >= 15) {
+      op = io61_lz_length(op, nlit - 15);
+    }
+    memcpy(op, src + lit, nlit);
+    op += nlit;
+    *op++ = off & 255;
+    *op++ = off >> 8;
+    if (len - 4 >= 15) {
+      op = io61_lz_length(op, len - 4 - 15);
+    }
+    p += len;
+    lit = p;
+  }
+  size_t nlit = n - lit;
+  *op++ = std::min(nlit, (size_t)15) << 4;
+  if (nlit >= 15) {
+    op = io61_lz_length(op, nlit - 15);
+  }
+  memcpy(op, src + lit, nlit);
+  return op + nlit - reinterpret_cast<unsigned char *>(dst);
+}
+
+// io61_lz_decompress(dst, cap, src, n)
+//    Decompress the `n` bytes at `src` into `dst`, which has room for
+//    `cap` bytes. Returns the decompressed length, or -1 if `src` is not
+//    valid compressed data that fits.
+
+static ssize_t io61_lz_decompress(char *dst, size_t cap, const char *src,
+                                  size_t n) {
+  auto ip = reinterpret_cast<const unsigned char *>(src), iend = ip + n;
+  char *op = dst, *oend = dst + cap;
+  auto length = [&](size_t &len) {
+    unsigned b = 255;
+    while (b == 255 && ip != iend) {
+      b = *ip++;
+      len += b;
+    }
+    return b != 255;
+  };
+  while (ip != iend) {
+    unsigned token = *ip++;
+    size_t len = token >> 4;
+    if ((len == 15 && !length(len)) || len > size_t(iend - ip)
+        || len > size_t(oend - op)) {
+      return -1;
+    }
+    if (len + 16 <= size_t(iend - ip) && len + 16 <= size_t(oend - op)) {
+      // room to copy in 16-byte pieces, overrunning by up to 15 bytes
+      for (size_t i = 0; i < len; i += 16) {
+        memcpy(op + i, ip + i, 16);
+      }
+    } else {
+      memcpy(op, ip, len);
+    }
+    op += len;
+    ip += len;
+    if (ip == iend) {
+      break;
+    } else if (iend - ip < 2) {
+      return -1;
+    }
+    size_t off = ip[0] | ip[1] << 8;
+    ip += 2;
+    len = (token & 15) + 4;
+    if ((len == 19 && !length(len)) || off == 0
+        || off > size_t(op - dst) || len > size_t(oend - op)) {
+      return -1;
+    }
+    const char *m = op - off;
+    if (off >= 16 && len + 16 <= size_t(oend - op)) {
+      for (size_t i = 0; i < len; i += 16) {
+        memcpy(op + i, m + i, 16);
+      }
+    } else if (off >= len) {
+      memcpy(op, m, len);
+    } else {
+      for (size_t i = 0; i != len; ++i) {
+        op[i] = m[i];
+      }
+    }
+    op += len;
+  }
+  return op - dst;
+}
+
+// io61_lz_io(f, buf, n, writing)
+//    Read or write `n` bytes of the stream of `f` at its file offset,
+//    retrying short transfers. Returns the number of bytes transferred,
+//    which is short only at end of file, or -1 on error.
+
+static ssize_t io61_lz_io(io61_file *f, char *buf, size_t n, bool writing) {
+  size_t done = 0;
+  while (done != n) {
+    ssize_t r;
+    if (writing) {
+      r = io61_timed(f->stats, S_WRITE,
+                     [&] { return write(f->fd, buf + done, n - done); });
+    } else {
+      r = io61_timed(f->stats, S_READ,
+                     [&] { return read(f->fd, buf + done, n - done); });
+    }
+    if (r < 0 && errno == EINTR) {
+      continue;
+    } else if (r < 0) {
+      return -1;
+    } else if (r == 0) {
+      break;
+    }
+    done += r;
+  }
+  return done;
+}
+
+// io61_lz_load_index(f)
+//    Read the trailer and index of the seekable lz stream `f`. Streams
+//    without a valid one, such as those whose writer did not close
+//    them, can still be read, but not seeked. A valid index starts at
+//    data offset 0, and its data and stream offsets increase and stay
+//    below the data size and the empty frame.
+
+static void io61_lz_load_index(io61_file *f) {
+  io61_lz &z = *f->lz;
+  struct stat st;
+  char t[io61_lz::trailer];
+  if (fstat(f->fd, &st) < 0 || st.st_size < (off_t)(16 + sizeof(t))
+      || pread(f->fd, t, sizeof(t), st.st_size - sizeof(t))
+             != (ssize_t)sizeof(t)
+      || memcmp(t + 16, io61_lz::index_magic, 8) != 0) {
+    return;
+  }
+  uint64_t nframes = io61_lz_get64(t), size = io61_lz_get64(t + 8);
+  off_t index_off = st.st_size - sizeof(t) - nframes * 16;
+  if (nframes > (uint64_t)st.st_size / 16 || index_off < 16
+      || size > (uint64_t)LLONG_MAX) {
+    return;
+  }
+  std::vector<char> v(nframes * 16);
+  if (nframes != 0
+      && pread(f->fd, v.data(), nframes * 16, index_off)
+             != (ssize_t)(nframes * 16)) {
+    return;
+  }
+  std::vector<std::pair<off_t, off_t>> index;
+  for (size_t i = 0; i != nframes; ++i) {
+    uint64_t data_off = io61_lz_get64(&v[16 * i]);
+    uint64_t stream_off = io61_lz_get64(&v[16 * i + 8]);
+    if (data_off >= size || stream_off < 8
+        || stream_off >= (uint64_t)index_off - 8
+        || (i == 0 ? data_off != 0
+                   : data_off <= (uint64_t)index.back().first
+                         || stream_off <= (uint64_t)index.back().second)) {
+      return;
+    }
+    index.emplace_back(data_off, stream_off);
+  }
+  z.index = std::move(index);
+  z.size = size;
+  z.end_frame = index_off - 8;
+}
+
+bool io61_lz_open(io61_file *f) {
+  // streams start with their magic number at offset 0
+  if (f->seekable && f->beg_tag != 0) {
+    return false;
+  }
+  f->lz = new io61_lz;
+  io61_lz &z = *f->lz;
+  z.data.reset(new char[io61_lz::block]);
+  z.stream.reset(new char[16 + io61_lz_bound(io61_lz::block)]);
+  if (f->mode == O_RDONLY) {
+    ssize_t n = io61_lz_io(f, z.stream.get(), 8, false);
+    if (n == 8 && memcmp(z.stream.get(), io61_lz::magic, 8) == 0) {
+      z.next = z.fd_pos = 8;
+      if (f->seekable) {
+        io61_lz_load_index(f);
+      }
+    } else if (f->seekable) {
+      io61_timed(f->stats, S_LSEEK, [&] { return lseek(f->fd, 0, SEEK_SET); });
+      delete f->lz;
+      f->lz = nullptr;
+      return false;
+    } else {
+      z.plain = true;
+      z.npending = std::max(n, (ssize_t)0);
+    }
+  }
+  f->positional = false;
+  f->cbuf = z.data.get();
+  f->bufcap = io61_lz::block;
+  return true;
+}
+
+ssize_t io61_lz_fill(io61_file *f) {
+  io61_lz &z = *f->lz;
+  if (z.plain && z.npending) {
+    memcpy(f->cbuf, z.stream.get(), z.npending);
+    return std::exchange(z.npending, 0);
+  } else if (z.plain) {
+    return io61_timed(f->stats, S_READ,
+                      [&] { return read(f->fd, f->cbuf, f->bufcap); });
+  }
+  f->beg_tag = z.data_next;
+  io61_lz::cached *c = &z.cache[0];
+  for (auto &x : z.cache) {
+    if (x.data_off == z.data_next && x.buf) {
+      // a cached block: the next frame's header is not at hand
+      x.used = ++z.clock;
+      f->cbuf = x.buf.get();
+      z.next = x.next;
+      z.data_next += x.len;
+      z.have_header = false;
+      return x.len;
+    } else if (z.seeked && (!x.buf || x.used < c->used)) {
+      c = &x;
+    }
+  }
+  if (z.fd_pos != z.next + (z.have_header ? 8 : 0)) {
+    if (io61_timed(f->stats, S_LSEEK, [&] {
+          return lseek(f->fd, z.next, SEEK_SET);
+        }) < 0) {
+      return -1;
+    }
+    z.fd_pos = z.next;
+    z.have_header = false;
+  }
+  if (!z.have_header) {
+    ssize_t n = io61_lz_io(f, z.header, 8, false);
+    z.fd_pos += std::max(n, (ssize_t)0);
+    if (n <= 0) {
+      return n;
+    } else if (n != 8) {
+      errno = EINVAL;
+      return -1;
+    }
+    z.have_header = true;
+  }
+  size_t len = io61_lz_get32(z.header),
+         stored = io61_lz_get32(z.header + 4);
+  if (len == 0) {
+    return 0;
+  } else if (len > io61_lz::block || stored > io61_lz_bound(len)) {
+    errno = EINVAL;
+    return -1;
+  }
+  // read the next frame's header along with this frame
+  char *s = z.stream.get();
+  ssize_t n = io61_lz_io(f, s, stored + 8, false);
+  z.fd_pos += std::max(n, (ssize_t)0);
+  if (n < (ssize_t)stored) {
+    errno = n < 0 ? errno : EINVAL;
+    return -1;
+  }
+  z.have_header = n == (ssize_t)stored + 8;
+  memcpy(z.header, s + stored, z.have_header ? 8 : 0);
+  if (!c->buf) {
+    c->buf.reset(new char[io61_lz::block]);
+  }
+  c->data_off = -1;
+  if (stored == len) {
+    memcpy(c->buf.get(), s, len);
+  } else if (io61_lz_decompress(c->buf.get(), len, s, stored)
+             != (ssize_t)len) {
+    errno = EINVAL;
+    return -1;
+  }
+  z.next += 8 + stored;
+  *c = {std::move(c->buf), z.data_next, z.next, len, ++z.clock};
+  f->cbuf = c->buf.get();
+  z.data_next += len;
+  f->stats.lz_data += len;
+  f->stats.lz_stream += 8 + stored;
+  return len;
+}
+
+int io61_lz_flush(io61_file *f, bool wait) {
+  (void)wait;
+  io61_lz &z = *f->lz;
+  size_t len = f->pos_tag - f->beg_tag;
+  f->beg_tag = f->end_tag = f->pos_tag;
+  if (len == 0) {
+    return 0;
+  }
+  // the first frame carries the stream's magic number
+  char *s = z.stream.get();
+  size_t stored = io61_lz_compress(s + 16, f->cbuf, len);
+  if (stored >= len) {
+    stored = len;
+    memcpy(s + 16, f->cbuf, len);
+  }
+  io61_lz_put32(s + 8, len);
+  io61_lz_put32(s + 12, stored);
+  size_t start = z.next == 0 ? 0 : 8;
+  memcpy(s, io61_lz::magic, 8);
+  z.next = std::max(z.next, (off_t)8);
+  z.index.emplace_back(z.data_next, z.next);
+  ssize_t n = io61_lz_io(f, s + start, 16 + stored - start, true);
+  z.next += 8 + stored;
+  z.data_next += len;
+  f->stats.lz_data += len;
+  f->stats.lz_stream += 16 + stored - start;
+  return n == (ssize_t)(16 + stored - start) ? 0 : -1;
+}
+
+off_t io61_lz_seek(io61_file *f, off_t pos) {
+  io61_lz &z = *f->lz;
+  if (f->mode != O_RDONLY || z.size < 0) {
+    // writers, and readers without an index, can only stay put
+    if (pos == z.data_next) {
+      return pos;
+    }
+    errno = ESPIPE;
+    return -1;
+  }
+  auto it = std::upper_bound(z.index.begin(), z.index.end(),
+                             std::make_pair(pos, (off_t)LLONG_MAX));
+  off_t data_off = z.size, stream_off = z.end_frame;
+  if (pos < z.size && it != z.index.begin()) {
+    data_off = std::prev(it)->first;
+    stream_off = std::prev(it)->second;
+  }
+  // io61_lz_fill moves the descriptor if it has to read
+  z.next = stream_off;
+  z.data_next = data_off;
+  z.seeked = true;
+  return pos;
+}
+
+int io61_lz_close(io61_file *f) {
+  io61_lz &z = *f->lz;
+  int r = 0;
+  if (f->mode != O_RDONLY) {
+    std::vector<char> t;
+    if (z.next == 0) {
+      t.insert(t.end(), io61_lz::magic, io61_lz::magic + 8);
+    }
+    t.resize(t.size() + 8); // the empty frame
+    size_t pos = t.size();
+    t.resize(pos + z.index.size() * 16 + 16);
+    for (auto &e : z.index) {
+      io61_lz_put64(&t[pos], e.first);
+      io61_lz_put64(&t[pos + 8], e.second);
+      pos += 16;
+    }
+    io61_lz_put64(&t[pos], z.index.size());
+    io61_lz_put64(&t[pos + 8], z.data_next);
+    t.insert(t.end(), io61_lz::index_magic, io61_lz::index_magic + 8);
+    if (io61_lz_io(f, t.data(), t.size(), true) != (ssize_t)t.size()) {
+      r = -1;
+    }
+    f->stats.lz_stream += t.size();
+  }
+  delete f->lz;
+  f->lz = nullptr;
+  return close(f->fd) | r;
+}
+
+// io61_lz_size(f)
+//    Return the uncompressed size of lz file `f`, or -1 if its index was
+//    not read.
+
+off_t io61_lz_size(io61_file *f) {
+  return f->lz->size;
+}
+
+// io61_lz_pread(f, buf, sz, off)
+//    io61_pread for lz files, whose bytes must be decompressed: seek to
+//    each block and copy from the buffer, then seek back.
+
+ssize_t io61_lz_pread(io61_file *f, char *buf, size_t sz, off_t off) {
+  off_t pos = f->pos_tag;
+  size_t nread = 0;
+  while (nread != sz && io61_seek(f, off + nread) == 0
+         && f->pos_tag < f->end_tag) {
+    size_t len = std::min(sz - nread, (size_t)(f->end_tag - f->pos_tag));
+    memcpy(buf + nread, &f->cbuf[f->pos_tag - f->beg_tag], len);
+    nread += len;
+  }
+  io61_seek(f, pos);
+  return nread;
+}
@@ -0,0 +1,141 @@
+#include "io61-internal.hh"
+#include <sys/mman.h>
+
+// mem backend: the file is memory, `mem_size` bytes at `mem_data`, with
+// room for `mem_cap`. The memory is the heap, or a shared mapping of a
+// memfd in `fd` so that other processes can open the file. Readers fill
+// once, with the whole file, like mmap. Writers write in place: the
+// buffer is a window on the memory from `pos_tag` to `mem_cap`, and a
+// flush only records the new size. At the end of the memory the
+// window moves to the file's own buffer, and the next flush copies
+// that buffer into memory grown to fit it.
+
+// io61_mem_reserve(f, n)
+//    Make room for at least `n` bytes in the memory of `f`, growing it
+//    geometrically. New memory is zero, so seeks past the end leave
+//    holes of zeros. Returns 0, or -1 if the memory cannot grow.
+
+int io61_mem_reserve(io61_file *f, size_t n) {
+  if (n <= f->mem_cap) {
+    return 0;
+  }
+  size_t cap = std::max({n, 2 * f->mem_cap, (size_t)f->bufsize});
+  void *p;
+  if (f->fd < 0) {
+    p = realloc(f->mem_data, cap);
+    if (!p) {
+      return -1;
+    }
+    memset((char *)p + f->mem_cap, 0, cap - f->mem_cap);
+  } else if (ftruncate(f->fd, cap) < 0) {
+    return -1;
+  } else if (f->mem_cap) {
+    p = mremap(f->mem_data, f->mem_cap, cap, MREMAP_MAYMOVE);
+  } else {
+    p = mmap(nullptr, cap, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, 0);
+  }
+  if (p == MAP_FAILED) {
+    return -1;
+  }
+  f->mem_data = (char *)p;
+  f->mem_cap = cap;
+  return 0;
+}
+
+// io61_mem_trim(f)
+//    Shrink the memfd of `f` to the file's size, so that other processes
+//    see exactly its bytes.
+
+int io61_mem_trim(io61_file *f) {
+  if (f->fd < 0 || f->mem_cap == f->mem_size) {
+    return 0;
+  } else if (f->mem_size == 0) {
+    munmap(f->mem_data, f->mem_cap);
+    f->mem_data = nullptr;
+  } else {
+    void *p = mremap(f->mem_data, f->mem_cap, f->mem_size, 0);
+    if (p == MAP_FAILED) {
+      return -1;
+    }
+  }
+  f->mem_cap = f->mem_size;
+  return ftruncate(f->fd, f->mem_size);
+}
+
+// io61_mem_window(f, pos)
+//    Point the write buffer of `f` at position `pos` in its memory, or
+//    at its own buffer if `pos` is past the memory's end.
+
+void io61_mem_window(io61_file *f, off_t pos) {
+  if ((size_t)pos < f->mem_cap) {
+    f->cbuf = f->mem_data + pos;
+    f->bufcap = f->mem_cap - pos;
+  } else {
+    f->cbuf = f->buf;
+    f->bufcap = f->bufsize;
+  }
+}
+
+// io61_mem_size(f)
+//    Return the size of memory file `f`, counting writes not yet
+//    flushed.
+
+size_t io61_mem_size(io61_file *f) {
+  if (f->mode != O_RDONLY && f->pos_tag > f->beg_tag) {
+    return std::max(f->mem_size, (size_t)f->pos_tag);
+  }
+  return f->mem_size;
+}
+
+bool io61_mem_open(io61_file *f) {
+  if (f->memory && f->mode != O_RDONLY) {
+    io61_mem_window(f, 0);
+  }
+  return f->memory;
+}
+
+ssize_t io61_mem_fill(io61_file *f) {
+  f->cbuf = f->mem_data;
+  f->beg_tag = 0;
+  return f->mem_size;
+}
+
+int io61_mem_flush(io61_file *f, bool wait) {
+  int r = 0;
+  if (f->pos_tag > f->beg_tag && f->cbuf != f->mem_data + f->beg_tag) {
+    r = io61_mem_reserve(f, f->pos_tag);
+    if (r == 0) {
+      memcpy(f->mem_data + f->beg_tag, f->cbuf, f->pos_tag - f->beg_tag);
+    }
+  }
+  if (r == 0) {
+    f->mem_size = io61_mem_size(f);
+  }
+  if (wait && r == 0) {
+    r = io61_mem_trim(f);
+  }
+  f->beg_tag = f->end_tag = f->pos_tag;
+  io61_mem_window(f, f->pos_tag);
+  return r;
+}
+
+off_t io61_mem_seek(io61_file *f, off_t pos) {
+  if (pos < 0) {
+    errno = EINVAL;
+    return -1;
+  } else if (f->mode != O_RDONLY) {
+    io61_mem_window(f, pos);
+  }
+  return pos;
+}
+
+int io61_mem_close(io61_file *f) {
+  if (f->fd < 0) {
+    free(f->mem_data);
+    return 0;
+  }
+  if (f->mem_cap) {
+    munmap(f->mem_data, f->mem_cap);
+  }
+  return close(f->fd);
+}
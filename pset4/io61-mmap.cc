@@ -0,0 +1,176 @@
+#include "io61-internal.hh"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// mmap backend: read-only regular files are mapped whole, and the
+// mapping becomes the buffer, so every fill after the first is free.
+// Write-only files that write at offsets are mapped shared, with room
+// reserved past the end (io61_size_hint reserves the final size), and
+// the buffer is the mapping from the position on, so a write, even
+// after a seek, is a memcpy into the page cache. Writers truncate the
+// file to the bytes written when they close. A writer whose mapping
+// cannot grow is unmapped and goes on as a plainly buffered file.
+
+// io61_mmap_window(f)
+//    Make the buffer of mmap writer `f` the mapping from `beg_tag` on.
+
+static void io61_mmap_window(io61_file *f) {
+  bool inside = f->beg_tag >= 0 && f->beg_tag < (off_t)f->map_size;
+  f->cbuf = inside ? f->map + f->beg_tag : f->map;
+  f->bufcap = inside ? f->map_size - f->beg_tag : 0;
+}
+
+// io61_mmap_unmap(f)
+//    Unmap mmap writer `f`, cut the file back to the bytes written, and
+//    buffer its later writes in `buf`. Returns 0 on success and -1 on
+//    error.
+
+static int io61_mmap_unmap(io61_file *f) {
+  munmap(f->map, f->map_size);
+  f->map = nullptr;
+  f->map_size = 0;
+  f->positional = true;
+  f->cbuf = f->buf;
+  f->bufcap = f->bufsize;
+  f->beg_tag = f->end_tag = f->pos_tag;
+  off_t size = std::max(f->map_end, f->map_min);
+  return io61_timed(f->stats, S_FTRUNCATE,
+                    [&] { return ftruncate(f->fd, size); });
+}
+
+// io61_mmap_reserve(f, size)
+//    Make the mapping of mmap writer `f` cover at least `size` bytes,
+//    allocating file blocks for them, so that a full disk fails here
+//    rather than in a page fault. The mapping at least doubles when it
+//    grows. Returns 0 on success; on failure, unmaps `f` and returns -1.
+
+int io61_mmap_reserve(io61_file *f, off_t size) {
+  if (size <= (off_t)f->map_size) {
+    return 0;
+  }
+  off_t want = std::max(size, off_t(2 * f->map_size));
+  int r = io61_timed(f->stats, S_FALLOCATE, [&] {
+    return fallocate(f->fd, 0, f->map_size, want - f->map_size);
+  });
+  if (r < 0 && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+    r = io61_timed(f->stats, S_FTRUNCATE,
+                   [&] { return ftruncate(f->fd, want); });
+  }
+  void *m = r < 0 ? MAP_FAILED
+                  : mremap(f->map, f->map_size, want, MREMAP_MAYMOVE);
+  if (m == MAP_FAILED) {
+    io61_mmap_unmap(f);
+    return -1;
+  }
+  f->map = (char *)m;
+  f->map_size = want;
+  io61_mmap_window(f);
+  return 0;
+}
+
+// io61_mmap_start(f, size)
+//    Map write-only file `f` with room for `size` bytes. The mapping needs
+//    a descriptor open for reading, so `fd` is reopened through /proc.
+//    Returns false if `f` cannot be mapped.
+
+bool io61_mmap_start(io61_file *f, off_t size) {
+  struct stat st;
+  if (!f->positional || f->crc_on || fstat(f->fd, &st) < 0
+      || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", f->fd);
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  off_t len = std::max({size, (off_t)st.st_size, f->bufsize});
+  int r = io61_timed(f->stats, S_FALLOCATE,
+                     [&] { return fallocate(fd, 0, 0, len); });
+  if (r < 0 && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+    r = st.st_size >= len ? 0 : io61_timed(f->stats, S_FTRUNCATE, [&] {
+      return ftruncate(fd, len);
+    });
+  }
+  void *m = r < 0 ? MAP_FAILED
+                  : mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    if (r == 0 && st.st_size < len) {
+      ftruncate(f->fd, st.st_size);
+    }
+    return false;
+  }
+  f->map = (char *)m;
+  f->map_size = len;
+  f->map_end = 0;
+  f->map_min = st.st_size;
+  f->positional = false;  // writes land in the mapping, not the cache
+  f->beg_tag = f->end_tag = f->pos_tag;
+  io61_mmap_window(f);
+  return true;
+}
+
+bool io61_mmap_open(io61_file *f) {
+  if (f->mode != O_RDONLY) {
+    return io61_mmap_start(f, 0);
+  }
+  struct stat st;
+  if (fstat(f->fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    return false;
+  }
+  void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+  if (m == MAP_FAILED) {
+    return false;
+  }
+  f->map = (char *)m;
+  f->map_size = st.st_size;
+  return true;
+}
+
+ssize_t io61_mmap_fill(io61_file *f) {
+  f->cbuf = f->map;
+  f->beg_tag = 0;
+  return f->map_size;
+}
+
+// the bytes are already in the mapping; a full window grows it, except
+// when the flush only drains the buffer
+int io61_mmap_flush(io61_file *f, bool wait) {
+  if (!f->map) {
+    return io61_buffered_flush(f, wait);
+  }
+  if (f->pos_tag > f->beg_tag) {
+    f->map_end = std::max(f->map_end, f->pos_tag);
+  }
+  f->beg_tag = f->end_tag = f->pos_tag;
+  if (!wait && (f->pos_tag < 0
+                || io61_mmap_reserve(f, f->pos_tag + 1) < 0)) {
+    if (f->map) {
+      io61_mmap_unmap(f);
+    }
+    return 0;
+  }
+  io61_mmap_window(f);
+  return 0;
+}
+
+off_t io61_mmap_seek(io61_file *f, off_t pos) {
+  if (f->mode == O_RDONLY || !f->map || pos < 0) {
+    return io61_offset_seek(f, pos);
+  }
+  f->beg_tag = f->end_tag = pos;
+  io61_mmap_window(f);
+  return pos;
+}
+
+int io61_mmap_close(io61_file *f) {
+  if (f->mode == O_RDONLY) {
+    munmap(f->map, f->map_size);
+    return close(f->fd);
+  }
+  int r = f->map ? io61_mmap_unmap(f) : 0;
+  return io61_fd_close(f) == 0 ? r : -1;
+}
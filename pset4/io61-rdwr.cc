@@ -0,0 +1,322 @@
+#include "io61-internal.hh"
+#include <climits>
+#include <sys/stat.h>
+
+// rdwr backend: read/write files. The file is cached in `nslots` slots
+// of one aligned block each, holding the file's bytes as read, or as
+// written since. Each slot records the byte ranges written into it, and
+// only those ranges go back to the file, when the slot is evicted or the
+// file flushed, so a small update costs one read of its block and one
+// small write. The buffer window is one slot, so readc reads in place;
+// writes go through io61_rdwr_io, which also marks them dirty.
+
+struct io61_rdwr {
+  static constexpr int nslots = 32;
+  static constexpr off_t slot_size = 4096;
+
+  struct slot {
+    std::unique_ptr<char[]> data;
+    off_t off = -1;       // file offset of `data`, or -1 if unused
+    size_t len = 0;       // bytes of the file in `data`
+    std::vector<std::pair<size_t, size_t>> dirty; // sorted, disjoint
+    unsigned long used = 0;
+  };
+  slot slots[nslots];
+  slot *last = nullptr;   // most recently used
+  off_t size = 0;         // file size, counting writes not yet flushed
+  unsigned long clock = 0;
+};
+
+// io61_rdwr_window(f, s)
+//    Return whether the buffer window of `f` is slot `s`.
+
+static bool io61_rdwr_window(io61_file *f, const io61_rdwr::slot &s) {
+  return f->cbuf == s.data.get() && f->beg_tag == s.off;
+}
+
+// io61_rdwr_mark(s, lo, hi)
+//    Add bytes [`lo`, `hi`) of slot `s` to its dirty ranges, merging
+//    ranges that overlap or touch them.
+
+static void io61_rdwr_mark(io61_rdwr::slot *s, size_t lo, size_t hi) {
+  auto &d = s->dirty;
+  auto it = std::lower_bound(d.begin(), d.end(), lo,
+                             [](const std::pair<size_t, size_t> &r,
+                                size_t x) { return r.second < x; });
+  auto end = it;
+  while (end != d.end() && end->first <= hi) {
+    lo = std::min(lo, end->first);
+    hi = std::max(hi, end->second);
+    ++end;
+  }
+  it = d.erase(it, end);
+  d.insert(it, {lo, hi});
+}
+
+// io61_rdwr_writeback(f, slots)
+//    Write the dirty ranges of `slots` to the file of `f`. Ranges that
+//    meet across slot boundaries go in one `pwritev`. Returns 0 on
+//    success and -1 on error; ranges stay dirty until they are written.
+
+static int io61_rdwr_writeback(io61_file *f,
+                               std::vector<io61_rdwr::slot *> slots) {
+  std::sort(slots.begin(), slots.end(),
+            [](io61_rdwr::slot *a, io61_rdwr::slot *b) {
+              return a->off < b->off;
+            });
+  int r = 0;
+  std::vector<struct iovec> iov;
+  off_t start = 0, end = 0;
+  auto emit = [&] {
+    if (!iov.empty()
+        && io61_pwritev_all(f, iov.data(), iov.size(), start) < 0) {
+      r = -1;
+    }
+    iov.clear();
+  };
+  for (auto s : slots) {
+    for (auto &d : s->dirty) {
+      if (iov.empty() || s->off + (off_t)d.first != end
+          || iov.size() == IOV_MAX) {
+        emit();
+        start = s->off + d.first;
+      }
+      iov.push_back({s->data.get() + d.first, d.second - d.first});
+      end = s->off + d.second;
+    }
+  }
+  emit();
+  if (r == 0) {
+    for (auto s : slots) {
+      s->dirty.clear();
+    }
+  }
+  return r;
+}
+
+// io61_rdwr_find(f, block)
+//    Return the slot of read/write file `f` that holds the block at file
+//    offset `block`, or nullptr if none does.
+
+static io61_rdwr::slot *io61_rdwr_find(io61_file *f, off_t block) {
+  io61_rdwr *rd = f->rdwr;
+  if (rd->last && rd->last->off == block) {
+    return rd->last;
+  }
+  for (auto &s : rd->slots) {
+    if (s.off == block) {
+      return &s;
+    }
+  }
+  return nullptr;
+}
+
+// io61_rdwr_evict(f)
+//    Empty the least recently used slot of read/write file `f`, other
+//    than its buffer window, writing back its dirty ranges, and return
+//    it. Returns nullptr if they cannot be written.
+
+static io61_rdwr::slot *io61_rdwr_evict(io61_file *f) {
+  io61_rdwr::slot *victim = nullptr;
+  for (auto &s : f->rdwr->slots) {
+    if (!io61_rdwr_window(f, s) && (!victim || s.used < victim->used)) {
+      victim = &s;
+    }
+  }
+  if (!victim->dirty.empty() && io61_rdwr_writeback(f, {victim}) < 0) {
+    return nullptr;
+  }
+  victim->off = -1;
+  victim->len = 0;
+  return victim;
+}
+
+// io61_rdwr_slot(f, block, end, whole)
+//    Return the slot of read/write file `f` that holds the block at file
+//    offset `block`, loading it if no slot does. Blocks after it, up to
+//    offset `end`, that no slot holds are loaded by the same `preadv`,
+//    up to half the slots' worth. If `whole` is true the caller is about
+//    to overwrite the whole block, so nothing is read. Returns nullptr on
+//    error.
+
+static io61_rdwr::slot *io61_rdwr_slot(io61_file *f, off_t block,
+                                       off_t end, bool whole) {
+  io61_rdwr *rd = f->rdwr;
+  constexpr off_t ssize = io61_rdwr::slot_size;
+  io61_rdwr::slot *s = io61_rdwr_find(f, block);
+  if (!s) {
+    std::vector<io61_rdwr::slot *> load;
+    std::vector<struct iovec> iov;
+    for (off_t b = block;
+         load.empty()
+         || (!whole && b < end && b < rd->size
+             && load.size() < (size_t)rd->nslots / 2 && !io61_rdwr_find(f, b));
+         b += ssize) {
+      io61_rdwr::slot *x = io61_rdwr_evict(f);
+      if (!x && load.empty()) {
+        return nullptr;
+      } else if (!x) {
+        break;
+      }
+      x->off = b;
+      x->used = ++rd->clock;
+      load.push_back(x);
+      iov.push_back({x->data.get(), (size_t)ssize});
+    }
+    s = load[0];
+    io61_syscall c = iov.size() == 1 ? S_PREAD : S_PREADV;
+    while (!whole && block < rd->size) {
+      ssize_t n = io61_timed(f->stats, c, [&] {
+        return preadv(f->fd, iov.data(), iov.size(), block);
+      });
+      if (n >= 0) {
+        for (auto x : load) {
+          x->len = std::min(std::max(n - (x->off - block), (off_t)0), ssize);
+        }
+        break;
+      } else if (errno != EINTR) {
+        for (auto x : load) {
+          x->off = -1;
+        }
+        return nullptr;
+      }
+    }
+  }
+  s->used = ++rd->clock;
+  rd->last = s;
+  // bytes the file does not have yet lie before a later write: zeros
+  size_t len = std::min(ssize, std::max(rd->size - block, (off_t)0));
+  if (s->len < len) {
+    memset(s->data.get() + s->len, 0, len - s->len);
+    s->len = len;
+    if (io61_rdwr_window(f, *s)) {
+      f->end_tag = block + len;
+    }
+  }
+  return s;
+}
+
+bool io61_rdwr_open(io61_file *f) {
+  struct stat st;
+  if (f->mode != O_RDWR || !f->seekable || fstat(f->fd, &st) < 0) {
+    return false;
+  }
+  f->rdwr = new io61_rdwr;
+  f->rdwr->size = st.st_size;
+  for (auto &s : f->rdwr->slots) {
+    s.data.reset(new char[io61_rdwr::slot_size]);
+  }
+  // every write must mark its bytes dirty
+  f->bufcap = 0;
+  return true;
+}
+
+ssize_t io61_rdwr_fill(io61_file *f) {
+  off_t pos = f->pos_tag;
+  off_t block = pos - pos % io61_rdwr::slot_size;
+  // read ahead while reads look sequential
+  off_t end = block + io61_rdwr::slot_size
+              * (f->pattern == P_SEQUENTIAL ? io61_rdwr::nslots / 4 : 1);
+  io61_rdwr::slot *s = io61_rdwr_slot(f, block, end, false);
+  if (!s) {
+    return -1;
+  } else if (pos > s->off + (off_t)s->len) {
+    return 0;
+  }
+  f->cbuf = s->data.get();
+  f->beg_tag = s->off;
+  return s->len;
+}
+
+int io61_rdwr_flush(io61_file *f, bool wait) {
+  (void)wait;
+  std::vector<io61_rdwr::slot *> dirty;
+  for (auto &s : f->rdwr->slots) {
+    if (!s.dirty.empty()) {
+      dirty.push_back(&s);
+    }
+  }
+  return dirty.empty() ? 0 : io61_rdwr_writeback(f, std::move(dirty));
+}
+
+int io61_rdwr_close(io61_file *f) {
+  // leave the offset where the position is, as io61_fd_close does
+  io61_timed(f->stats, S_LSEEK,
+             [&] { return lseek(f->fd, f->pos_tag, SEEK_SET); });
+  delete f->rdwr;
+  f->rdwr = nullptr;
+  return close(f->fd);
+}
+
+// io61_rdwr_size(f)
+//    Return the size of read/write file `f`, including bytes written but
+//    not yet written back.
+
+off_t io61_rdwr_size(io61_file *f) {
+  return f->rdwr->size;
+}
+
+// io61_rdwr_io(f, buf, sz, off, writing)
+//    Copy `sz` bytes between `buf` and offset `off` of read/write file
+//    `f` through its slots, without moving the position. Writes mark
+//    their bytes dirty and may extend the file; reads stop at its end.
+//    Returns the number of bytes copied, or -1 if an error occurred
+//    before any were.
+
+ssize_t io61_rdwr_io(io61_file *f, char *buf, size_t sz, off_t off,
+                     bool writing) {
+  io61_rdwr *rd = f->rdwr;
+  size_t n = 0;
+  while (n < sz && (writing || off + (off_t)n < rd->size)) {
+    off_t pos = off + n;
+    off_t block = pos - pos % io61_rdwr::slot_size;
+    size_t lo = pos - block;
+    size_t hi = std::min((size_t)io61_rdwr::slot_size, lo + (sz - n));
+    bool whole = writing && lo == 0 && hi == (size_t)io61_rdwr::slot_size;
+    // reads may load the blocks after this one with it
+    off_t end = writing ? block + io61_rdwr::slot_size : off + sz;
+    io61_rdwr::slot *s = io61_rdwr_slot(f, block, end, whole);
+    if (!s) {
+      return n ? (ssize_t)n : -1;
+    }
+    if (!writing) {
+      hi = std::min(hi, s->len);
+      memcpy(buf + n, s->data.get() + lo, hi - lo);
+      n += hi - lo;
+      continue;
+    }
+    if (s->len < lo) {
+      memset(s->data.get() + s->len, 0, lo - s->len);
+    }
+    memcpy(s->data.get() + lo, buf + n, hi - lo);
+    io61_rdwr_mark(s, lo, hi);
+    if (s->len < hi) {
+      s->len = hi;
+      rd->size = std::max(rd->size, block + (off_t)hi);
+      if (io61_rdwr_window(f, *s)) {
+        f->end_tag = block + hi;
+      }
+    }
+    n += hi - lo;
+  }
+  return n;
+}
+
+// io61_rdwr_write(f, buf, sz)
+//    io61_write for read/write files: write at the position through the
+//    slots, then keep the buffer window if the position is still in it.
+
+ssize_t io61_rdwr_write(io61_file *f, const char *buf, size_t sz) {
+  io61_crc_fold(f);
+  ssize_t n = io61_rdwr_io(f, (char *)buf, sz, f->pos_tag, true);
+  if (n > 0) {
+    if (f->crc_on) {
+      f->crc = io61_crc32c(f->crc, buf, n);
+    }
+    f->pos_tag = f->crc_tag = f->pos_tag + n;
+    if (f->pos_tag > f->end_tag) {
+      f->beg_tag = f->end_tag = f->pos_tag;
+    }
+  }
+  return n;
+}
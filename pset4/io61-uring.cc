@@ -0,0 +1,464 @@
+#include "io61-internal.hh"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// uring backend: io_uring with registered buffers, for seekable files
+
+// io61_uring
+//    An io_uring instance owned by one io61_file. Each slot is a buffer
+//    registered with the kernel, so fixed reads and writes into it skip
+//    per-I/O page pinning. Reads keep up to `nslots` buffers in flight at
+//    predicted offsets; writes are queued and submitted in batches.
+
+struct io61_uring {
+  static constexpr unsigned nslots = 4;
+  static constexpr unsigned entries = 2 * nslots;
+
+  enum slot_state { FREE, BUSY, READY };
+  struct slot {
+    char *buf;
+    off_t off;
+    ssize_t res;        // completion result once READY
+    slot_state state = FREE;
+  };
+
+  int ring_fd = -1;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  io_uring_sqe *sqes;
+  io_uring_cqe *cqes;
+  void *sq_map = MAP_FAILED, *cq_map = MAP_FAILED, *sqe_map = MAP_FAILED;
+  size_t sq_size, cq_size, sqe_size;
+
+  slot slots[nslots];
+  char *bufs = nullptr;
+  unsigned cq_entries = 0;  // completions the ring can hold
+  unsigned unsubmitted = 0; // SQEs queued but not yet passed to the kernel
+  unsigned inflight = 0;    // SQEs submitted but not yet completed
+  int err = 0;              // errno from a failed write
+  bool failed = false;      // `io_uring_enter` failed; writes stop using it
+  off_t fsize = -1;         // size of a regular file being read
+  ssize_t *run_res = nullptr; // results of write-back runs
+  io61_stats *stats;        // the owning file's counters
+};
+
+static int io61_uring_enter(io61_uring *u, unsigned min_complete) {
+  int r;
+  do {
+    r = io61_timed(*u->stats, S_URING, [&] {
+      return syscall(__NR_io_uring_enter, u->ring_fd, u->unsubmitted,
+                     min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0,
+                     nullptr, 0);
+    });
+  } while (r < 0 && errno == EINTR);
+  if (r > 0) {
+    u->inflight += r;
+    u->unsubmitted -= r;
+  }
+  return r;
+}
+
+// io61_uring_free(u)
+//    Release every resource of `u`. Safe on partly set up rings.
+
+static void io61_uring_free(io61_uring *u) {
+  if (u->ring_fd >= 0) {
+    close(u->ring_fd);
+  }
+  if (u->sqe_map != MAP_FAILED) {
+    munmap(u->sqe_map, u->sqe_size);
+  }
+  if (u->cq_map != MAP_FAILED && u->cq_map != u->sq_map) {
+    munmap(u->cq_map, u->cq_size);
+  }
+  if (u->sq_map != MAP_FAILED) {
+    munmap(u->sq_map, u->sq_size);
+  }
+  free(u->bufs);
+  delete u;
+}
+
+// io61_uring_start(f)
+//    Set up an io_uring with registered buffers for `f`. If the kernel
+//    does not support io_uring (or forbids it), `f` keeps using
+//    `read` and `write`.
+
+static void io61_uring_start(io61_file *f) {
+  io61_uring *u = new io61_uring;
+  u->stats = &f->stats;
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  u->ring_fd = syscall(__NR_io_uring_setup, u->entries, &p);
+  if (u->ring_fd < 0) {
+    io61_uring_free(u);
+    return;
+  }
+
+  u->cq_entries = p.cq_entries;
+  u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    u->sq_size = u->cq_size = std::max(u->sq_size, u->cq_size);
+  }
+  u->sq_map = mmap(nullptr, u->sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    u->cq_map = u->sq_map;
+  } else {
+    u->cq_map = mmap(nullptr, u->cq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->ring_fd,
+                     IORING_OFF_CQ_RING);
+  }
+  u->sqe_size = p.sq_entries * sizeof(io_uring_sqe);
+  u->sqe_map = mmap(nullptr, u->sqe_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+  if (u->sq_map == MAP_FAILED || u->cq_map == MAP_FAILED
+      || u->sqe_map == MAP_FAILED) {
+    io61_uring_free(u);
+    return;
+  }
+  char *sq = (char *)u->sq_map, *cq = (char *)u->cq_map;
+  u->sq_head = (unsigned *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(sq + p.sq_off.array);
+  u->cq_head = (unsigned *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+  u->sqes = (io_uring_sqe *)u->sqe_map;
+
+  // register the slot buffers
+  struct iovec iov[io61_uring::nslots];
+  if (posix_memalign((void **)&u->bufs, 4096, u->nslots * f->bufsize) != 0) {
+    u->bufs = nullptr;
+    io61_uring_free(u);
+    return;
+  }
+  for (unsigned i = 0; i != u->nslots; ++i) {
+    u->slots[i].buf = u->bufs + i * f->bufsize;
+    iov[i].iov_base = u->slots[i].buf;
+    iov[i].iov_len = f->bufsize;
+  }
+  if (syscall(__NR_io_uring_register, u->ring_fd, IORING_REGISTER_BUFFERS,
+              iov, u->nslots) < 0) {
+    io61_uring_free(u);
+    return;
+  }
+  if (f->mode == O_RDONLY) {
+    u->fsize = io61_filesize(f);
+  }
+  f->uring = u;
+}
+
+// io61_uring_sqe(u, op, fd, off, addr, len, user_data)
+//    Queue an SQE. Returns false if the submission queue is full.
+
+static bool io61_uring_sqe(io61_uring *u, int op, int fd, off_t off,
+                           const void *addr, size_t len, uint64_t user_data) {
+  unsigned tail = *u->sq_tail;
+  if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->entries) {
+    return false;
+  }
+  unsigned idx = tail & *u->sq_mask;
+  io_uring_sqe *sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->off = off;
+  sqe->addr = (unsigned long)addr;
+  sqe->len = len;
+  if (user_data < u->nslots) {
+    sqe->buf_index = user_data;
+  }
+  sqe->user_data = user_data;
+  u->sq_array[idx] = idx;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++u->unsubmitted;
+  return true;
+}
+
+// io61_uring_queue(u, op, i, off, len, fd)
+//    Queue a fixed-buffer read or write of slot `i`. Every slot has at
+//    most one SQE, so the submission queue cannot be full.
+
+static void io61_uring_queue(io61_uring *u, int op, unsigned i, off_t off,
+                             size_t len, int fd) {
+  bool ok = io61_uring_sqe(u, op, fd, off, u->slots[i].buf, len, i);
+  assert(ok);
+  (void)ok;
+  u->slots[i].off = off;
+  u->slots[i].state = io61_uring::BUSY;
+}
+
+// io61_uring_reap(u)
+//    Record every available completion. Reads make their slot READY and
+//    writes free theirs; completions with `user_data >= nslots` belong to
+//    write-back runs and are stored in `run_res`.
+
+static void io61_uring_reap(io61_uring *u, int mode) {
+  unsigned head = *u->cq_head;
+  while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+    io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+    if (cqe->res > 0) {
+      u->stats->bytes[S_URING] += cqe->res;
+    }
+    if (cqe->user_data >= u->nslots) {
+      // a run io61_uring_writeback gave up on has no result slot
+      if (u->run_res) {
+        u->run_res[cqe->user_data - u->nslots] = cqe->res;
+      }
+    } else if (mode == O_RDONLY) {
+      u->slots[cqe->user_data].res = cqe->res;
+      u->slots[cqe->user_data].state = io61_uring::READY;
+    } else {
+      if (cqe->res < 0) {
+        u->err = -cqe->res;
+      }
+      u->slots[cqe->user_data].state = io61_uring::FREE;
+    }
+    --u->inflight;
+    ++head;
+  }
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// io61_uring_wait(u, mode)
+//    Submit queued SQEs and wait for at least one completion. Returns 0,
+//    or -1 if `io_uring_enter` failed, in which case callers must stop
+//    waiting: the queued SQEs may never be submitted.
+
+static int io61_uring_wait(io61_uring *u, int mode) {
+  int r = io61_uring_enter(u, 1);
+  io61_uring_reap(u, mode);
+  if (r < 0) {
+    u->failed = true;
+    return -1;
+  }
+  return 0;
+}
+
+// io61_uring_drop(u, mode)
+//    Take back the SQEs queued on `u` but not yet passed to the kernel,
+//    then wait for the submitted ones by polling the completion queue,
+//    for use once `io_uring_enter` has failed: the kernel may still be
+//    reading or writing the memory they name.
+
+static void io61_uring_drop(io61_uring *u, int mode) {
+  __atomic_store_n(u->sq_tail, *u->sq_tail - u->unsubmitted,
+                   __ATOMIC_RELEASE);
+  u->unsubmitted = 0;
+  io61_uring_reap(u, mode);
+  while (u->inflight > 0) {
+    struct timespec ts = {0, 100000};
+    nanosleep(&ts, nullptr);
+    io61_uring_reap(u, mode);
+  }
+}
+
+// io61_uring_predict(f, off, k)
+//    Return the offset of the `k`th buffer fill expected after a fill at
+//    `off`, or -1 if the access pattern of `f` does not predict one.
+
+static off_t io61_uring_predict(io61_file *f, off_t off, int k) {
+  off_t next = -1;
+  if (f->pattern == P_SEQUENTIAL) {
+    next = off + k * f->bufsize;
+  } else if (f->pattern == P_REVERSE) {
+    next = off - k * f->bufsize;
+  } else if (f->pattern == P_STRIDED && f->delta > f->bufsize) {
+    // strided fills follow the seeks, not the aligned buffer starts
+    next = ((f->seek_tag + k * f->delta) / f->bufsize) * f->bufsize;
+  }
+  if (next < 0 || (f->uring->fsize >= 0 && next >= f->uring->fsize)) {
+    return -1;
+  }
+  return next;
+}
+
+// io61_uring_slot(f, off)
+//    Return a slot that a read at `off` can use: a free slot, or else one
+//    holding a completed read that `off`'s predictions do not need.
+//    Returns -1 if every slot is busy.
+
+static int io61_uring_slot(io61_file *f, off_t off) {
+  io61_uring *u = f->uring;
+  int stale = -1;
+  for (unsigned i = 0; i != u->nslots; ++i) {
+    auto &s = u->slots[i];
+    if (s.state == io61_uring::FREE) {
+      return i;
+    } else if (s.state == io61_uring::READY && stale < 0 && s.off != off) {
+      stale = i;
+      for (unsigned k = 1; k != u->nslots; ++k) {
+        if (io61_uring_predict(f, off, k) == s.off) {
+          stale = -1;
+        }
+      }
+    }
+  }
+  return stale;
+}
+
+// io61_uring_find(u, off)
+//    Return the slot holding or reading offset `off`, or -1.
+
+static int io61_uring_find(io61_uring *u, off_t off) {
+  for (unsigned i = 0; i != u->nslots; ++i) {
+    if (u->slots[i].state != io61_uring::FREE && u->slots[i].off == off) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// io61_uring_fill(f)
+//    Fill the buffer of read-only file `f` from offset `f->end_tag`,
+//    using a read already in flight for that offset if there is one, and
+//    start reads for the offsets its access pattern predicts next. All
+//    new reads go to the kernel in one `io_uring_enter`.
+
+ssize_t io61_uring_fill(io61_file *f) {
+  io61_uring *u = f->uring;
+  off_t off = f->end_tag;
+  io61_uring_reap(u, O_RDONLY);
+
+  int want;
+  while ((want = io61_uring_find(u, off)) < 0) {
+    int i = io61_uring_slot(f, off);
+    if (i >= 0) {
+      io61_uring_queue(u, IORING_OP_READ_FIXED, i, off, f->bufsize, f->fd);
+    } else if (io61_uring_wait(u, O_RDONLY) < 0) {
+      return -1;
+    }
+  }
+  for (unsigned k = 1; k != u->nslots; ++k) {
+    off_t next = io61_uring_predict(f, off, k);
+    int i;
+    if (next < 0) {
+      break;
+    } else if (io61_uring_find(u, next) >= 0) {
+      continue;
+    } else if ((i = io61_uring_slot(f, off)) < 0) {
+      break;
+    }
+    io61_uring_queue(u, IORING_OP_READ_FIXED, i, next, f->bufsize, f->fd);
+  }
+
+  while (u->slots[want].state != io61_uring::READY) {
+    if (io61_uring_wait(u, O_RDONLY) < 0) {
+      return -1;
+    }
+  }
+  io61_uring_enter(u, 0);
+  auto &s = u->slots[want];
+  s.state = io61_uring::FREE;
+  if (s.res < 0) {
+    errno = -s.res;
+    return -1;
+  }
+  memcpy(f->cbuf, s.buf, s.res);
+  return s.res;
+}
+
+// io61_uring_give(f, wait)
+//    Queue the write buffer of write-only file `f` for writing. Queued
+//    writes are submitted together once every slot is in use; if `wait`
+//    is true, submit now and wait for all of them. Returns 0 on success
+//    and -1 if a write failed.
+
+int io61_uring_give(io61_file *f, bool wait) {
+  io61_uring *u = f->uring;
+  if (f->pos_tag > f->beg_tag) {
+    int i = -1;
+    while (true) {
+      io61_uring_reap(u, O_WRONLY);
+      for (unsigned j = 0; j != u->nslots && i < 0; ++j) {
+        if (u->slots[j].state == io61_uring::FREE) {
+          i = j;
+        }
+      }
+      if (i >= 0) {
+        break;
+      } else if (io61_uring_wait(u, O_WRONLY) < 0) {
+        return -1;
+      }
+    }
+    size_t len = f->pos_tag - f->beg_tag;
+    memcpy(u->slots[i].buf, f->cbuf, len);
+    io61_uring_queue(u, IORING_OP_WRITE_FIXED, i, f->beg_tag, len, f->fd);
+    f->beg_tag = f->end_tag = f->pos_tag;
+  }
+  while (wait && u->unsubmitted + u->inflight > 0) {
+    if (io61_uring_wait(u, O_WRONLY) < 0) {
+      return -1;
+    }
+  }
+  if (u->err) {
+    errno = u->err;
+    u->err = 0;
+    return -1;
+  }
+  return 0;
+}
+
+// io61_uring_stop(f)
+//    Wait for outstanding I/O on `f` and tear down its io_uring.
+
+static void io61_uring_stop(io61_file *f) {
+  io61_uring *u = f->uring;
+  if (!u) {
+    return;
+  }
+  while (u->unsubmitted + u->inflight > 0
+         && io61_uring_wait(u, f->mode) == 0) {
+  }
+  io61_uring_drop(u, f->mode);
+  io61_uring_free(u);
+  f->uring = nullptr;
+}
+
+// io61_uring_writeback(f, runs, nruns, res)
+//    Write the `nruns` runs of io61_writeback through the ring of `f`,
+//    batched into as few submissions as possible, and set `res[i]` to the
+//    bytes the ring wrote from run `i`. Runs it did not write completely
+//    are left for the caller.
+
+void io61_uring_writeback(io61_file *f, io61_run *runs, size_t nruns,
+                          ssize_t *res) {
+  io61_uring *u = f->uring;
+  // earlier writes must land before the cache's newer bytes. Runs are
+  // queued only while the completion queue has room for their results.
+  // Once the ring has failed, runs it left in flight may complete at
+  // any time, so no later run goes through it
+  if (io61_uring_give(f, true) < 0 || u->failed) {
+    return;
+  }
+  u->run_res = res;
+  size_t next = 0;
+  while (!u->failed && (next != nruns || u->unsubmitted + u->inflight > 0)) {
+    while (next != nruns && u->unsubmitted + u->inflight < u->cq_entries
+           && io61_uring_sqe(u, IORING_OP_WRITEV, f->fd, runs[next].off,
+                             runs[next].iov.data(), runs[next].iov.size(),
+                             u->nslots + next)) {
+      ++next;
+    }
+    io61_uring_wait(u, O_WRONLY);
+  }
+  io61_uring_drop(u, O_WRONLY);
+  u->run_res = nullptr;
+}
+
+bool io61_uring_open(io61_file *f) {
+  // io_uring reads and writes at explicit offsets
+  if ((f->mode == O_RDONLY && f->seekable) || f->positional) {
+    io61_uring_start(f);
+  }
+  return f->uring != nullptr;
+}
+
+int io61_uring_close(io61_file *f) {
+  io61_uring_stop(f);
+  return io61_fd_close(f);
+}
@@ -1,64 +1,1651 @@
-#include "io61.hh"
+#include "io61-internal.hh"
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <climits>
+#include <ctime>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
-// io61.c
-//    YOUR CODE HERE!
+// names of io61_pattern and io61_syscall values, for io61_report
+static const char *const pattern_names[] = {"sequential", "reverse",
+                                            "strided", "random"};
+static const char *const syscall_names[] = {
+    "read",   "pread",   "readv",           "preadv",   "write",
+    "pwrite", "writev",  "pwritev",         "copy_file_range",
+    "sendfile", "splice", "io_uring_enter", "lseek",    "fadvise",
+    "fallocate", "ftruncate"};
+
+// buffer pool: file buffers are aligned powers of two, at least
+// `pool_min` bytes, shared by the whole process and reused from one
+// open to the next. Buffers smaller than `pool_chunk` are carved from
+// chunks of that size, so a process that opens thousands of files
+// faults in memory a chunk at a time rather than a file at a time; they
+// are never returned to the system. Larger buffers are mapped singly,
+// and unmapped once `pool_keep` of their size are free. If
+// $IO61_HUGEPAGES is set, chunks and large buffers ask for huge pages:
+// from the hugetlb pool if it has them, and otherwise as transparent
+// huge pages.
+
+static constexpr size_t pool_min = 4096;
+static constexpr size_t pool_chunk = 2 << 20;
+static constexpr size_t pool_keep = 4;
+
+static std::mutex pool_lock;
+static std::vector<char *> pool_free[64]; // by log2 of the size
+
+// io61_pool_size(sz)
+//    Return the size of the pool buffer that holds `sz` bytes: the least
+//    power of two that is at least `sz` and `pool_min`.
+
+static size_t io61_pool_size(size_t sz) {
+  sz = std::max(sz, pool_min);
+  return size_t(1) << (64 - __builtin_clzll(sz - 1));
+}
+
+// io61_pool_map(sz)
+//    Map `sz` bytes of fresh memory, a multiple of `pool_chunk` aligned
+//    to it when huge pages are wanted. Returns nullptr if memory is
+//    exhausted.
+
+static char *io61_pool_map(size_t sz) {
+  static const bool huge = getenv("IO61_HUGEPAGES") != nullptr;
+  int prot = PROT_READ | PROT_WRITE, flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  if (!huge || sz % pool_chunk != 0) {
+    void *p = mmap(nullptr, sz, prot, flags, -1, 0);
+    return p == MAP_FAILED ? nullptr : (char *)p;
+  }
+  void *p = mmap(nullptr, sz, prot, flags | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) {
+    return (char *)p;
+  }
+  // transparent huge pages need an aligned range: map more and trim
+  p = mmap(nullptr, sz + pool_chunk, prot, flags, -1, 0);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+  char *b = (char *)p;
+  char *a = (char *)(((uintptr_t)b + pool_chunk - 1) & ~(pool_chunk - 1));
+  if (a != b) {
+    munmap(b, a - b);
+  }
+  munmap(a + sz, pool_chunk - (a - b));
+  madvise(a, sz, MADV_HUGEPAGE);
+  return a;
+}
+
+// io61_pool_get(sz)
+//    Return a buffer of `sz` bytes, a size returned by io61_pool_size,
+//    from the pool. Returns nullptr if memory is exhausted.
+
+char *io61_pool_get(size_t sz) {
+  std::vector<char *> &idle = pool_free[__builtin_ctzll(sz)];
+  std::lock_guard<std::mutex> guard(pool_lock);
+  if (!idle.empty()) {
+    char *b = idle.back();
+    idle.pop_back();
+    return b;
+  } else if (sz >= pool_chunk) {
+    return io61_pool_map(sz);
+  }
+  // a new chunk: the buffer is its first `sz` bytes, and the rest
+  // splits into free buffers of `sz`, `2 * sz`, ..., `pool_chunk / 2`
+  char *chunk = io61_pool_map(pool_chunk);
+  if (!chunk) {
+    return nullptr;
+  }
+  for (size_t off = sz; off != pool_chunk; off *= 2) {
+    pool_free[__builtin_ctzll(off)].push_back(chunk + off);
+  }
+  return chunk;
+}
+
+// io61_pool_put(b, sz)
+//    Return buffer `b` of `sz` bytes to the pool.
+
+void io61_pool_put(char *b, size_t sz) {
+  std::vector<char *> &idle = pool_free[__builtin_ctzll(sz)];
+  std::lock_guard<std::mutex> guard(pool_lock);
+  if (sz < pool_chunk || idle.size() < pool_keep) {
+    idle.push_back(b);
+  } else {
+    munmap(b, sz);
+  }
+}
+
+// io61_guard
+//    Holds the lock of an io61_file for the guard's lifetime, once the
+//    process has threads; until then nobody else can hold it.
+
+struct io61_guard {
+  io61_file *f;
+
+  explicit io61_guard(io61_file *f_)
+      : f(io61_single_threaded() ? nullptr : f_) {
+    if (f) {
+      f->lock.lock();
+    }
+  }
+  ~io61_guard() {
+    if (f) {
+      f->lock.unlock();
+    }
+  }
+  io61_guard(const io61_guard &) = delete;
+  io61_guard &operator=(const io61_guard &) = delete;
+};
+
+// default for io61_file::dirty_limit; override with $IO61_DIRTY_LIMIT, a
+// positive number of bytes up to `max_dirty_limit`
+static constexpr size_t default_dirty_limit = 32 << 20;
+static constexpr size_t max_dirty_limit = size_t(1) << 30;
+
+// io61_async
+//    State shared between an io61_file and its background worker thread.
+//    The caller owns the io61_file's own buffer; the worker owns `slots`
+//    that are not `full`. For read-only files the worker fills slots ahead
+//    of the caller; for write-only files it drains slots the caller has
+//    handed it. Slots are used in ring order.
+
+struct io61_async {
+  struct slot {
+    std::unique_ptr<char[]> buf;
+    off_t off;          // file offset of the first byte (writes only)
+    ssize_t len;        // bytes in `buf`; 0 is end of file, -1 an error
+    bool full = false;
+  };
 
-// io61_file
-//    Data structure for io61 file wrappers. Add your own stuff.
-struct io61_file {
   int fd;
   int mode;
-  static constexpr off_t bufsize = 8192;
-  char cbuf[bufsize];
-  off_t tag;
-  off_t beg_tag; // start of buffer
-  off_t end_tag; // end of buffer
-  off_t pos_tag; // current position in buffer
+  bool positional;
+  size_t bufsize;
+  int wake = -1;        // eventfd signaled by io61_async_stop
+  std::vector<slot> slots;
+  size_t head = 0;      // next slot the caller takes (reads) or the
+                        // worker drains (writes)
+  size_t tail = 0;      // next slot the worker fills (reads) or the
+                        // caller hands over (writes)
+  size_t nfull = 0;
+  bool stop = false;
+  bool done = false;    // worker has exited
+  int err = 0;          // errno from a failed background write
+  io61_stats stats;     // the worker's system calls
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::thread worker;
 };
 
-// io61_fdopen(fd, mode)
-//    Return a new io61_file for file descriptor `fd`. `mode` is
-//    either O_RDONLY for a read-only file or O_WRONLY for a
-//    write-only file. You need not support read/write files.
+// io61_append
+//    The shared write buffer of a write-only file that several threads
+//    write to. A writer reserves room for its bytes with one
+//    compare-and-swap on `state`, which packs the bytes reserved in `buf`
+//    with the number of writers still copying into it, and then copies
+//    them in without a lock. Whoever finds the buffer full seals it, so
+//    no more reservations succeed, waits for its writers, and swaps in
+//    the other buffer before writing the full one out. Full buffers are
+//    written under `wm` in the order they were sealed, so records reach
+//    the file in the order they were reserved and never interleave.
 
-io61_file *io61_fdopen(int fd, int mode) {
-  assert(fd >= 0);
+struct io61_append {
+  static constexpr size_t cap = 64 << 10;     // bytes per buffer
+  static constexpr uint64_t sealed = 1ULL << 63;
+  static constexpr int used_shift = 32;
+
+  alignas(64) std::atomic<uint64_t> state{0};
+  std::atomic<unsigned long> requests{0};
+  std::atomic<int> err{0};      // errno from a failed write
+  alignas(64) char *buf;        // buffer taking reservations
+  std::unique_ptr<char[]> bufs[2];
+  off_t off;                    // file offset of `buf[0]`
+  std::mutex m;                 // held to seal and swap `buf`
+  std::mutex wm;                // held to write a sealed buffer
+  io61_stats stats;             // system calls made under `wm`
+
+  static size_t used(uint64_t s) {
+    return (s & ~sealed) >> used_shift;
+  }
+  static uint32_t writers(uint64_t s) {
+    return s;
+  }
+};
+
+// io61_inputs
+//    The files behind a stream from io61_open_concat. A worker thread
+//    keeps up to `ahead` of the files after the current one open, each
+//    with its first buffer already read, so that moving on to the next
+//    file costs the reader no system calls. If `ahead` is 0 there is no
+//    worker, and the reader opens each file when it gets there.
+
+struct io61_inputs {
+  struct input {
+    int fd;
+    int err;                     // errno from `open` or `read`, or 0
+    ssize_t len;                 // bytes in `buf`
+    std::unique_ptr<char[]> buf; // the file's first `bufsize` bytes
+  };
+  std::vector<std::string> names;
+  size_t ahead;
+  size_t bufsize;
+  size_t nopened = 0;            // files the worker has opened
+  size_t ntaken = 0;             // files the reader has taken
+  std::deque<input> ready;       // opened files not yet taken, in order
+  bool stop = false;
+  io61_stats stats;              // the worker's system calls
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::thread worker;
+};
+
+// io61_inputs_open(name, bufsize, st)
+//    Open the file `name` and read its first `bufsize` bytes, recording
+//    system calls in `st`.
+
+static io61_inputs::input io61_inputs_open(const char *name, size_t bufsize,
+                                           io61_stats &st) {
+  io61_inputs::input x = {-1, 0, 0,
+                          std::unique_ptr<char[]>(new char[bufsize])};
+  x.fd = open(name, O_RDONLY | O_CLOEXEC);
+  if (x.fd < 0) {
+    x.err = errno;
+    return x;
+  }
+  do {
+    x.len = io61_timed(st, S_READ,
+                       [&] { return read(x.fd, x.buf.get(), bufsize); });
+  } while (x.len < 0 && errno == EINTR);
+  x.err = x.len < 0 ? errno : 0;
+  return x;
+}
+
+// io61_inputs_run(in)
+//    Body of the worker thread that opens the inputs of a concatenated
+//    stream ahead of the reader.
+
+static void io61_inputs_run(std::shared_ptr<io61_inputs> in) {
+  std::unique_lock<std::mutex> guard(in->m);
+  while (!in->stop && in->nopened < in->names.size()) {
+    if (in->ready.size() >= in->ahead) {
+      in->cv.wait(guard);
+      continue;
+    }
+    const char *name = in->names[in->nopened].c_str();
+    guard.unlock();
+    io61_stats st;
+    io61_inputs::input x = io61_inputs_open(name, in->bufsize, st);
+    guard.lock();
+    in->stats.merge(st);
+    in->ready.push_back(std::move(x));
+    ++in->nopened;
+    in->cv.notify_all();
+  }
+}
+
+// io61_async_run(a)
+//    Body of the background worker thread.
+
+static void io61_async_run(std::shared_ptr<io61_async> a) {
+  std::unique_lock<std::mutex> guard(a->m);
+  while (!a->stop) {
+    if (a->mode == O_RDONLY && a->nfull < a->slots.size()) {
+      // prefetch the next buffer once it can be read without blocking,
+      // unless io61_async_stop wakes us first
+      auto &s = a->slots[a->tail];
+      guard.unlock();
+      struct pollfd pfd[2] = {{a->fd, POLLIN, 0}, {a->wake, POLLIN, 0}};
+      while (poll(pfd, 2, -1) < 0 && errno == EINTR) {
+      }
+      guard.lock();
+      if (a->stop) {
+        break;
+      }
+      guard.unlock();
+      io61_stats st;
+      ssize_t n;
+      do {
+        n = io61_timed(st, S_READ,
+                       [&] { return read(a->fd, s.buf.get(), a->bufsize); });
+      } while (n < 0 && errno == EINTR);
+      guard.lock();
+      a->stats.merge(st);
+      s.len = n;
+      s.full = true;
+      a->tail = (a->tail + 1) % a->slots.size();
+      ++a->nfull;
+      a->cv.notify_all();
+      if (n <= 0) {
+        break;
+      }
+    } else if (a->mode == O_WRONLY && a->nfull > 0) {
+      // write out the oldest handed-over buffer
+      auto &s = a->slots[a->head];
+      guard.unlock();
+      io61_stats st;
+      ssize_t done = 0;
+      while (done < s.len) {
+        ssize_t n;
+        if (a->positional) {
+          n = io61_timed(st, S_PWRITE, [&] {
+            return pwrite(a->fd, s.buf.get() + done, s.len - done,
+                          s.off + done);
+          });
+        } else {
+          n = io61_timed(st, S_WRITE, [&] {
+            return write(a->fd, s.buf.get() + done, s.len - done);
+          });
+        }
+        if (n < 0 && errno == EINTR) {
+          continue;
+        } else if (n <= 0) {
+          a->err = n < 0 ? errno : EIO;
+          break;
+        }
+        done += n;
+      }
+      guard.lock();
+      a->stats.merge(st);
+      s.full = false;
+      a->head = (a->head + 1) % a->slots.size();
+      --a->nfull;
+      a->cv.notify_all();
+    } else {
+      a->cv.wait(guard);
+    }
+  }
+  a->done = true;
+  a->cv.notify_all();
+}
+
+// io61_async_start(f, nbufs)
+//    Give `f` a background worker, making it `nbufs`-buffered: the
+//    caller's buffer plus `nbufs - 1` slots for the worker. Does nothing
+//    unless `nbufs` is 2 or 3, or if no eventfd is available.
+
+static void io61_async_start(io61_file *f, long nbufs) {
+  if (nbufs < 2 || nbufs > 3) {
+    return;
+  }
+  auto a = std::make_shared<io61_async>();
+  a->wake = eventfd(0, EFD_CLOEXEC);
+  if (a->wake < 0) {
+    return;
+  }
+  a->fd = f->fd;
+  a->mode = f->mode;
+  a->positional = f->positional;
+  a->bufsize = f->bufsize;
+  a->slots.resize(nbufs - 1);
+  for (auto &s : a->slots) {
+    s.buf.reset(new char[f->bufsize]);
+  }
+  a->worker = std::thread(io61_async_run, a);
+  f->async = a;
+}
+
+// io61_async_stop(f)
+//    Shut down the background worker of `f`, which returns to synchronous
+//    I/O. Pending writes are drained first; prefetched reads are dropped.
+//    A reader waiting on a pipe or terminal is woken through `wake` and
+//    exits without reading, so the worker is always joined before `f`'s
+//    descriptor can be closed.
+
+static void io61_async_stop(io61_file *f) {
+  auto a = f->async;
+  if (!a) {
+    return;
+  }
+  std::unique_lock<std::mutex> guard(a->m);
+  while (a->mode == O_WRONLY && a->nfull > 0 && !a->done) {
+    a->cv.wait(guard);
+  }
+  a->stop = true;
+  a->cv.notify_all();
+  guard.unlock();
+  uint64_t one = 1;
+  ssize_t r = write(a->wake, &one, sizeof(one));
+  (void)r;
+  a->worker.join();
+  close(a->wake);
+  f->stats.merge(a->stats);
+  f->async = nullptr;
+}
+
+// io61_async_take(f)
+//    Wait for the worker of read-only file `f` to prefetch a buffer, then
+//    move it into `f`'s own buffer. Returns the number of bytes moved, 0
+//    at end of file, or -1 on error.
+
+static ssize_t io61_async_take(io61_file *f) {
+  auto a = f->async;
+  std::unique_lock<std::mutex> guard(a->m);
+  while (a->nfull == 0) {
+    a->cv.wait(guard);
+  }
+  auto &s = a->slots[a->head];
+  ssize_t n = s.len;
+  if (n > 0) {
+    memcpy(f->cbuf, s.buf.get(), n);
+    s.full = false;
+    a->head = (a->head + 1) % a->slots.size();
+    --a->nfull;
+    a->cv.notify_all();
+  }
+  // leave end-of-file and error slots in place for later fills
+  return n;
+}
+
+// io61_async_give(f, wait)
+//    Hand the write buffer of write-only file `f` to its worker. If
+//    `wait` is true, also wait until every handed-over buffer is written.
+//    Returns 0 on success and -1 if a background write failed.
+
+static int io61_async_give(io61_file *f, bool wait) {
+  auto a = f->async;
+  std::unique_lock<std::mutex> guard(a->m);
+  if (f->pos_tag > f->beg_tag) {
+    while (a->nfull == a->slots.size()) {
+      a->cv.wait(guard);
+    }
+    auto &s = a->slots[a->tail];
+    s.off = f->beg_tag;
+    s.len = f->pos_tag - f->beg_tag;
+    memcpy(s.buf.get(), f->cbuf, s.len);
+    s.full = true;
+    a->tail = (a->tail + 1) % a->slots.size();
+    ++a->nfull;
+    a->cv.notify_all();
+    f->beg_tag = f->end_tag = f->pos_tag;
+  }
+  while (wait && a->nfull > 0) {
+    a->cv.wait(guard);
+  }
+  if (a->err) {
+    errno = a->err;
+    a->err = 0;
+    return -1;
+  }
+  return 0;
+}
+
+// io61_offset_seek(f, pos)
+//    `seek` for backends that pass explicit offsets on every transfer.
+
+off_t io61_offset_seek(io61_file *f, off_t pos) {
+  (void)f;
+  if (pos < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  return pos;
+}
+
+// io61_fd_close(f)
+//    Close the file descriptor of `f`, first leaving its offset where a
+//    plain `write` loop would have if writes went to explicit offsets.
+
+int io61_fd_close(io61_file *f) {
+  if (f->positional) {
+    io61_timed(f->stats, S_LSEEK,
+               [&] { return lseek(f->fd, f->pos_tag, SEEK_SET); });
+  }
+  return close(f->fd);
+}
+
+// io61_scattered(f)
+//    Return whether fills of `f` should read one block, however large
+//    the buffer is: its reads are random, or strided more than a block
+//    apart, when a whole buffer would copy more bytes between two reads
+//    than the one block a miss costs. A strided reader's last seek may
+//    also go back to the start of its next pass, which is as far. Other
+//    fills read a whole buffer.
+
+bool io61_scattered(io61_file *f) {
+  return f->pattern == P_RANDOM
+         || (f->pattern == P_STRIDED
+             && (f->delta > f->blksize || f->delta < -f->blksize));
+}
+
+// buffered backend: `read`, and `write` or `pwrite`, one buffer at a
+// time, optionally handed to a background worker ($IO61_ASYNC)
+
+static bool io61_buffered_open(io61_file *f) {
+  if (const char *nbufs = getenv("IO61_ASYNC")) {
+    io61_async_start(f, strtol(nbufs, nullptr, 0));
+  }
+  return true;
+}
+
+static ssize_t io61_buffered_fill(io61_file *f) {
+  if (f->async) {
+    return io61_async_take(f);
+  }
+  size_t n = io61_scattered(f) ? std::min(f->bufcap, f->blksize) : f->bufcap;
+  return io61_timed(f->stats, S_READ,
+                    [&] { return read(f->fd, f->cbuf, n); });
+}
+
+int io61_buffered_flush(io61_file *f, bool wait) {
+  if (f->async) {
+    return io61_async_give(f, wait);
+  }
+  // retry short writes from where they stopped
+  const char *p = f->cbuf;
+  size_t len = f->pos_tag - f->beg_tag;
+  off_t off = f->beg_tag;
+  int r = 0;
+  while (len > 0) {
+    ssize_t n;
+    if (f->positional) {
+      n = io61_timed(f->stats, S_PWRITE,
+                     [&] { return pwrite(f->fd, p, len, off); });
+    } else {
+      n = io61_timed(f->stats, S_WRITE,
+                     [&] { return write(f->fd, p, len); });
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      r = -1;
+      break;
+    }
+    p += n;
+    len -= n;
+    off += n;
+  }
+  f->beg_tag = f->end_tag = f->pos_tag;
+  return r;
+}
+
+static off_t io61_buffered_seek(io61_file *f, off_t pos) {
+  return io61_timed(f->stats, S_LSEEK,
+                    [&] { return lseek(f->fd, pos, SEEK_SET); });
+}
+
+static int io61_buffered_close(io61_file *f) {
+  io61_async_stop(f);
+  return io61_fd_close(f);
+}
+
+// slow backend: one-byte buffer, so each character is its own system
+// call, like slow-io61.cc
+
+static bool io61_slow_open(io61_file *f) {
+  f->bufcap = 1;
+  f->positional = false;
+  return true;
+}
+
+// stdio backend: io61's buffer in front of a stdio FILE
+
+static bool io61_stdio_open(io61_file *f) {
+  f->stdio = fdopen(f->fd, f->mode == O_RDONLY ? "r" : "w");
+  if (f->stdio) {
+    f->positional = false;
+  }
+  return f->stdio != nullptr;
+}
+
+static ssize_t io61_stdio_fill(io61_file *f) {
+  size_t n = fread(f->cbuf, 1, f->bufcap, f->stdio);
+  return n == 0 && ferror(f->stdio) ? -1 : (ssize_t)n;
+}
+
+static int io61_stdio_flush(io61_file *f, bool wait) {
+  size_t len = f->pos_tag - f->beg_tag;
+  bool ok = fwrite(f->cbuf, 1, len, f->stdio) == len
+            && (!wait || fflush(f->stdio) == 0);
+  f->beg_tag = f->end_tag = f->pos_tag;
+  return ok ? 0 : -1;
+}
+
+static off_t io61_stdio_seek(io61_file *f, off_t pos) {
+  return fseeko(f->stdio, pos, SEEK_SET) == 0 ? pos : -1;
+}
+
+static int io61_stdio_close(io61_file *f) {
+  return fclose(f->stdio);
+}
+
+// concat backend: the files of an io61_inputs, one after another, each
+// taken over from the worker with its first buffer already read
+
+static bool io61_concat_open(io61_file *f) {
+  return f->inputs != nullptr;
+}
+
+// io61_concat_next(f, len)
+//    Make the next input of `f` current and copy its first buffer into
+//    `cbuf`, setting `*len` to the number of bytes copied or -1. Returns
+//    false if no inputs remain. Inputs that cannot be opened are
+//    reported and skipped, as cat(1) does.
+
+static bool io61_concat_next(io61_file *f, ssize_t *len) {
+  io61_inputs &in = *f->inputs;
+  std::unique_lock<std::mutex> guard(in.m);
+  while (true) {
+    if (in.ntaken == in.names.size()) {
+      return false;
+    }
+    const std::string &name = in.names[in.ntaken++];
+    io61_inputs::input x;
+    if (in.ahead == 0) {
+      x = io61_inputs_open(name.c_str(), in.bufsize, f->stats);
+    } else {
+      while (in.ready.empty()) {
+        in.cv.wait(guard);
+      }
+      x = std::move(in.ready.front());
+      in.ready.pop_front();
+      in.cv.notify_all();
+    }
+    if (x.fd < 0) {
+      fprintf(stderr, "%s: %s\n", name.c_str(), strerror(x.err));
+      continue;
+    }
+    f->fd = x.fd;
+    if (x.len < 0) {
+      errno = x.err;
+    } else {
+      memcpy(f->cbuf, x.buf.get(), x.len);
+    }
+    *len = x.len;
+    return true;
+  }
+}
+
+static ssize_t io61_concat_fill(io61_file *f) {
+  while (true) {
+    ssize_t n;
+    if (f->fd >= 0) {
+      n = io61_timed(f->stats, S_READ,
+                     [&] { return read(f->fd, f->cbuf, f->bufcap); });
+      if (n != 0) {
+        return n;
+      }
+      close(f->fd);
+      f->fd = -1;
+    }
+    if (!io61_concat_next(f, &n)) {
+      return 0;
+    } else if (n != 0) {
+      return n;
+    }
+  }
+}
+
+static off_t io61_concat_seek(io61_file *f, off_t pos) {
+  (void)f, (void)pos;
+  errno = ESPIPE;
+  return -1;
+}
+
+static int io61_concat_close(io61_file *f) {
+  io61_inputs &in = *f->inputs;
+  {
+    std::lock_guard<std::mutex> guard(in.m);
+    in.stop = true;
+    in.cv.notify_all();
+  }
+  if (in.worker.joinable()) {
+    in.worker.join();
+  }
+  for (auto &x : in.ready) {
+    if (x.fd >= 0) {
+      close(x.fd);
+    }
+  }
+  f->stats.merge(in.stats);
+  return f->fd >= 0 ? close(f->fd) : 0;
+}
+
+// io61_iov_skip(iov, niov, n)
+//    Advance the iovec array `iov` of `niov` entries past its first `n`
+//    bytes, dropping entries that are used up.
+
+void io61_iov_skip(struct iovec *&iov, int &niov, size_t n) {
+  while (niov > 0 && n >= iov->iov_len) {
+    n -= iov->iov_len;
+    ++iov;
+    --niov;
+  }
+  if (niov > 0 && n > 0) {
+    iov->iov_base = (char *)iov->iov_base + n;
+    iov->iov_len -= n;
+  }
+}
+
+// io61_pwritev_all(f, iov, niov, off)
+//    Write all of `iov` to `f` at `off`, retrying short writes from
+//    where they stopped. Modifies `iov`. Returns 0 on success and -1 on
+//    error.
+
+int io61_pwritev_all(io61_file *f, struct iovec *iov, int niov, off_t off) {
+  while (niov > 0) {
+    ssize_t n = io61_timed(f->stats, S_PWRITEV, [&] {
+      return pwritev(f->fd, iov, std::min(niov, IOV_MAX), off);
+    });
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return -1;
+    }
+    off += n;
+    io61_iov_skip(iov, niov, n);
+  }
+  return 0;
+}
+
+static const io61_backend io61_backends[] = {
+    {"buffered", io61_buffered_open, io61_buffered_fill, io61_buffered_flush,
+     io61_buffered_seek, io61_buffered_close, true},
+    {"uring", io61_uring_open, io61_uring_fill, io61_uring_give,
+     io61_offset_seek, io61_uring_close, true},
+    {"slow", io61_slow_open, io61_buffered_fill, io61_buffered_flush,
+     io61_buffered_seek, io61_buffered_close, false},
+    {"stdio", io61_stdio_open, io61_stdio_fill, io61_stdio_flush,
+     io61_stdio_seek, io61_stdio_close, false},
+    {"mmap", io61_mmap_open, io61_mmap_fill, io61_mmap_flush,
+     io61_mmap_seek, io61_mmap_close, false},
+    {"direct", io61_direct_open, io61_direct_fill, io61_direct_flush,
+     io61_offset_seek, io61_direct_close, false},
+    {"concat", io61_concat_open, io61_concat_fill, io61_buffered_flush,
+     io61_concat_seek, io61_concat_close, false},
+    {"lz", io61_lz_open, io61_lz_fill, io61_lz_flush, io61_lz_seek,
+     io61_lz_close, false},
+    {"mem", io61_mem_open, io61_mem_fill, io61_mem_flush, io61_mem_seek,
+     io61_mem_close, false},
+    {"rdwr", io61_rdwr_open, io61_rdwr_fill, io61_rdwr_flush,
+     io61_offset_seek, io61_rdwr_close, false}};
+
+// io61_backend_find(spec, mode)
+//    Return the backend that `spec` names for files opened with `mode`.
+//    `spec` is a comma-separated list of backend names, each optionally
+//    prefixed by "r:" or "w:" to apply only to read-only or write-only
+//    files; the last entry that applies wins. For example, "r:direct"
+//    reads without the page cache and writes through the default
+//    backend. Returns the default backend if no entry applies.
+
+static const io61_backend *io61_backend_find(const char *spec, int mode) {
+  const io61_backend *b = &io61_backends[0];
+  while (spec && *spec) {
+    size_t len = strcspn(spec, ",");
+    std::string name(spec, len);
+    spec += len + (spec[len] == ',');
+    if (name.size() > 2 && name[1] == ':'
+        && (name[0] == 'r' || name[0] == 'w')) {
+      if ((name[0] == 'r') != (mode == O_RDONLY)) {
+        continue;
+      }
+      name.erase(0, 2);
+    }
+    for (auto &candidate : io61_backends) {
+      if (name == candidate.name) {
+        b = &candidate;
+      }
+    }
+  }
+  return b;
+}
+
+// buffer sizes chosen by io61_bufsize
+static constexpr off_t default_bufsize = 8192;
+static constexpr off_t max_auto_bufsize = 64 << 10;
+static constexpr off_t max_bufsize = off_t(1) << 30;
+
+// io61_bufsize(f)
+//    Choose the buffer size and block size of new file `f`. The block
+//    size is the file system's preferred transfer size, `st_blksize`.
+//    Pipes, sockets and terminals, and files with no descriptor, get
+//    `default_bufsize`, or a block if that is larger. A read-only file
+//    gets a buffer that holds the whole file, if it is small, and
+//    otherwise `max_auto_bufsize`; a write-only file gets
+//    `max_auto_bufsize`; a read/write file, whose backend caches data
+//    elsewhere, gets one block. $IO61_BUFSIZE, if set to a positive
+//    number, overrides the buffer size, up to `max_bufsize`; other values
+//    are ignored. Sizes are rounded up to pool buffer sizes.
+
+static void io61_bufsize(io61_file *f) {
+  struct stat st;
+  off_t size = default_bufsize;
+  f->blksize = default_bufsize;
+  if (f->fd >= 0 && fstat(f->fd, &st) == 0) {
+    f->blksize = io61_pool_size(
+        std::min<off_t>(std::max<off_t>(st.st_blksize, 1), max_auto_bufsize));
+    if (!S_ISREG(st.st_mode)) {
+      size = std::max(size, f->blksize);
+    } else if (f->mode == O_RDONLY) {
+      size = std::min<off_t>(std::max(st.st_size, f->blksize),
+                             max_auto_bufsize);
+    } else if (f->mode == O_WRONLY) {
+      size = max_auto_bufsize;
+    } else {
+      size = f->blksize;
+    }
+  }
+  if (const char *env = getenv("IO61_BUFSIZE")) {
+    char *end;
+    long n = strtol(env, &end, 0);
+    if (end != env && *end == '\0' && n > 0) {
+      // strtol saturates at LONG_MAX on overflow
+      size = std::min<off_t>(n, max_bufsize);
+    }
+  }
+  f->bufsize = io61_pool_size(size);
+}
+
+// io61_file_new(fd, mode)
+//    Return a new io61_file for `fd`, which may be -1 for a file whose
+//    backend opens descriptors itself. The file has no backend yet.
+//    Returns nullptr, with `errno` set to ENOMEM, if no buffer can be had.
+
+static io61_file *io61_file_new(int fd, int mode) {
   io61_file *f = new io61_file;
   f->fd = fd;
   f->mode = mode;
+  // tags are file offsets, so start them at the current offset
+  off_t start = fd < 0 ? -1 : io61_timed(f->stats, S_LSEEK, [&] {
+    return lseek(fd, 0, SEEK_CUR);
+  });
+  f->beg_tag = f->end_tag = f->pos_tag = start >= 0 ? start : 0;
+  io61_bufsize(f);
+  f->buf = io61_pool_get(f->bufsize);
+  if (!f->buf) {
+    delete f;
+    errno = ENOMEM;
+    return nullptr;
+  }
+  f->cbuf = f->buf;
+  f->bufcap = f->bufsize;
+  f->seekable = start >= 0;
+  f->seek_tag = f->beg_tag;
+  f->span = f->delta = 0;
+  f->streak = f->misses = 0;
+  f->pattern = P_SEQUENTIAL;
+  f->advised = false;
+  f->hint_tag = -1;
+
+  // writes to seekable files go through the write-back cache
+  f->positional = mode == O_WRONLY && start >= 0
+                  && !(fcntl(fd, F_GETFL) & O_APPEND);
+  f->dirty_bytes = 0;
+  f->dirty_limit = default_dirty_limit;
+  if (const char *env = getenv("IO61_DIRTY_LIMIT")) {
+    char *end;
+    long long n = strtoll(env, &end, 0);
+    if (end != env && *end == '\0' && n > 0) {
+      f->dirty_limit = std::min<unsigned long long>(n, max_dirty_limit);
+    }
+  }
+
+  f->pbuf_tag = f->pbuf_end = 0;
+
+  f->crc_tag = f->pos_tag;
+  f->crc_on = getenv("IO61_CHECKSUM") != nullptr;
+
+  f->uring = nullptr;
   return f;
 }
 
+// io61_file_use(f, b)
+//    Give `f` the backend `b`, or the default backend if `f` cannot use
+//    `b`.
+
+static void io61_file_use(io61_file *f, const io61_backend *b) {
+  if (!b->open(f)) {
+    b = &io61_backends[0];
+    b->open(f);
+  }
+  f->backend = b;
+  f->appendable = f->mode == O_WRONLY && b->passthrough;
+  f->fill = b->fill;
+  f->flush = b->flush;
+  f->seek = b->seek;
+  f->close = b->close;
+}
+
+// io61_trace
+//    Access trace of one file, written to the file named by $IO61_TRACE
+//    for io61sim to replay. Each line is a record of the file's `id`:
+//
+//        ID open MODE SIZE POS   MODE is r, w, or rw; SIZE is -1 if unknown
+//        ID [@SEEK] [OP] [xN]    OP is c (readc), C (writec), rBYTES
+//                                (read), or wBYTES (write); SEEK moves the
+//                                position by that much first; xN repeats
+//                                the record N times
+//        ID close
+//
+//    Seeks, reads, writes, and byte operations that reach the library are
+//    recorded as they happen; a positional transfer is a seek there, the
+//    transfer, and a seek back, and other calls that move the position
+//    (io61_readline, io61_readv, io61_writev, io61_copy) are one read or
+//    write. Transfers that the inline functions of io61.hh finish without
+//    the library are seen at the next library call, as a run with the
+//    request count and byte total since the last one.
+
+struct io61_trace {
+  struct record {
+    bool seeking = false;
+    off_t seek = 0;
+    char op = 0;        // 0 for a seek alone
+    off_t n = 0;        // bytes, for 'r' and 'w'
+    unsigned long count = 0;
+  };
+  std::string id;
+  off_t pos;              // `pos_tag` at the last library call
+  off_t end;              // `end_tag` then
+  unsigned long requests; // `requests` then
+  record last;            // not yet written, in case it repeats
+  int depth = 0;          // traced calls in progress
+  bool seeking = false;   // a seek waits for the next transfer
+  off_t seek = 0;
+  std::string out;        // records not yet written to the trace file
+};
+
+static constexpr size_t trace_flush_size = 64 << 10;
+
+// io61_trace_fd()
+//    Return the descriptor of the trace file, opening it on first use, or
+//    -1 if $IO61_TRACE is unset or cannot be opened. Processes that share
+//    the file append whole lines, so their records interleave cleanly.
+
+static int io61_trace_fd() {
+  static const int fd = [] {
+    const char *name = getenv("IO61_TRACE");
+    return name && *name
+               ? open(name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666)
+               : -1;
+  }();
+  return fd;
+}
+
+// io61_trace_write(t)
+//    Write the records buffered in `t` to the trace file. Errors are
+//    ignored; the trace is only a diagnostic.
+
+static void io61_trace_write(io61_trace *t) {
+  size_t off = 0;
+  while (off < t->out.size()) {
+    ssize_t n = write(io61_trace_fd(), t->out.data() + off,
+                      t->out.size() - off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      break;
+    }
+    off += n;
+  }
+  t->out.clear();
+}
+
+// io61_trace_emit(t, r)
+//    Add record `r` to trace `t`, merging it into the previous record if
+//    the two differ only in count.
+
+static void io61_trace_emit(io61_trace *t, const io61_trace::record &r) {
+  io61_trace::record &l = t->last;
+  if (l.count && l.seeking == r.seeking && l.seek == r.seek
+      && l.op == r.op && l.n == r.n) {
+    l.count += r.count;
+    return;
+  }
+  if (l.count) {
+    char buf[96];
+    int len = snprintf(buf, sizeof(buf), "%s", t->id.c_str());
+    if (l.seeking) {
+      len += snprintf(buf + len, sizeof(buf) - len, " @%+lld",
+                      (long long)l.seek);
+    }
+    if (l.op == 'r' || l.op == 'w') {
+      len += snprintf(buf + len, sizeof(buf) - len, " %c%lld", l.op,
+                      (long long)l.n);
+    } else if (l.op) {
+      len += snprintf(buf + len, sizeof(buf) - len, " %c", l.op);
+    }
+    if (l.count > 1) {
+      len += snprintf(buf + len, sizeof(buf) - len, " x%lu", l.count);
+    }
+    t->out.append(buf, len);
+    t->out += '\n';
+    if (t->out.size() >= trace_flush_size) {
+      io61_trace_write(t);
+    }
+  }
+  l = r;
+}
+
+// io61_trace_seek(t, delta)
+//    Record a seek by `delta` bytes in `t`. It is written with the
+//    transfer that follows it; seeks in a row are written as one.
+
+static void io61_trace_seek(io61_trace *t, off_t delta) {
+  t->seek = t->seeking ? t->seek + delta : delta;
+  t->seeking = true;
+}
+
+// io61_trace_run(t, op, n, count)
+//    Record `count` transfers of type `op` moving `n` bytes in all: `op`
+//    is 'c' or 'C' for byte operations, or 'r' or 'w' for transfers of
+//    `n / count` bytes each, the last taking the remainder. A pending
+//    seek goes with the first.
+
+static void io61_trace_run(io61_trace *t, char op, off_t n,
+                           unsigned long count) {
+  auto put = [&](off_t bytes, unsigned long k) {
+    io61_trace::record r;
+    r.op = op;
+    r.n = op == 'r' || op == 'w' ? bytes : 0;
+    r.count = k;
+    if (k && t->seeking) {
+      r.seeking = true;
+      r.seek = t->seek;
+      r.count = 1;
+      io61_trace_emit(t, r);
+      t->seeking = false;
+      r = io61_trace::record{false, 0, r.op, r.n, k - 1};
+    }
+    if (r.count) {
+      io61_trace_emit(t, r);
+    }
+  };
+  put(n / count, count - 1);
+  put(n / count + n % count, 1);
+}
+
+// io61_trace_sync(f, skip)
+//    Record the requests that the inline functions finished on `f` since
+//    the last library call, not counting the `skip` most recent, which
+//    the caller records itself. Reads and writes are told apart by mode,
+//    or for a read/write file by whether the buffer grew.
+
+static void io61_trace_sync(io61_file *f, unsigned long skip) {
+  io61_trace *t = f->trace;
+  unsigned long k = f->requests - skip - t->requests;
+  off_t d = f->pos_tag - t->pos;
+  off_t dw = f->mode == O_WRONLY ? d
+             : f->mode == O_RDONLY ? 0
+                                   : std::clamp(f->end_tag - t->end,
+                                                off_t(0), std::max(d, off_t(0)));
+  if (d < 0 || (k == 0 && d != 0)) {
+    io61_trace_seek(t, d);   // moved by a call that is not traced
+  } else if (k != 0 && d != 0) {
+    // a run of both splits the requests between them by bytes
+    unsigned long kw = dw == d ? k : dw == 0 ? 0
+                       : k < 2 ? 1
+                               : std::clamp<unsigned long>(k * dw / d, 1,
+                                                           k - 1);
+    unsigned long kr = std::max<unsigned long>(k - kw, 1);
+    if (d - dw) {
+      io61_trace_run(t, d - dw == off_t(kr) ? 'c' : 'r', d - dw, kr);
+    }
+    if (dw) {
+      io61_trace_run(t, dw == off_t(kw) ? 'C' : 'w', dw, kw);
+    }
+  }
+  t->pos = f->pos_tag;
+  t->end = f->end_tag;
+  t->requests = f->requests - skip;
+}
+
+// io61_traced
+//    Records one traced call on `f` for the lifetime of the object: a
+//    read ('r'), write ('w'), byte read ('c') or write ('C'), or seek
+//    ('@'). `skip` is 1 if the inline caller already counted the request.
+//    A positional transfer of `len` bytes at `off` is recorded as a seek
+//    there and back around it. Calls made inside another traced call are
+//    part of it. Does nothing for untraced files.
+
+struct io61_traced {
+  io61_file *f;
+  io61_trace *t;  // null if `f` is untraced
+  bool outer;     // whether this is not inside another traced call
+  char op;
+  off_t off;
+  size_t len;
+
+  io61_traced(io61_file *f_, char op_, unsigned long skip = 0,
+              off_t off_ = -1, size_t len_ = 0)
+      : f(f_), t(f_->trace), outer(t && t->depth++ == 0), op(op_),
+        off(off_), len(len_) {
+    if (outer) {
+      io61_trace_sync(f, skip);
+    }
+  }
+  ~io61_traced() {
+    if (!t) {
+      return;
+    } else if (!outer) {
+      --t->depth;
+      return;
+    }
+    off_t d = f->pos_tag - t->pos;
+    if (off >= 0) {
+      io61_trace_seek(t, off - t->pos);
+      io61_trace_run(t, op, len, 1);
+      io61_trace_seek(t, t->pos - (off + off_t(len)));
+    } else if (op == '@') {
+      io61_trace_seek(t, d);
+    } else if ((op == 'c' || op == 'C') && d == 1) {
+      io61_trace_run(t, op, 1, 1);
+    } else {
+      // a byte operation that moved nothing is an empty transfer
+      io61_trace_run(t, op == 'c' ? 'r' : op == 'C' ? 'w' : op,
+                     std::max(d, off_t(0)), 1);
+    }
+    t->pos = f->pos_tag;
+    t->end = f->end_tag;
+    t->requests = f->requests;
+    --t->depth;
+  }
+  io61_traced(const io61_traced &) = delete;
+  io61_traced &operator=(const io61_traced &) = delete;
+};
+
+// io61_trace_start(f)
+//    Start tracing `f` if $IO61_TRACE names a trace file.
+
+static void io61_trace_start(io61_file *f) {
+  static std::atomic<unsigned> nfiles{0};
+  if (io61_trace_fd() < 0) {
+    return;
+  }
+  io61_trace *t = new io61_trace;
+  t->id = std::to_string(getpid()) + "." + std::to_string(nfiles++);
+  t->pos = f->pos_tag;
+  t->end = f->end_tag;
+  t->requests = f->requests;
+  struct stat s;
+  off_t size = fstat(f->fd, &s) == 0 && S_ISREG(s.st_mode) ? s.st_size : -1;
+  char buf[96];
+  snprintf(buf, sizeof(buf), "%s open %s %lld %lld\n", t->id.c_str(),
+           f->mode == O_RDONLY ? "r" : f->mode == O_WRONLY ? "w" : "rw",
+           (long long)size, (long long)f->pos_tag);
+  t->out = buf;
+  f->trace = t;
+}
+
+// io61_trace_finish(f)
+//    Record the close of traced file `f` and write out its trace.
+
+static void io61_trace_finish(io61_file *f) {
+  io61_trace *t = f->trace;
+  io61_trace_sync(f, 0);
+  if (t->seeking) {
+    io61_trace_emit(t, io61_trace::record{true, t->seek, 0, 0, 1});
+  }
+  io61_trace_emit(t, io61_trace::record{});
+  t->out += t->id + " close\n";
+  io61_trace_write(t);
+  delete t;
+  f->trace = nullptr;
+}
+
+// io61_fdopen(fd, mode, backend)
+//    Return a new io61_file for file descriptor `fd`. `mode` is
+//    O_RDONLY for a read-only file, O_WRONLY for a write-only file, or
+//    O_RDWR for a read/write file, which must be seekable.
+//    `backend` chooses the io61_backend, as described at
+//    io61_backend_find; if it is null, the $IO61_BACKEND environment
+//    variable does. Files that cannot use the chosen backend, or that
+//    name none, are plainly buffered; read/write files always use the
+//    rdwr backend. Returns nullptr, with `errno` set, if `fd` cannot be
+//    used with `mode` or memory is exhausted; `fd` stays open.
+
+io61_file *io61_fdopen(int fd, int mode, const char *backend) {
+  assert(fd >= 0);
+  io61_file *f = io61_file_new(fd, mode);
+  if (!f) {
+    return nullptr;
+  } else if (mode == O_RDWR && !f->seekable) {
+    delete f;
+    errno = ESPIPE;
+    return nullptr;
+  } else if (mode == O_RDWR) {
+    for (auto &b : io61_backends) {
+      if (strcmp(b.name, "rdwr") == 0) {
+        io61_file_use(f, &b);
+      }
+    }
+  } else {
+    if (!backend) {
+      backend = getenv("IO61_BACKEND");
+    }
+    io61_file_use(f, io61_backend_find(backend, f->mode));
+  }
+  io61_trace_start(f);
+  return f;
+}
+
+// io61_open_concat(filenames, ahead)
+//    Return a read-only io61_file that reads the named files one after
+//    another, as one stream. A background thread opens up to `ahead`
+//    files beyond the one being read and reads their first buffers, so
+//    that many small files are not read at the pace of `open` and
+//    first-read latency; $IO61_OPEN_AHEAD, if set, overrides `ahead`.
+//    The stream cannot seek. With fewer than two names this is
+//    io61_open_check of the name, or of standard input. Returns nullptr
+//    if memory is exhausted.
+
+io61_file *io61_open_concat(const std::vector<const char *> &filenames,
+                            int ahead) {
+  if (filenames.size() < 2) {
+    return io61_open_check(filenames.empty() ? nullptr : filenames[0],
+                           O_RDONLY);
+  }
+  io61_file *f = io61_file_new(-1, O_RDONLY);
+  if (!f) {
+    return nullptr;
+  }
+  f->inputs = std::make_shared<io61_inputs>();
+  for (const char *fn : filenames) {
+    assert(fn);
+    f->inputs->names.push_back(fn);
+  }
+  if (const char *env = getenv("IO61_OPEN_AHEAD")) {
+    ahead = strtol(env, nullptr, 0);
+  }
+  f->inputs->ahead = std::max(ahead, 0);
+  f->inputs->bufsize = f->bufcap;
+  if (ahead > 0) {
+    f->inputs->worker = std::thread(io61_inputs_run, f->inputs);
+  }
+  for (auto &b : io61_backends) {
+    if (strcmp(b.name, "concat") == 0) {
+      io61_file_use(f, &b);
+    }
+  }
+  return f;
+}
+
+// io61_crc_fold(f)
+//    Add the bytes that `f` has read or written since the last call to
+//    its running checksum. Every function that moves the buffer window
+//    or the file position calls this first, while those bytes are still
+//    in `cbuf`.
+
+void io61_crc_fold(io61_file *f) {
+  if (f->crc_on && f->pos_tag > f->crc_tag) {
+    f->crc = io61_crc32c(f->crc, &f->cbuf[f->crc_tag - f->beg_tag],
+                         f->pos_tag - f->crc_tag);
+  }
+  f->crc_tag = f->pos_tag;
+}
+
+// io61_crc_iov(f, iov, niov, n)
+//    Add the first `n` bytes of `iov` to the running checksum of `f`,
+//    for vector transfers that bypass the buffer.
+
+static void io61_crc_iov(io61_file *f, const struct iovec *iov, int niov,
+                         size_t n) {
+  for (int i = 0; f->crc_on && i != niov && n != 0; ++i) {
+    size_t len = std::min(iov[i].iov_len, n);
+    f->crc = io61_crc32c(f->crc, iov[i].iov_base, len);
+    n -= len;
+  }
+}
+
+// io61_checksum_start(f)
+//    Start a running CRC32C checksum of the bytes read from or written
+//    to `f` through its file position, from now on, replacing any
+//    earlier one. Setting $IO61_CHECKSUM starts one on every file at
+//    open. Positional I/O (io61_pread, io61_pwrite) is not included,
+//    nor are writes that threads append through a shared buffer
+//    (io61_append), which a file checksummed before then never uses.
+
+void io61_checksum_start(io61_file *f) {
+  io61_guard guard(f);
+  io61_crc_fold(f);
+  f->crc_on = true;
+  f->crc = 0;
+}
+
+// io61_checksum(f)
+//    Return the checksum started by io61_checksum_start, or 0 if none
+//    was started.
+
+uint32_t io61_checksum(io61_file *f) {
+  io61_guard guard(f);
+  io61_crc_fold(f);
+  return f->crc;
+}
+
+// io61_memopen(data, sz, mode, memfd)
+//    Return a new io61_file whose contents live in memory, starting as
+//    a copy of the `sz` bytes at `data`. `mode` is O_RDONLY or O_WRONLY;
+//    a written file grows as needed. The file costs no system calls,
+//    unless `memfd` is true: then its bytes are kept in a memfd, which
+//    other processes can open through io61_fileno(f), for instance by
+//    inheriting it, once the writer has flushed. Returns nullptr if the
+//    memory or the memfd cannot be had.
+
+io61_file *io61_memopen(const char *data, size_t sz, int mode, bool memfd) {
+  io61_file *f = io61_file_new(-1, mode & O_ACCMODE);
+  if (!f) {
+    return nullptr;
+  }
+  f->memory = f->seekable = true;
+  if (memfd) {
+    f->fd = memfd_create("io61", 0);
+  }
+  if ((memfd && f->fd < 0) || io61_mem_reserve(f, sz) < 0) {
+    io61_mem_close(f);
+    delete f;
+    return nullptr;
+  }
+  if (sz) {
+    memcpy(f->mem_data, data, sz);
+  }
+  f->mem_size = sz;
+  io61_mem_trim(f);
+  for (auto &b : io61_backends) {
+    if (strcmp(b.name, "mem") == 0) {
+      io61_file_use(f, &b);
+    }
+  }
+  return f;
+}
+
+// io61_memdata(f, sz)
+//    Return the contents of memory file `f`, setting `*sz` to their
+//    size, after flushing it. The pointer is valid until the next call
+//    on `f`. Returns nullptr for other files.
+
+const char *io61_memdata(io61_file *f, size_t *sz) {
+  if (!f->memory) {
+    return nullptr;
+  }
+  io61_guard guard(f);
+  io61_flush(f);
+  *sz = f->mem_size;
+  return f->mem_data;
+}
+
+// io61_fileno(f)
+//    Return the file descriptor of `f`, or -1 if it has none.
+
+int io61_fileno(io61_file *f) {
+  return f->fd;
+}
+
+// stream-mode writers, flushed before a stream-mode read waits
+static std::vector<io61_file *> io61_stream_writers;
+static std::mutex io61_stream_lock;  // guards io61_stream_writers
+
+static long long io61_now_ns() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+// io61_stream(f, timeout_ms, flush_size, flush_us)
+//    Put `f`, a pipe or socket, in stream mode. A read returns as soon as
+//    it has some bytes, rather than waiting for all it asked for, and
+//    waits at most `timeout_ms` milliseconds for the first (for ever if
+//    negative); if none arrive it returns -1 with errno EAGAIN, and
+//    io61_readc returns EOF. Before a read waits, every stream-mode
+//    writer with buffered bytes is flushed, so requests go out before
+//    their replies are awaited. A writer also flushes once it buffers
+//    `flush_size` bytes, if that is nonzero, or once its oldest byte is
+//    `flush_us` microseconds old, if that is nonnegative; both are
+//    checked whenever a write reaches the library. Returns 0 on success,
+//    or -1 with errno ESPIPE if `f` is seekable, or EBUSY if threads
+//    already append to it through a shared buffer (io61_append).
+
+int io61_stream(io61_file *f, int timeout_ms, size_t flush_size,
+                long flush_us) {
+  io61_guard guard(f);
+  if (f->seekable) {
+    errno = ESPIPE;
+    return -1;
+  } else if (f->append) {
+    errno = EBUSY;
+    return -1;
+  }
+  f->stream = true;
+  f->stream_timeout = timeout_ms;
+  f->flush_size = flush_size;
+  f->flush_ns = flush_us < 0 ? -1 : flush_us * 1000LL;
+  std::lock_guard<std::mutex> registry(io61_stream_lock);
+  if (f->mode != O_RDONLY
+      && std::find(io61_stream_writers.begin(), io61_stream_writers.end(), f)
+             == io61_stream_writers.end()) {
+    io61_stream_writers.push_back(f);
+  }
+  return 0;
+}
+
+// io61_stream_pending(flush)
+//    Return whether any stream-mode writer has buffered bytes, flushing
+//    them if `flush` is true. A writer whose lock another thread holds is
+//    in the middle of a call, and is skipped rather than waited for.
+
+static bool io61_stream_pending(bool flush) {
+  std::lock_guard<std::mutex> registry(io61_stream_lock);
+  bool pending = false;
+  for (io61_file *w : io61_stream_writers) {
+    std::unique_lock<std::recursive_mutex> lock(w->lock, std::defer_lock);
+    if (!io61_single_threaded() && !lock.try_lock()) {
+      continue;
+    }
+    if (w->pos_tag > w->beg_tag) {
+      pending = true;
+      if (flush) {
+        io61_flush(w);
+      }
+    }
+  }
+  return pending;
+}
+
+// io61_stream_wait(f)
+//    Wait until stream-mode reader `f` has bytes to read, first flushing
+//    the stream-mode writers if it would block. Returns false, with errno
+//    EAGAIN, if the timeout passed first.
+
+static bool io61_stream_wait(io61_file *f) {
+  bool pending = io61_stream_pending(false);
+  if (!pending && f->stream_timeout < 0) {
+    return true;    // a blocking read does the waiting
+  }
+  pollfd p = {f->fd, POLLIN, 0};
+  if (pending) {
+    if (poll(&p, 1, 0) > 0) {
+      return true;
+    }
+    io61_stream_pending(true);
+  }
+  int r;
+  while ((r = poll(&p, 1, f->stream_timeout)) < 0 && errno == EINTR) {
+  }
+  if (r == 0) {
+    errno = EAGAIN;
+    return false;
+  }
+  return true;
+}
+
+// io61_stream_check(f)
+//    Flush stream-mode writer `f` if it has buffered `flush_size` bytes or
+//    held its oldest buffered byte for `flush_ns`.
+
+static void io61_stream_check(io61_file *f) {
+  size_t buffered = f->pos_tag - f->beg_tag;
+  if (buffered == 0) {
+    f->pending_ns = 0;
+    return;
+  }
+  long long now = io61_now_ns();
+  if (f->pending_ns == 0) {
+    f->pending_ns = now;
+  }
+  if ((f->flush_size && buffered >= f->flush_size)
+      || (f->flush_ns >= 0 && now - f->pending_ns >= f->flush_ns)) {
+    io61_flush(f);
+    f->pending_ns = 0;
+  }
+}
+
+// io61_report(f)
+//    Add the buffer size and I/O counters of `f` to the profile record as
+//    one entry of the "files" array. Only system calls that were made are
+//    listed; each latency histogram stops at its last nonempty bucket. A
+//    checksummed file also reports its "crc32c", an lz file the bytes of
+//    data and of compressed stream that it moved, and a copy's output the
+//    bytes it left as "holes". Calls made without the file lock are
+//    included; positional reads that took no lock are counted but not
+//    timed.
+
+static void io61_report(io61_file *f) {
+  io61_stats st = f->stats;
+  unsigned long requests = f->requests;
+  for (auto &shard : f->pread_shards) {
+    requests += shard.requests;
+    st.calls[S_PREAD] += shard.calls;
+    st.bytes[S_PREAD] += shard.bytes;
+  }
+  if (io61_append *a = f->append) {
+    requests += a->requests;
+    st.merge(a->stats);
+    st.refills += a->stats.refills;
+  }
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "{\"fd\":%d, \"mode\":\"%s\", \"backend\":\"%s\", "
+           "\"bufsize\":%lld, \"requests\":%lu, "
+           "\"refills\":%lu, \"hit_rate\":%.4f, \"seeks\":%lu, "
+           "\"flushes\":%lu, ",
+           f->fd,
+           f->mode == O_RDONLY ? "r" : f->mode == O_WRONLY ? "w" : "rw",
+           f->backend->name, (long long)f->bufsize,
+           requests, st.refills,
+           requests ? 1.0 - (double)std::min(st.refills, requests)
+                                / requests
+                       : 0.0,
+           st.seeks, st.flushes);
+  std::string report = buf;
+  if (f->crc_on) {
+    snprintf(buf, sizeof(buf), "\"crc32c\":\"%08x\", ", f->crc);
+    report += buf;
+  }
+  if (st.lz_stream) {
+    snprintf(buf, sizeof(buf), "\"lz\":{\"data\":%llu, \"stream\":%llu}, ",
+             st.lz_data, st.lz_stream);
+    report += buf;
+  }
+  if (st.holes) {
+    snprintf(buf, sizeof(buf), "\"holes\":%llu, ", st.holes);
+    report += buf;
+  }
+  report += "\"syscalls\":{";
+  const char *sep = "";
+  for (int c = 0; c != NSYSCALLS; ++c) {
+    if (!st.calls[c]) {
+      continue;
+    }
+    snprintf(buf, sizeof(buf),
+             "%s\"%s\":{\"calls\":%lu, \"bytes\":%llu, \"log2ns\":[",
+             sep, syscall_names[c], st.calls[c], st.bytes[c]);
+    report += buf;
+    int last = st.nbuckets - 1;
+    while (last > 0 && !st.hist[c][last]) {
+      --last;
+    }
+    for (int b = 0; b <= last; ++b) {
+      report += (b ? "," : "") + std::to_string(st.hist[c][b]);
+    }
+    report += "]}";
+    sep = ", ";
+  }
+  report += "}}";
+  io61_profile_note("files", "%s", report.c_str());
+}
+
 // io61_close(f)
 //    Close the io61_file `f` and release all its resources.
 
 int io61_close(io61_file *f) {
+  if (f->trace) {
+    io61_trace_finish(f);
+  }
+  if (f->mode == O_RDONLY) {
+    io61_profile_note("patterns", "\"%s\"", pattern_names[f->pattern]);
+  }
   io61_flush(f);
-  int r = close(f->fd);
+  io61_crc_fold(f);
+  if (f->stream) {
+    std::lock_guard<std::mutex> registry(io61_stream_lock);
+    io61_stream_writers.erase(std::remove(io61_stream_writers.begin(),
+                                          io61_stream_writers.end(), f),
+                              io61_stream_writers.end());
+  }
+  int r = f->close(f);
+  io61_report(f);
+  delete f->append.load();
   delete f;
   return r;
 }
 
-void io61_fill(io61_file *f) {
-  f->beg_tag = f->pos_tag = f->end_tag;
-  ssize_t nread = read(f->fd, f->cbuf, f->bufsize);
-  if (nread >= 0) {
-    f->end_tag = f->beg_tag + nread;
+// io61_lock(f), io61_unlock(f)
+//    Take or release the lock of `f`, as flockfile does for stdio. The
+//    holder may use the unlocked functions of io61.hh, and other threads'
+//    calls on `f` wait until it is done, except for appends and positional
+//    reads, which take no lock. The lock is recursive.
+
+void io61_lock(io61_file *f) {
+  f->lock.lock();
+}
+
+void io61_unlock(io61_file *f) {
+  f->lock.unlock();
+}
+
+// io61_fill(f)
+//    Refill the read buffer of `f` from the position after its end.
+//    Returns false, leaving the buffer empty, if the read failed; an empty
+//    buffer after a true return means end of file.
+
+bool io61_fill(io61_file *f) {
+  ++f->stats.refills;
+  io61_crc_fold(f);
+  f->beg_tag = f->pos_tag = f->crc_tag = f->end_tag;
+  if (f->stream && !io61_stream_wait(f)) {
+    return false;
+  }
+  ssize_t nread = f->fill(f);
+  if (nread < 0) {
+    return false;
   }
+  f->end_tag = f->beg_tag + nread;
+  return true;
 }
 
-// io61_readc(f)
+// io61_readc_slow(f)
 //    Read a single (unsigned) character from `f` and return it. Returns EOF
-//    (which is -1) on error or end-of-file.
+//    (which is -1) on error or end-of-file. The inline io61_readc calls
+//    this, having counted the request, when the buffer is empty.
 
-int io61_readc(io61_file *f) {
-  if (f->pos_tag == f->end_tag) {
+int io61_readc_slow(io61_file *f) {
+  io61_traced traced(f, 'c', 1);
+  if (f->pos_tag >= f->end_tag) {
     io61_fill(f);
-    if (f->pos_tag == f->end_tag) {
+    if (f->pos_tag >= f->end_tag) {
       return EOF;
     }
   }
@@ -67,8 +1654,61 @@ int io61_readc(io61_file *f) {
   return c;
 }
 
-// io61_fill(f)
-// fills the read cache with new data
+// io61_findnl(p, n)
+//    Return a pointer to the first newline in the `n` bytes at `p`, or
+//    nullptr if there is none. Compares 16 bytes at a time with SSE2.
+
+static const char *io61_findnl(const char *p, size_t n) {
+#if __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; n >= 16; p += 16, n -= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    if (int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl))) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+#endif
+  return (const char *)memchr(p, '\n', n);
+}
+
+// io61_readline(f, line)
+//    Read the next line from `f`, including its newline if any, and set
+//    `*line` to point at it. Returns the line's length, or 0 at end of
+//    file. Returns -1 if an error occurred before any characters were
+//    read. A line that lies in the read buffer is returned in place;
+//    only a line that spans a refill is copied. Either way, `*line` is
+//    valid until the next call on `f`.
+
+ssize_t io61_readline(io61_file *f, const char **line) {
+  io61_guard guard(f);
+  io61_traced traced(f, 'r');
+  ++f->requests;
+  f->line.clear();
+  while (true) {
+    if (f->pos_tag >= f->end_tag) {
+      if (!io61_fill(f) && f->line.empty()) {
+        return -1;
+      }
+      if (f->pos_tag >= f->end_tag) {
+        break;
+      }
+    }
+    const char *p = &f->cbuf[f->pos_tag - f->beg_tag];
+    const char *nl = io61_findnl(p, f->end_tag - f->pos_tag);
+    size_t len = nl ? nl + 1 - p : f->end_tag - f->pos_tag;
+    f->pos_tag += len;
+    if (nl && f->line.empty()) {
+      *line = p;
+      return len;
+    }
+    f->line.insert(f->line.end(), p, p + len);
+    if (nl) {
+      break;
+    }
+  }
+  *line = f->line.data();
+  return f->line.size();
+}
 
 // io61_read(f, buf, sz)
 //    Read up to `sz` characters from `f` into `buf`. Returns the number of
@@ -81,10 +1721,17 @@ ssize_t io61_read(io61_file *f, char *buf, size_t sz) {
   // tracking variables
   size_t bytes_read = 0;
   size_t req_bytes = 0;
+  io61_guard guard(f);
+  io61_traced traced(f, 'r');
+  ++f->requests;
 
   while (bytes_read < sz) {
-    // fill the buffer if we are outside of it
+    // fill the buffer if we are outside of it; a stream returns what
+    // it has instead
     if (f->pos_tag >= f->end_tag) {
+      if (f->stream && bytes_read > 0) {
+        break;
+      }
       io61_fill(f);
       // if we are still out we are done
       if (f->pos_tag >= f->end_tag) {
@@ -115,18 +1762,361 @@ ssize_t io61_read(io61_file *f, char *buf, size_t sz) {
   // an error.
 }
 
-// io61_writec(f)
+// io61_dirty_trim(f, off, end)
+//    Remove the bytes in [`off`, `end`) from the write-back cache of `f`,
+//    trimming or splitting the extents that overlap them. Returns an
+//    iterator to the first extent at or after `end`.
+
+static std::map<off_t, std::vector<char>>::iterator
+io61_dirty_trim(io61_file *f, off_t off, off_t end) {
+  auto it = f->dirty.lower_bound(off);
+
+  // trim an extent that starts before `off` and reaches into the new bytes
+  if (it != f->dirty.begin()) {
+    auto prev = std::prev(it);
+    off_t prev_end = prev->first + prev->second.size();
+    if (prev_end > end) {
+      std::vector<char> tail(prev->second.begin() + (end - prev->first),
+                             prev->second.end());
+      f->dirty.emplace_hint(it, end, std::move(tail));
+    }
+    if (prev_end > off) {
+      f->dirty_bytes -= std::min(prev_end, end) - off;
+      prev->second.resize(off - prev->first);
+    }
+  }
+
+  // drop or trim extents that start inside the new bytes
+  while (it != f->dirty.end() && it->first < end) {
+    off_t it_end = it->first + it->second.size();
+    if (it_end > end) {
+      std::vector<char> tail(it->second.begin() + (end - it->first),
+                             it->second.end());
+      f->dirty.emplace_hint(std::next(it), end, std::move(tail));
+    }
+    f->dirty_bytes -= std::min(it_end, end) - it->first;
+    it = f->dirty.erase(it);
+  }
+  return it;
+}
+
+// io61_dirty_add(f, off, data, len)
+//    Add `len` bytes of `data`, destined for offset `off`, to the
+//    write-back cache of `f`. Older extents that overlap the new bytes are
+//    trimmed or split; an extent that ends exactly at `off` is extended.
+
+static void io61_dirty_add(io61_file *f, off_t off, const char *data,
+                          size_t len) {
+  if (len == 0) {
+    return;   // an empty extent would make an empty writeback run
+  }
+  auto it = io61_dirty_trim(f, off, off + len);
+
+  // extend the preceding extent if it is adjacent, else start a new one
+  if (it != f->dirty.begin()) {
+    auto prev = std::prev(it);
+    if (prev->first + (off_t) prev->second.size() == off) {
+      prev->second.insert(prev->second.end(), data, data + len);
+      f->dirty_bytes += len;
+      return;
+    }
+  }
+  f->dirty.emplace_hint(it, off, std::vector<char>(data, data + len));
+  f->dirty_bytes += len;
+}
+
+// io61_writeback(f)
+//    Write every extent in the write-back cache of `f` to disk in offset
+//    order. Runs of adjacent extents are written with a single `pwritev`,
+//    or with the io_uring equivalent, batched into as few submissions as
+//    possible, when `f` has one. Returns 0 on success and -1 on error.
+
+static int io61_writeback(io61_file *f) {
+  std::vector<io61_run> runs;
+  for (auto &e : f->dirty) {
+    if (runs.empty() || runs.back().off + (off_t)runs.back().len != e.first
+        || runs.back().iov.size() == IOV_MAX) {
+      runs.emplace_back();
+      runs.back().off = e.first;
+    }
+    runs.back().iov.push_back({e.second.data(), e.second.size()});
+    runs.back().len += e.second.size();
+  }
+
+  int r = 0;
+  std::vector<ssize_t> res(runs.size(), -1);
+  if (f->uring) {
+    io61_uring_writeback(f, runs.data(), runs.size(), res.data());
+  }
+  for (size_t i = 0; i != runs.size(); ++i) {
+    // finish runs the ring did not write completely
+    if (res[i] != (ssize_t)runs[i].len) {
+      size_t skip = res[i] > 0 ? res[i] : 0;
+      auto iov = runs[i].iov.begin();
+      while (skip >= iov->iov_len) {
+        skip -= iov->iov_len;
+        ++iov;
+      }
+      iov->iov_base = (char *)iov->iov_base + skip;
+      iov->iov_len -= skip;
+      off_t off = runs[i].off + (res[i] > 0 ? res[i] : 0);
+      if (io61_pwritev_all(f, &*iov, runs[i].iov.end() - iov, off) < 0) {
+        r = -1;
+      }
+    }
+  }
+  f->dirty.clear();
+  f->dirty_bytes = 0;
+  return r;
+}
+
+// io61_dirty_check(f)
+//    Write back the write-back cache of `f` if it has grown past its limit.
+
+static int io61_dirty_check(io61_file *f) {
+  if (f->dirty_bytes + f->dirty.size() * f->extent_overhead >
+      f->dirty_limit) {
+    return io61_writeback(f);
+  }
+  return 0;
+}
+
+// io61_retire(f)
+//    Move the contents of the write buffer of `f` into its write-back
+//    cache, then write the cache back if it has grown past its limit.
+
+static int io61_retire(io61_file *f) {
+  io61_crc_fold(f);
+  if (f->pos_tag > f->beg_tag) {
+    io61_dirty_add(f, f->beg_tag, f->cbuf, f->pos_tag - f->beg_tag);
+  }
+  f->beg_tag = f->end_tag = f->pos_tag;
+  return io61_dirty_check(f);
+}
+
+// io61_spill(f)
+//    Empty the full write buffer of `f`. If earlier writes are still
+//    waiting in the write-back cache the buffer joins them, so that it
+//    cannot be overwritten by older data; otherwise it is written now.
+
+static int io61_spill(io61_file *f) {
+  ++f->stats.refills;
+  if (!f->dirty.empty()) {
+    return io61_retire(f);
+  }
+  io61_crc_fold(f);
+  return f->flush(f, false);
+}
+
+// io61_append_out(f, a, iov, iovcnt, off)
+//    Write the `iovcnt` buffers of `iov` to `f`, at offset `off` if it
+//    writes at offsets. Called with `a->wm` held. Returns 0 on success
+//    and -1 on error.
+
+static int io61_append_out(io61_file *f, io61_append *a, struct iovec *iov,
+                           int iovcnt, off_t off) {
+  while (iovcnt > 0) {
+    ssize_t n;
+    if (f->positional) {
+      n = io61_timed(a->stats, S_PWRITEV, [&] {
+        return pwritev(f->fd, iov, std::min(iovcnt, IOV_MAX), off);
+      });
+    } else {
+      n = io61_timed(a->stats, S_WRITEV, [&] {
+        return writev(f->fd, iov, std::min(iovcnt, IOV_MAX));
+      });
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      a->err = n < 0 ? errno : EIO;
+      return -1;
+    }
+    off += n;
+    io61_iov_skip(iov, iovcnt, n);
+  }
+  return 0;
+}
+
+// io61_append_swap(f, a, lock, iov, iovcnt)
+//    Seal the buffer of `a` that takes reservations, wait for its writers,
+//    and swap in the other buffer; then write the sealed bytes to `f`,
+//    followed by the `iovcnt` buffers of `iov`, which no reservation can
+//    come between. `lock` holds `a->m` on entry and is released once
+//    reservations can resume. Returns the file offset after the written
+//    bytes, or -1 on error.
+
+static off_t io61_append_swap(io61_file *f, io61_append *a,
+                              std::unique_lock<std::mutex> &lock,
+                              const struct iovec *iov, int iovcnt) {
+  uint64_t s = a->state.fetch_or(io61_append::sealed,
+                                 std::memory_order_acq_rel);
+  while (io61_append::writers(s) != 0) {
+    std::this_thread::yield();
+    s = a->state.load(std::memory_order_acquire);
+  }
+  size_t used = io61_append::used(s);
+  std::vector<struct iovec> v;
+  if (used) {
+    v.push_back({a->buf, used});
+  }
+  v.insert(v.end(), iov, iov + iovcnt);
+  size_t total = 0;
+  for (auto &e : v) {
+    total += e.iov_len;
+  }
+
+  // the other buffer is free once the last sealed one is written
+  a->wm.lock();
+  off_t off = a->off;
+  a->off += total;
+  a->buf = a->bufs[a->buf == a->bufs[0].get()].get();
+  a->state.store(0, std::memory_order_release);
+  lock.unlock();
+
+  int r = 0;
+  if (a->err) {
+    errno = a->err;
+    r = -1;
+  } else if (total) {
+    a->stats.refills += used != 0;
+    r = io61_append_out(f, a, v.data(), v.size(), off);
+  }
+  a->wm.unlock();
+  return r < 0 ? -1 : off + (off_t)total;
+}
+
+// io61_append_write(f, a, iov, iovcnt)
+//    Append the `iovcnt` buffers of `iov` to `f` as one record, through
+//    its shared write buffer `a`. Records of more than half a buffer are
+//    written directly, after the bytes reserved before them. Returns the
+//    record's size, or -1 on error.
+
+static ssize_t io61_append_write(io61_file *f, io61_append *a,
+                                 const struct iovec *iov, int iovcnt) {
+  if (int err = a->err.load(std::memory_order_relaxed)) {
+    errno = err;
+    return -1;
+  }
+  size_t total = 0;
+  for (int i = 0; i != iovcnt; ++i) {
+    total += iov[i].iov_len;
+  }
+  if (total > io61_append::cap / 2) {
+    std::unique_lock<std::mutex> lock(a->m);
+    return io61_append_swap(f, a, lock, iov, iovcnt) < 0 ? -1
+                                                          : (ssize_t)total;
+  }
+
+  uint64_t s = a->state.load(std::memory_order_relaxed);
+  while (true) {
+    if (!(s & io61_append::sealed)
+        && io61_append::used(s) + total <= io61_append::cap) {
+      if (a->state.compare_exchange_weak(
+              s, s + ((uint64_t)total << io61_append::used_shift) + 1,
+              std::memory_order_acquire, std::memory_order_relaxed)) {
+        break;
+      }
+      continue;
+    }
+    // the buffer is full or being swapped; the first writer to take `m`
+    // swaps it, and the others find room once they get `m`
+    std::unique_lock<std::mutex> lock(a->m);
+    s = a->state.load(std::memory_order_relaxed);
+    if (io61_append::used(s) + total > io61_append::cap
+        && io61_append_swap(f, a, lock, nullptr, 0) < 0) {
+      return -1;
+    }
+    s = a->state.load(std::memory_order_relaxed);
+  }
+
+  // the buffer cannot be swapped while this writer is counted in `state`
+  char *p = a->buf + io61_append::used(s);
+  for (int i = 0; i != iovcnt; ++i) {
+    memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    p += iov[i].iov_len;
+  }
+  a->state.fetch_sub(1, std::memory_order_release);
+  return total;
+}
+
+// io61_append_get(f)
+//    Return the shared write buffer of `f`, or nullptr if it has none.
+//    A write-only file with a passthrough backend gets one at its first
+//    write from a process with threads, unless it checksums, streams, or
+//    writes in the background, which keep their own buffer under the
+//    file lock.
+
+static io61_append *io61_append_get(io61_file *f) {
+  io61_append *a = f->append.load(std::memory_order_acquire);
+  if (a || !f->appendable.load(std::memory_order_relaxed)) {
+    return a;
+  }
+  std::lock_guard<std::recursive_mutex> guard(f->lock);
+  a = f->append.load(std::memory_order_relaxed);
+  if (!a && f->appendable) {
+    f->appendable = false;
+    if (!f->crc_on && !f->stream && !f->async && io61_flush(f) == 0) {
+      a = new io61_append;
+      for (auto &b : a->bufs) {
+        b.reset(new char[io61_append::cap]);
+      }
+      a->buf = a->bufs[0].get();
+      a->off = f->pos_tag;
+      // send the inline writers to io61_writec_slow
+      f->bufcap = 0;
+      f->append.store(a, std::memory_order_release);
+    }
+  }
+  return a;
+}
+
+// io61_append_drain(f)
+//    Write out every byte appended to `f` so far and bring its file
+//    position up to date, so that a caller holding the file lock sees
+//    the file as the appends left it. Returns 0 on success and -1 on
+//    error.
+
+static int io61_append_drain(io61_file *f) {
+  io61_append *a = f->append.load(std::memory_order_acquire);
+  if (!a) {
+    return 0;
+  }
+  std::unique_lock<std::mutex> lock(a->m);
+  off_t end = io61_append_swap(f, a, lock, nullptr, 0);
+  if (end < 0) {
+    return -1;
+  }
+  f->beg_tag = f->end_tag = f->pos_tag = f->crc_tag = end;
+  return 0;
+}
+
+// io61_writec_slow(f)
 //    Write a single character `ch` to `f`. Returns 0 on success or
-//    -1 on error.
+//    -1 on error. The inline io61_writec calls this, having counted the
+//    request, when the buffer is full.
 
-int io61_writec(io61_file *f, int ch) {
-  // if we are over our buffer flush
-  if (f->end_tag == f->beg_tag + f->bufsize) {
-    io61_flush(f);
+int io61_writec_slow(io61_file *f, int ch) {
+  io61_traced traced(f, 'C', 1);
+  if (io61_append *a = f->append.load(std::memory_order_acquire)) {
+    char c = ch;
+    struct iovec iov = {&c, 1};
+    return io61_append_write(f, a, &iov, 1) < 0 ? -1 : 0;
+  } else if (f->rdwr) {
+    char c = ch;
+    return io61_rdwr_write(f, &c, 1) == 1 ? 0 : -1;
+  }
+  // if we are over our buffer flush; a buffer that stays full failed
+  if (f->end_tag == f->beg_tag + f->bufcap && io61_spill(f) < 0
+      && f->end_tag == f->beg_tag + f->bufcap) {
+    return -1;
   }
   f->cbuf[f->pos_tag - f->beg_tag] = ch;
   ++f->pos_tag;
   ++f->end_tag;
+  if (f->stream) {
+    io61_stream_check(f);
+  }
   return 0;
 }
 
@@ -137,16 +2127,31 @@ int io61_writec(io61_file *f, int ch) {
 
 ssize_t io61_write(io61_file *f, const char *buf, size_t sz) {
   // keep track of how many bytes we have written and need to write
+  if (!io61_single_threaded()) {
+    if (io61_append *a = io61_append_get(f)) {
+      a->requests.fetch_add(1, std::memory_order_relaxed);
+      struct iovec iov = {(void *)buf, sz};
+      return io61_append_write(f, a, &iov, 1);
+    }
+  }
   size_t bytes_written = 0;
   size_t rec_bytes = 0;
+  io61_guard guard(f);
+  io61_traced traced(f, 'w');
+  ++f->requests;
+  if (f->rdwr) {
+    return io61_rdwr_write(f, buf, sz);
+  }
 
   // loop over bytes buffer by buffer
   while (bytes_written < sz) {
-    if (f->end_tag == f->beg_tag + f->bufsize) {
-      io61_flush(f); // flush buffer if full
+    // flush buffer if full; a buffer that stays full failed
+    if (f->end_tag == f->beg_tag + f->bufcap && io61_spill(f) < 0
+        && f->end_tag == f->beg_tag + f->bufcap) {
+      return bytes_written ? (ssize_t)bytes_written : -1;
     }
     // calculate bytes still needing to be written
-    rec_bytes = f->bufsize - (f->pos_tag - f->beg_tag);
+    rec_bytes = f->bufcap - (f->pos_tag - f->beg_tag);
     if (sz - bytes_written < rec_bytes) {
       rec_bytes = sz - bytes_written;
     }
@@ -157,53 +2162,1093 @@ ssize_t io61_write(io61_file *f, const char *buf, size_t sz) {
     f->end_tag += rec_bytes;
     bytes_written += rec_bytes;
   }
+  if (f->stream) {
+    io61_stream_check(f);
+  }
   return bytes_written;
 }
 
+// io61_flush_data(f)
+//    Like io61_flush, but leave a hole at the end of `f` open, so that
+//    io61_copy can keep extending it without truncating the file.
+
+static int io61_flush_data(io61_file *f) {
+  if (f->mode == O_RDONLY) {
+    return 0;
+  }
+  io61_guard guard(f);
+  ++f->stats.flushes;
+  if (f->append && io61_append_drain(f) < 0) {
+    return -1;
+  }
+  if (!f->dirty.empty()) {
+    io61_retire(f);
+    return io61_writeback(f);
+  }
+  io61_crc_fold(f);
+  return f->flush(f, true);
+}
+
+// io61_end_hole(f)
+//    Extend write-only file `f` over the hole io61_copy left at its end,
+//    if the file does not already reach past it. Returns 0 on success and
+//    -1 on error.
+
+static int io61_end_hole(io61_file *f) {
+  off_t end = std::exchange(f->hole_end, 0);
+  struct stat st;
+  if (end == 0 || (fstat(f->fd, &st) == 0 && st.st_size >= end)) {
+    return 0;
+  }
+  return io61_timed(f->stats, S_FTRUNCATE,
+                    [&] { return ftruncate(f->fd, end); });
+}
+
 // io61_flush(f)
 //    Forces a write of all buffered data written to `f`.
 //    If `f` was opened read-only, io61_flush(f) may either drop all
 //    data buffered for reading, or do nothing.
 
 int io61_flush(io61_file *f) {
-  if (f->mode == O_RDONLY) {
-    return 0;
+  io61_guard guard(f);
+  int r = io61_flush_data(f);
+  return io61_end_hole(f) == 0 ? r : -1;
+}
+
+// io61_setvbuf(f, size)
+//    Give `f` a buffer of `size` bytes, rounded up to a pool buffer size,
+//    in place of the one io61_bufsize chose when it was opened. Bytes
+//    written to `f` are flushed first, and bytes it has read ahead move
+//    to the new buffer. Returns 0 on success, or -1 with errno EINVAL if
+//    `size` is over 1 GiB or `f` uses buffers other than its own (the
+//    mmap, direct, slow, uring, concat, lz, mem and rdwr backends, and
+//    $IO61_ASYNC), EBUSY if threads append to `f` or its read-ahead
+//    bytes do not fit, or ENOMEM.
+
+int io61_setvbuf(io61_file *f, size_t size) {
+  io61_guard guard(f);
+  if (size > (size_t)max_bufsize || f->cbuf != f->buf
+      || f->bufcap != f->bufsize || f->async || f->uring || f->inputs
+      || f->memory) {
+    errno = EINVAL;
+    return -1;
+  } else if (f->append) {
+    errno = EBUSY;
+    return -1;
+  } else if (f->mode != O_RDONLY && io61_flush_data(f) < 0) {
+    return -1;
+  }
+  io61_crc_fold(f);
+  size = io61_pool_size(size);
+  off_t ahead = f->end_tag - f->pos_tag;
+  if (ahead > (off_t)size) {
+    errno = EBUSY;
+    return -1;
+  }
+  char *b = io61_pool_get(size);
+  if (!b) {
+    errno = ENOMEM;
+    return -1;
   }
-  ssize_t n = write(f->fd, f->cbuf, f->pos_tag - f->beg_tag);
+  memcpy(b, &f->cbuf[f->pos_tag - f->beg_tag], ahead);
+  io61_pool_put(f->buf, f->bufsize);
+  f->buf = f->cbuf = b;
+  f->bufsize = f->bufcap = size;
   f->beg_tag = f->pos_tag;
-  if (n >= 0) {
+  return 0;
+}
+
+// io61_size_hint(f, size)
+//    Tell io61 that write-only file `f` will be `size` bytes long when it
+//    is closed, as a program that writes blocks in any order may know.
+//    A regular file that writes at offsets and has written nothing yet is
+//    mapped (see the mmap backend) with `size` bytes reserved, so each
+//    write, after a seek or not, is a memcpy into the mapping; a file
+//    already mapped reserves `size` bytes. Other files keep their backend
+//    and only have the space preallocated, where the file system allows.
+//    The file still ends after the last byte written, once it is closed;
+//    until then it may be `size` bytes long. Returns 0 on success, or -1
+//    with errno EINVAL if `size` is negative or `f` is not write-only.
+
+int io61_size_hint(io61_file *f, off_t size) {
+  io61_guard guard(f);
+  if (size < 0 || f->mode != O_WRONLY) {
+    errno = EINVAL;
+    return -1;
+  } else if (f->map) {
+    io61_mmap_reserve(f, size);
     return 0;
+  }
+  bool idle = f->backend == &io61_backends[0] && f->pos_tag == f->beg_tag
+              && f->dirty.empty() && !f->async && !f->append
+              && f->hole_end == 0;
+  if (idle && io61_mmap_start(f, size)) {
+    for (auto &b : io61_backends) {
+      if (strcmp(b.name, "mmap") == 0) {
+        f->backend = &b;
+        f->appendable = false;
+        f->fill = b.fill;
+        f->flush = b.flush;
+        f->seek = b.seek;
+        f->close = b.close;
+      }
+    }
+  } else if (f->positional) {
+    io61_timed(f->stats, S_FALLOCATE, [&] {
+      return fallocate(f->fd, FALLOC_FL_KEEP_SIZE, 0, size);
+    });
+  }
+  return 0;
+}
+
+// io61_zero(p, n)
+//    Return whether the `n` bytes at `p` are all zero. ORs 64 bytes at a
+//    time together with SSE2, so a nonzero block usually fails fast.
+
+static bool io61_zero(const char *p, size_t n) {
+#if __SSE2__
+  for (; n >= 64; p += 64, n -= 64) {
+    __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)p),
+                             _mm_loadu_si128((const __m128i *)(p + 16)));
+    __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + 32)),
+                             _mm_loadu_si128((const __m128i *)(p + 48)));
+    __m128i z = _mm_cmpeq_epi8(_mm_or_si128(a, b), _mm_setzero_si128());
+    if (_mm_movemask_epi8(z) != 0xFFFF) {
+      return false;
+    }
+  }
+#endif
+  for (; n != 0; ++p, --n) {
+    if (*p) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// io61_find_hole(off, p, n, data)
+//    Look for whole zero blocks in the `n` bytes at `p`, which are headed
+//    for output offset `off`. Blocks are `hole_block` bytes aligned on
+//    output offsets. Sets `*data` to the number of bytes before the first
+//    zero block and returns the length of the run of zero blocks that
+//    starts there, or returns 0 (with `*data == n`) if there is none.
+
+static constexpr size_t hole_block = 4096;
+
+static size_t io61_find_hole(off_t off, const char *p, size_t n,
+                             size_t *data) {
+  size_t i = std::min(n, (size_t)-off & (hole_block - 1));
+  while (i + hole_block <= n && !io61_zero(p + i, hole_block)) {
+    i += hole_block;
+  }
+  size_t z = i;
+  while (z + hole_block <= n && io61_zero(p + z, hole_block)) {
+    z += hole_block;
+  }
+  *data = z == i ? n : i;
+  return z - i;
+}
+
+// io61_skip_hole(f, n)
+//    Leave the next `n` bytes of write-only file `f` as a hole by moving
+//    its position past them. This is only correct where `f` holds no
+//    data: right after a hole it made, or at or past its end once
+//    flushed. Returns false, having done nothing, elsewhere.
+
+static bool io61_skip_hole(io61_file *f, size_t n) {
+  if (f->hole_end == 0 || f->pos_tag != f->hole_end) {
+    struct stat st;
+    if (io61_flush_data(f) < 0 || fstat(f->fd, &st) < 0
+        || f->pos_tag < st.st_size) {
+      return false;
+    }
+  }
+  f->pos_tag += n;
+  f->beg_tag = f->end_tag = f->crc_tag = f->hole_end = f->pos_tag;
+  f->stats.holes += n;
+  return true;
+}
+
+// io61_copy_kernel(in, out, n)
+//    Copy up to `n` bytes from the file position of `in` to that of `out`
+//    without passing them through user space: `copy_file_range` between
+//    regular files, `sendfile` from a regular file to anything else, and
+//    `splice` when either side is a pipe. Both files' buffers must be
+//    empty. Returns the number of bytes copied, which is less than `n`
+//    only at end of file or on error, or -1 if the file types allow no
+//    kernel-side copy.
+
+static ssize_t io61_copy_kernel(io61_file *in, io61_file *out, size_t n) {
+  struct stat ist, ost;
+  if (fstat(in->fd, &ist) < 0 || fstat(out->fd, &ost) < 0) {
+    return -1;
+  }
+  bool in_reg = S_ISREG(ist.st_mode);
+  bool out_reg = S_ISREG(ost.st_mode) && out->positional;
+  bool pipes = S_ISFIFO(ist.st_mode) || S_ISFIFO(ost.st_mode);
+
+  // io_uring readers track their offset in `end_tag`, others in the fd
+  off_t in_start = in->uring ? in->end_tag
+                             : io61_timed(in->stats, S_LSEEK, [&] {
+                                 return lseek(in->fd, 0, SEEK_CUR);
+                               });
+  if (in_reg && in_start < 0) {
+    return -1;
+  }
+  off_t in_off = in_start, out_off = out->pos_tag;
+
+  enum { COPY_FILE_RANGE, SENDFILE, SPLICE, NONE } method = NONE;
+  if (in_reg && out_reg) {
+    method = COPY_FILE_RANGE;
+  } else if (in_reg) {
+    method = SENDFILE;
+  } else if (pipes) {
+    method = SPLICE;
+  }
+
+  size_t done = 0;
+  while (method != NONE && done < n) {
+    size_t chunk = std::min(n - done, (size_t)1 << 30);
+    ssize_t r;
+    if (method == COPY_FILE_RANGE) {
+      r = io61_timed(out->stats, S_COPY_FILE_RANGE, [&] {
+        return copy_file_range(in->fd, &in_off, out->fd, &out_off, chunk, 0);
+      });
+    } else if (method == SENDFILE) {
+      if (done == 0 && out->positional) {
+        io61_timed(out->stats, S_LSEEK,
+                   [&] { return lseek(out->fd, out->pos_tag, SEEK_SET); });
+      }
+      r = io61_timed(out->stats, S_SENDFILE,
+                     [&] { return sendfile(out->fd, in->fd, &in_off, chunk); });
+    } else {
+      r = io61_timed(out->stats, S_SPLICE, [&] {
+        return splice(in->fd, in_reg ? &in_off : nullptr, out->fd,
+                      out_reg ? &out_off : nullptr, chunk, SPLICE_F_MOVE);
+      });
+    }
+    if (r < 0 && errno == EINTR) {
+      continue;
+    } else if (r < 0 && done == 0 && method == COPY_FILE_RANGE) {
+      // e.g. EXDEV on older kernels: try the next way
+      method = SENDFILE;
+      continue;
+    } else if (r < 0 && done == 0 && method == SENDFILE && pipes) {
+      method = SPLICE;
+      continue;
+    } else if (r < 0 && done == 0) {
+      return -1;
+    } else if (r <= 0) {
+      break;
+    }
+    done += r;
+  }
+  if (method == NONE) {
+    return -1;
+  }
+
+  // move both files past the copied bytes
+  in->end_tag += done;
+  in->beg_tag = in->pos_tag = in->end_tag;
+  if (in_reg && !in->uring) {
+    io61_timed(in->stats, S_LSEEK,
+               [&] { return lseek(in->fd, in_start + done, SEEK_SET); });
+  }
+  out->pos_tag += done;
+  out->beg_tag = out->end_tag = out->pos_tag;
+  return done;
+}
+
+// io61_copy_sparse(in, out, n)
+//    Copy up to `n` bytes like io61_copy_kernel, but find the holes in
+//    `in` with SEEK_DATA and SEEK_HOLE and skip over them in both files,
+//    copying only the data between. Both files must be regular, `out` at
+//    or past its end. Returns the number of bytes copied, or -1, having
+//    copied nothing, if `in` has no hole in range or cannot say.
+
+static ssize_t io61_copy_sparse(io61_file *in, io61_file *out, size_t n) {
+  struct stat ist, ost;
+  if (fstat(in->fd, &ist) < 0 || fstat(out->fd, &ost) < 0
+      || !S_ISREG(ist.st_mode) || !S_ISREG(ost.st_mode) || !out->positional
+      || out->pos_tag < ost.st_size) {
+    return -1;
+  }
+  off_t start = in->uring ? in->end_tag
+                          : io61_timed(in->stats, S_LSEEK, [&] {
+                              return lseek(in->fd, 0, SEEK_CUR);
+                            });
+  if (start < 0 || start >= ist.st_size) {
+    return -1;
+  }
+  off_t end = ist.st_size - start > (off_t)std::min(n, (size_t)LLONG_MAX)
+              ? start + n : ist.st_size;
+  // `whence` is SEEK_DATA or SEEK_HOLE; past the last data is `end`
+  auto next = [&](off_t pos, int whence) {
+    off_t r = io61_timed(in->stats, S_LSEEK,
+                         [&] { return lseek(in->fd, pos, whence); });
+    return r < 0 && errno == ENXIO ? end : std::min(r, end);
+  };
+  off_t data = next(start, SEEK_DATA);
+  off_t hole = data < 0 ? -1 : next(data, SEEK_HOLE);
+  if (hole < 0 || (data == start && hole == end)) {
+    if (!in->uring) {
+      io61_timed(in->stats, S_LSEEK,
+                 [&] { return lseek(in->fd, start, SEEK_SET); });
+    }
+    return -1;
+  }
+
+  off_t pos = start;
+  while (pos < end) {
+    if (data > pos && !io61_skip_hole(out, data - pos)) {
+      break;
+    }
+    pos = data;
+    if (pos == end) {
+      break;
+    }
+    // io61_copy_kernel starts from `in`'s offset
+    in->end_tag = pos;
+    if (!in->uring) {
+      io61_timed(in->stats, S_LSEEK,
+                 [&] { return lseek(in->fd, pos, SEEK_SET); });
+    }
+    ssize_t k = io61_copy_kernel(in, out, hole - pos);
+    if (k < 0 && pos == start) {
+      return -1;
+    }
+    pos += std::max(k, (ssize_t)0);
+    if (pos < hole || pos == end) {
+      break;
+    }
+    data = next(pos, SEEK_DATA);
+    hole = data < 0 ? -1 : next(data, SEEK_HOLE);
+    if (hole < 0) {
+      break;
+    }
+  }
+
+  // move `in` past the copied bytes and holes
+  in->end_tag = in->beg_tag = in->pos_tag = pos;
+  if (!in->uring) {
+    io61_timed(in->stats, S_LSEEK,
+               [&] { return lseek(in->fd, pos, SEEK_SET); });
+  }
+  return pos - start;
+}
+
+// io61_copy_parallel(in, out, n, nthreads)
+//    Copy up to `n` bytes from the file position of `in` to that of `out`
+//    with `nthreads` threads, each moving whole chunks with `pread` and
+//    `pwrite`, into space preallocated with `fallocate`. Both files must
+//    be regular with empty buffers, and the copy must span at least two
+//    chunks. Returns the number of bytes copied, which is less than `n`
+//    only at end of file or on error, or -1 if the copy cannot be
+//    parallel or failed before any bytes were copied.
+
+static constexpr size_t copy_chunk = 1 << 20;
+
+static ssize_t io61_copy_parallel(io61_file *in, io61_file *out, size_t n,
+                                  int nthreads) {
+  struct stat ist, ost;
+  if (fstat(in->fd, &ist) < 0 || fstat(out->fd, &ost) < 0
+      || !S_ISREG(ist.st_mode) || !S_ISREG(ost.st_mode) || !out->positional) {
+    return -1;
+  }
+  off_t in_start = in->uring ? in->end_tag
+                             : io61_timed(in->stats, S_LSEEK, [&] {
+                                 return lseek(in->fd, 0, SEEK_CUR);
+                               });
+  if (in_start < 0 || in_start >= ist.st_size) {
+    return -1;
+  }
+  size_t len = std::min(n, (size_t)(ist.st_size - in_start));
+  if (len < 2 * copy_chunk) {
+    return -1;
+  }
+  off_t out_start = out->pos_tag;
+  // errors only cost the preallocation
+  io61_timed(out->stats, S_FALLOCATE, [&] {
+    return fallocate(out->fd, FALLOC_FL_KEEP_SIZE, out_start, len);
+  });
+
+  // workers take chunks in order; `stop` is the lowest offset, relative
+  // to the start, at which some chunk came up short
+  std::atomic<size_t> next(0);
+  std::mutex m;
+  size_t stop = len;
+  int err = 0;
+  auto work = [&] {
+    std::unique_ptr<char[]> buf(new char[copy_chunk]);
+    io61_stats in_st, out_st;
+    size_t off;
+    while ((off = next.fetch_add(copy_chunk)) < len) {
+      size_t want = std::min(copy_chunk, len - off), got = 0, put = 0;
+      ssize_t r = 1;
+      while (got < want && r != 0) {
+        r = io61_timed(in_st, S_PREAD, [&] {
+          return pread(in->fd, buf.get() + got, want - got,
+                       in_start + off + got);
+        });
+        if (r < 0 && errno != EINTR) {
+          break;
+        }
+        got += std::max(r, (ssize_t)0);
+      }
+      while (put < got && r >= 0) {
+        r = io61_timed(out_st, S_PWRITE, [&] {
+          return pwrite(out->fd, buf.get() + put, got - put,
+                        out_start + off + put);
+        });
+        if (r < 0 && errno == EINTR) {
+          r = 0;
+        } else if (r <= 0) {
+          r = -1;
+          break;
+        }
+        put += r;
+      }
+      if (put < want) {
+        std::lock_guard<std::mutex> guard(m);
+        if (off + put < stop) {
+          stop = off + put;
+          err = r < 0 ? errno : 0;
+        }
+      }
+    }
+    std::lock_guard<std::mutex> guard(m);
+    in->stats.merge(in_st);
+    out->stats.merge(out_st);
+  };
+  std::vector<std::thread> workers;
+  for (int i = 1; i < nthreads; ++i) {
+    workers.emplace_back(work);
+  }
+  work();
+  for (auto &w : workers) {
+    w.join();
+  }
+  if (stop == 0 && err) {
+    errno = err;
+    return -1;
+  }
+
+  // move both files past the copied bytes
+  in->end_tag = in_start + stop;
+  in->beg_tag = in->pos_tag = in->end_tag;
+  if (!in->uring) {
+    io61_timed(in->stats, S_LSEEK,
+               [&] { return lseek(in->fd, in->end_tag, SEEK_SET); });
+  }
+  out->pos_tag += stop;
+  out->beg_tag = out->end_tag = out->pos_tag;
+  return stop;
+}
+
+// io61_copy(in, out, n)
+//    Copy up to `n` bytes from read-only file `in` to write-only file
+//    `out`, stopping early at end of file. Bytes already buffered in `in`
+//    go first; the rest are copied by $IO61_COPY_THREADS threads, if that
+//    is more than 1 and both files are regular, then inside the kernel
+//    when the file types allow it, and through `in`'s buffer otherwise.
+//    Unless $IO61_SPARSE is 0, copies keep files sparse: holes in a
+//    regular `in` are skipped rather than read, and whole zero blocks
+//    passing through the buffer become holes past the end of `out`. If
+//    it is "always", every byte passes through the buffer, so zero
+//    blocks become holes whatever `in` is.
+//    Returns the number of bytes copied, or -1 if an error occurred
+//    before any were copied.
+
+ssize_t io61_copy(io61_file *in, io61_file *out, size_t n) {
+  // other threads' appends must not land inside the copy, so an output
+  // shared that way takes each chunk as one io61_write
+  bool shared = !io61_single_threaded() && io61_append_get(out);
+  io61_guard in_guard(in), out_guard(out);
+  io61_traced in_traced(in, 'r'), out_traced(out, 'w');
+  ++in->requests;
+  ++out->requests;
+  size_t copied = 0;
+  // a background reader has already consumed data past our buffer, only
+  // passthrough backends keep the kernel's view of the files current,
+  // and checksums need the bytes in user space
+  // holes can only be made by seeking a file that writes at offsets
+  const char *sparse_env = getenv("IO61_SPARSE");
+  bool sparse = (!sparse_env || strcmp(sparse_env, "0") != 0)
+                && out->positional && out->backend->passthrough
+                && !out->crc_on && !shared;
+  bool always = sparse && sparse_env && strcmp(sparse_env, "always") == 0;
+  bool kernel = !in->async && in->backend->passthrough
+                && out->backend->passthrough && !in->crc_on && !out->crc_on
+                && !always && !shared;
+  while (copied < n) {
+    if (in->pos_tag >= in->end_tag) {
+      if (kernel) {
+        kernel = false;
+        ssize_t k = -1;
+        const char *threads = getenv("IO61_COPY_THREADS");
+        int nthreads = threads ? strtol(threads, nullptr, 0) : 1;
+        bool flushed = io61_flush_data(out) == 0;
+        if (flushed && sparse) {
+          k = io61_copy_sparse(in, out, n - copied);
+        }
+        if (k >= 0) {
+          copied += k;
+          break;
+        }
+        if (flushed && nthreads > 1) {
+          // the kernel copies whatever the threads leave, if anything
+          k = io61_copy_parallel(in, out, n - copied, nthreads);
+          copied += std::max(k, (ssize_t)0);
+        }
+        if (flushed) {
+          k = io61_copy_kernel(in, out, n - copied);
+        }
+        if (k >= 0) {
+          copied += k;
+          break;
+        }
+      }
+      io61_fill(in);
+      if (in->pos_tag >= in->end_tag) {
+        break;
+      }
+    }
+    size_t len = std::min((size_t)(in->end_tag - in->pos_tag), n - copied);
+    const char *p = &in->cbuf[in->pos_tag - in->beg_tag];
+    size_t data = len, zeros = 0;
+    if (sparse) {
+      zeros = io61_find_hole(out->pos_tag, p, len, &data);
+    }
+    if (data && io61_write(out, p, data) < 0) {
+      return copied ? (ssize_t)copied : -1;
+    }
+    if (zeros && !io61_skip_hole(out, zeros)
+        && io61_write(out, p + data, zeros) < 0) {
+      zeros = 0;
+    }
+    in->pos_tag += data + zeros;
+    copied += data + zeros;
+  }
+  return copied;
+}
+
+// io61_readv(f, iov, iovcnt)
+//    Read into the `iovcnt` buffers of `iov` in order, as if by one
+//    `io61_read` of their total size. Once buffered bytes are used up,
+//    requests at least as large as the buffer are read straight into
+//    `iov`; smaller ones go through the buffer. Returns the number of
+//    bytes read, or -1 if an error occurred before any were read.
+
+ssize_t io61_readv(io61_file *f, const struct iovec *iov, int iovcnt) {
+  io61_guard guard(f);
+  io61_traced traced(f, 'r');
+  ++f->requests;
+  std::vector<struct iovec> v(iov, iov + iovcnt);
+  struct iovec *vp = v.data();
+  int nv = iovcnt;
+  size_t total = 0;
+  for (auto &e : v) {
+    total += e.iov_len;
+  }
+
+  // use up buffered bytes first
+  size_t nread = f->pos_tag < f->end_tag
+                 ? std::min((size_t)(f->end_tag - f->pos_tag), total)
+                 : 0;
+  for (size_t done = 0; done != nread;) {
+    size_t len = std::min(vp->iov_len, nread - done);
+    memcpy(vp->iov_base, &f->cbuf[f->pos_tag - f->beg_tag], len);
+    f->pos_tag += len;
+    done += len;
+    io61_iov_skip(vp, nv, len);
+  }
+
+  if (total - nread >= (size_t)f->bufsize && f->backend->passthrough
+      && !f->async) {
+    io61_crc_fold(f);
+    // io_uring readers keep the file offset in `end_tag`
+    while (nv > 0) {
+      ssize_t n;
+      if (f->uring) {
+        n = io61_timed(f->stats, S_PREADV, [&] {
+          return preadv(f->fd, vp, std::min(nv, IOV_MAX), f->end_tag);
+        });
+      } else {
+        n = io61_timed(f->stats, S_READV, [&] {
+          return readv(f->fd, vp, std::min(nv, IOV_MAX));
+        });
+      }
+      if (n < 0 && errno == EINTR) {
+        continue;
+      } else if (n <= 0) {
+        if (n < 0 && nread == 0) {
+          return -1;
+        }
+        break;
+      }
+      nread += n;
+      f->end_tag += n;
+      io61_crc_iov(f, vp, nv, n);
+      io61_iov_skip(vp, nv, n);
+    }
+    f->beg_tag = f->pos_tag = f->crc_tag = f->end_tag;
   } else {
+    while (nv > 0) {
+      ssize_t n = io61_read(f, (char *)vp->iov_base, vp->iov_len);
+      if (n <= 0) {
+        break;
+      }
+      nread += n;
+      if ((size_t)n != vp->iov_len) {
+        break;
+      }
+      io61_iov_skip(vp, nv, n);
+    }
+  }
+  return nread;
+}
+
+// io61_writev(f, iov, iovcnt)
+//    Write the `iovcnt` buffers of `iov` in order, as if by one
+//    `io61_write` of their total size. Requests at least as large as the
+//    buffer skip it and go to the file with one `pwritev` (or `writev`
+//    for pipes); smaller ones are copied into the buffer. Returns the
+//    number of bytes written, or -1 if an error occurred before any were
+//    written.
+
+ssize_t io61_writev(io61_file *f, const struct iovec *iov, int iovcnt) {
+  if (!io61_single_threaded()) {
+    if (io61_append *a = io61_append_get(f)) {
+      a->requests.fetch_add(1, std::memory_order_relaxed);
+      return io61_append_write(f, a, iov, iovcnt);
+    }
+  }
+  io61_guard guard(f);
+  io61_traced traced(f, 'w');
+  ++f->requests;
+  size_t total = 0;
+  for (int i = 0; i != iovcnt; ++i) {
+    total += iov[i].iov_len;
+  }
+
+  if (total < (size_t)f->bufsize || !f->backend->passthrough || f->async) {
+    size_t nwritten = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+      ssize_t n = io61_write(f, (const char *)iov[i].iov_base,
+                             iov[i].iov_len);
+      if (n < 0) {
+        return nwritten ? (ssize_t)nwritten : -1;
+      }
+      nwritten += n;
+    }
+    return nwritten;
+  }
+
+  // older bytes must not land on top of these
+  if (!f->dirty.empty()) {
+    io61_retire(f);
+    io61_dirty_trim(f, f->pos_tag, f->pos_tag + total);
+  } else if (io61_flush(f) < 0) {
+    return -1;
+  }
+  if (f->uring && io61_uring_give(f, true) < 0) {
+    return -1;
+  }
+  std::vector<struct iovec> v(iov, iov + iovcnt);
+  struct iovec *vp = v.data();
+  int nv = iovcnt;
+  size_t nwritten = 0;
+  while (nv > 0) {
+    ssize_t n;
+    if (f->positional) {
+      n = io61_timed(f->stats, S_PWRITEV, [&] {
+        return pwritev(f->fd, vp, std::min(nv, IOV_MAX), f->pos_tag);
+      });
+    } else {
+      n = io61_timed(f->stats, S_WRITEV, [&] {
+        return writev(f->fd, vp, std::min(nv, IOV_MAX));
+      });
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      if (nwritten == 0) {
+        return -1;
+      }
+      break;
+    }
+    nwritten += n;
+    f->pos_tag += n;
+    io61_crc_iov(f, vp, nv, n);
+    io61_iov_skip(vp, nv, n);
+  }
+  f->beg_tag = f->end_tag = f->crc_tag = f->pos_tag;
+  return nwritten;
+}
+
+// io61_pread_shard()
+//    Return the calling thread's index into io61_file::pread_shards.
+//    Threads take indexes in turn, so up to `npread_shards` readers of a
+//    file count their calls on cache lines of their own.
+
+static int io61_pread_shard() {
+  static std::atomic<unsigned> next_shard{0};
+  static thread_local int shard =
+      next_shard.fetch_add(1, std::memory_order_relaxed)
+      % io61_file::npread_shards;
+  return shard;
+}
+
+// io61_pread_shared(f, buf, sz, off)
+//    io61_pread for a read-only file in a process with threads. Takes no
+//    lock and touches no shared buffer: the bytes come straight from
+//    `pread`, or from the memory of a memory file, which readers cannot
+//    change, so concurrent readers never wait for one another.
+
+static ssize_t io61_pread_shared(io61_file *f, char *buf, size_t sz,
+                                 off_t off) {
+  auto &shard = f->pread_shards[io61_pread_shard()];
+  shard.requests.fetch_add(1, std::memory_order_relaxed);
+  if (f->memory) {
+    size_t n = (size_t)off < f->mem_size ? std::min(sz, f->mem_size - off) : 0;
+    memcpy(buf, f->mem_data + off, n);
     return n;
   }
+  size_t nread = 0;
+  while (nread < sz) {
+    ssize_t n = pread(f->fd, buf + nread, sz - nread, off + nread);
+    shard.calls.fetch_add(1, std::memory_order_relaxed);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      if (n < 0 && nread == 0) {
+        return -1;
+      }
+      break;
+    }
+    nread += n;
+  }
+  shard.bytes.fetch_add(nread, std::memory_order_relaxed);
+  return nread;
 }
 
-// io61_seek(f, pos)
-//    Change the file pointer for file `f` to `pos` bytes into the file.
-//    Returns 0 on success and -1 on failure.
+// io61_pread(f, buf, sz, off)
+//    Read up to `sz` bytes at offset `off` of read-only file `f` into
+//    `buf` without changing the file position. Bytes in the read buffer
+//    are used directly; other small reads go through a block cache of
+//    their own, and large ones go straight to `pread`. Once the process
+//    has threads, the read takes no lock and skips both buffers (see
+//    io61_pread_shared). Read/write files read through their slots, so
+//    they see writes not yet flushed. Returns the number of bytes read
+//    (short only at end of file), or -1 on error.
 
-int io61_seek(io61_file *f, off_t pos) {
-  if (f->mode == O_WRONLY) {
+ssize_t io61_pread(io61_file *f, char *buf, size_t sz, off_t off) {
+  // traced files take the lock, which guards the trace
+  if (!io61_single_threaded() && f->mode == O_RDONLY && f->seekable
+      && !f->lz && !f->trace) {
+    return io61_pread_shared(f, buf, sz, off);
+  }
+  io61_guard guard(f);
+  io61_traced traced(f, 'r', 0, off, sz);
+  ++f->requests;
+  if (f->rdwr) {
+    if (off < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    return io61_rdwr_io(f, buf, sz, off, false);
+  } else if (f->mode != O_RDONLY) {
+    errno = EBADF;
+    return -1;
+  } else if (!f->seekable) {
+    errno = ESPIPE;
+    return -1;
+  } else if (f->lz) {
+    return io61_lz_pread(f, buf, sz, off);
+  } else if (f->memory) {
+    size_t n = (size_t)off < f->mem_size ? std::min(sz, f->mem_size - off) : 0;
+    memcpy(buf, f->mem_data + off, n);
+    return n;
+  }
+  if (off >= f->beg_tag && off + (off_t)sz <= f->end_tag) {
+    memcpy(buf, &f->cbuf[off - f->beg_tag], sz);
+    return sz;
+  }
+
+  size_t nread = 0;
+  while (nread < sz) {
+    off_t pos = off + nread;
+    if (sz - nread >= (size_t)f->blksize) {
+      ssize_t n = io61_timed(f->stats, S_PREAD, [&] {
+        return pread(f->fd, buf + nread, sz - nread, pos);
+      });
+      if (n < 0 && errno == EINTR) {
+        continue;
+      } else if (n <= 0) {
+        return nread || n == 0 ? (ssize_t)nread : -1;
+      }
+      nread += n;
+      continue;
+    }
+    if (!f->pbuf) {
+      f->pbuf.reset(new char[f->blksize]);
+    }
+    if (pos < f->pbuf_tag || pos >= f->pbuf_end) {
+      off_t start = (pos / f->blksize) * f->blksize;
+      ++f->stats.refills;
+      ssize_t n = io61_timed(f->stats, S_PREAD, [&] {
+        return pread(f->fd, f->pbuf.get(), f->blksize, start);
+      });
+      if (n < 0 && errno == EINTR) {
+        continue;
+      } else if (n < 0) {
+        return nread ? (ssize_t)nread : -1;
+      }
+      f->pbuf_tag = start;
+      f->pbuf_end = start + n;
+      if (pos >= f->pbuf_end) {
+        break;
+      }
+    }
+    size_t len = std::min(sz - nread, (size_t)(f->pbuf_end - pos));
+    memcpy(buf + nread, &f->pbuf[pos - f->pbuf_tag], len);
+    nread += len;
+  }
+  return nread;
+}
+
+// io61_pwrite(f, buf, sz, off)
+//    Write `sz` bytes from `buf` at offset `off` of write-only file `f`
+//    without changing the file position. Small writes join the write-back
+//    cache, where they coalesce with their neighbors; large ones, and
+//    all writes to files without the cache, go straight to `pwrite`
+//    after the bytes buffered before them. Read/write files take the
+//    bytes into their slots, like io61_write. Returns the number of bytes
+//    written, or -1 on error.
+
+ssize_t io61_pwrite(io61_file *f, const char *buf, size_t sz, off_t off) {
+  io61_guard guard(f);
+  io61_traced traced(f, 'w', 0, off, sz);
+  ++f->requests;
+  if (f->rdwr) {
+    if (off < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    // bytes read through the position are checksummed as they were
+    io61_crc_fold(f);
+    return io61_rdwr_io(f, (char *)buf, sz, off, true);
+  } else if (f->map && f->mode == O_WRONLY && off >= 0
+             && io61_mmap_reserve(f, off + sz) == 0) {
+    memcpy(f->map + off, buf, sz);
+    if (sz) {
+      f->map_end = std::max(f->map_end, off + (off_t)sz);
+    }
+    return sz;
+  } else if (f->mode != O_WRONLY) {
+    errno = EBADF;
+    return -1;
+  } else if (f->lz) {
+    // compressed streams are written in order
+    errno = ESPIPE;
+    return -1;
+  } else if (f->memory) {
+    // land buffered bytes first; growing may move the memory
+    if (off < 0) {
+      errno = EINVAL;
+      return -1;
+    } else if (io61_flush(f) < 0 || io61_mem_reserve(f, off + sz) < 0) {
+      return -1;
+    }
+    memcpy(f->mem_data + off, buf, sz);
+    f->mem_size = std::max(f->mem_size, off + sz);
+    io61_mem_window(f, f->pos_tag);
+    return sz;
+  } else if (!f->positional || f->append) {
+    // appends made before this write land first
+    if (io61_flush(f) < 0) {
+      return -1;
+    }
+  } else {
+    io61_async_stop(f);
+    // bytes already buffered are older than these
+    io61_retire(f);
+    if (sz < (size_t)f->bufsize) {
+      io61_dirty_add(f, off, buf, sz);
+      return io61_dirty_check(f) < 0 ? -1 : (ssize_t)sz;
+    }
+    io61_dirty_trim(f, off, off + sz);
+    if (f->uring && io61_uring_give(f, true) < 0) {
+      return -1;
+    }
+  }
+  size_t nwritten = 0;
+  while (nwritten < sz) {
+    ssize_t n = io61_timed(f->stats, S_PWRITE, [&] {
+      return pwrite(f->fd, buf + nwritten, sz - nwritten, off + nwritten);
+    });
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return nwritten ? (ssize_t)nwritten : -1;
+    }
+    nwritten += n;
+  }
+  return nwritten;
+}
+
+// io61_observe(f, pos)
+//    Record a seek to `pos` in the access history of read-only file `f`
+//    and reclassify its access pattern. Three seeks in a row that move by
+//    the same distance establish a sequential, reverse, or strided
+//    pattern; four in a row that do not make the pattern random.
+
+static void io61_observe(io61_file *f, off_t pos) {
+  off_t consumed = f->pos_tag - f->seek_tag;
+  off_t delta = pos - f->seek_tag;
+  f->seek_tag = pos;
+  if (pos == f->pos_tag) {
+    // continuing where the last read left off
+    return;
+  }
+  f->span = consumed;
+  if (delta == f->delta) {
+    ++f->streak;
+    f->misses = 0;
+  } else {
+    f->delta = delta;
+    f->streak = 0;
+    ++f->misses;
+  }
+
+  io61_pattern pattern = f->pattern;
+  if (f->streak >= 2 && delta < 0) {
+    pattern = P_REVERSE;
+  } else if (f->streak >= 2 && delta <= consumed) {
+    pattern = P_SEQUENTIAL;
+  } else if (f->streak >= 2) {
+    pattern = P_STRIDED;
+  } else if (f->misses >= 4) {
+    pattern = P_RANDOM;
+  }
+  if (pattern != f->pattern) {
+    f->pattern = pattern;
+    f->advised = false;
+    f->hint_tag = -1;
+  }
+}
+
+// io61_fill_start(f, pos)
+//    Return the file offset where a buffer fill that must cover `pos`
+//    should begin. Reverse readers get a buffer that ends just after the
+//    bytes they read at `pos`, and lz readers the frame that holds `pos`;
+//    everyone else gets a buffer aligned forward.
+
+static off_t io61_fill_start(io61_file *f, off_t pos) {
+  if (f->lz) {
+    // lz fills return the whole frame that holds their offset, and a
+    // frame ends wherever its writer flushed, so only `pos` is sure to
+    // be covered
+    return pos;
+  } else if (f->pattern == P_REVERSE) {
+    off_t end = pos + (f->span > 0 ? f->span : 1);
+    return end > f->bufcap ? end - f->bufcap : 0;
+  }
+  // other fills start at the block that holds `pos`, so that a fill of
+  // a whole buffer reaches as far past it as it can
+  off_t unit = f->pattern == P_SEQUENTIAL ? f->bufcap
+                                          : std::min(f->bufcap, f->blksize);
+  return (pos / unit) * unit;
+}
+
+// io61_advise(f, pos)
+//    Tell the kernel which parts of `f` we expect to read after the
+//    buffer fill at `pos`. Errors are ignored; these are only hints.
+
+static void io61_advise(io61_file *f, off_t pos) {
+  auto fadvise = [f](off_t off, off_t len, int advice) {
+    io61_timed(f->stats, S_FADVISE,
+               [&] { return posix_fadvise(f->fd, off, len, advice); });
+  };
+  off_t ahead = f->prefetch_depth * f->bufsize;
+  if (!f->advised) {
+    if (f->pattern == P_SEQUENTIAL) {
+      fadvise(0, 0, POSIX_FADV_SEQUENTIAL);
+    } else if (f->pattern == P_RANDOM) {
+      fadvise(0, 0, POSIX_FADV_RANDOM);
+    } else {
+      fadvise(0, 0, POSIX_FADV_NORMAL);
+    }
+    f->advised = true;
+  }
+  // each range is hinted once: reverse readers hint the next `ahead`
+  // bytes when half of the last hint is used up, and strided readers
+  // hint a block only if it is past every block hinted before
+  if (f->pattern == P_REVERSE && pos > 0
+      && (f->hint_tag < 0 || pos - f->hint_tag < ahead / 2)) {
+    off_t start = pos > ahead ? pos - ahead : 0;
+    off_t end = f->hint_tag < 0 ? pos : std::min(pos, f->hint_tag);
+    if (start < end) {
+      fadvise(start, end - start, POSIX_FADV_WILLNEED);
+      f->hint_tag = start;
+    }
+  } else if (f->pattern == P_STRIDED && f->delta > f->blksize) {
+    off_t next = pos + f->prefetch_depth * f->delta;
+    off_t block = (next / f->blksize) * f->blksize;
+    if (block >= f->hint_tag) {
+      fadvise(block, f->blksize, POSIX_FADV_WILLNEED);
+      f->hint_tag = block + f->blksize;
+    }
+  }
+}
+
+// io61_seek_locked(f, pos)
+//    io61_seek for a caller holding the file lock.
+
+static int io61_seek_locked(io61_file *f, off_t pos) {
+  ++f->stats.seeks;
+  io61_crc_fold(f);
+  if (f->mode == O_WRONLY && f->positional) {
+    // keep the write buffer's bytes in the write-back cache
+    if (pos < 0) {
+      return -1;
+    } else if (pos != f->pos_tag) {
+      io61_async_stop(f);
+      io61_retire(f);
+      io61_end_hole(f);
+      f->beg_tag = f->end_tag = f->pos_tag = f->crc_tag = pos;
+    }
+    return 0;
+  } else if (f->mode == O_WRONLY) {
     io61_flush(f);
+  } else {
+    io61_observe(f, pos);
   }
   // if the position is within the current file buffer then we are done
   if (pos < f->end_tag && pos >= f->beg_tag) {
-    f->pos_tag = pos;
+    f->pos_tag = f->crc_tag = pos;
     return 0;
   }
   // otherwise need to seek
   off_t new_pos = pos;
   if (f->mode == O_RDONLY) {
-    new_pos = (pos / f->bufsize) * f->bufsize;
+    if (f->async && io61_timed(f->stats, S_LSEEK, [&] {
+          return lseek(f->fd, 0, SEEK_CUR);
+        }) < 0) {
+      return -1;
+    }
+    io61_async_stop(f);
+    new_pos = io61_fill_start(f, pos);
   }
-  off_t r = lseek(f->fd, new_pos, SEEK_SET);
+  off_t r = f->seek(f, new_pos);
   if (f->mode == O_RDONLY) {
     f->end_tag = new_pos;
     io61_fill(f);
+    io61_advise(f, new_pos);
   } else {
     f->beg_tag = f->end_tag = pos;
   }
-  f->pos_tag = pos;
+  f->pos_tag = f->crc_tag = pos;
 
   // check for success and return
   if (r == new_pos) {
@@ -213,6 +3258,27 @@ int io61_seek(io61_file *f, off_t pos) {
   }
 }
 
+// io61_seek(f, pos)
+//    Change the file pointer for file `f` to `pos` bytes into the file.
+//    Returns 0 on success and -1 on failure. Threads appending to `f`
+//    through a shared buffer continue at `pos`.
+
+int io61_seek(io61_file *f, off_t pos) {
+  io61_guard guard(f);
+  io61_traced traced(f, '@');
+  io61_append *a = f->append;
+  if (a && io61_append_drain(f) < 0) {
+    return -1;
+  }
+  int r = io61_seek_locked(f, pos);
+  if (a) {
+    std::lock_guard<std::mutex> lock(a->m);
+    a->off = f->pos_tag;
+  }
+  return r;
+}
+
+
 // You shouldn't need to change these functions.
 
 // io61_open_check(filename, mode)
@@ -234,7 +3300,13 @@ io61_file *io61_open_check(const char *filename, int mode) {
     fprintf(stderr, "%s: %s\n", filename, strerror(errno));
     exit(1);
   }
-  return io61_fdopen(fd, mode & O_ACCMODE);
+  io61_file *f = io61_fdopen(fd, mode & O_ACCMODE);
+  if (!f) {
+    fprintf(stderr, "%s: %s\n", filename ? filename : "-",
+            strerror(errno));
+    exit(1);
+  }
+  return f;
 }
 
 // io61_filesize(f)
@@ -242,8 +3314,16 @@ io61_file *io61_open_check(const char *filename, int mode) {
 //    well-defined size (for instance, if it is a pipe).
 
 off_t io61_filesize(io61_file *f) {
+  io61_guard guard(f);
   struct stat s;
-  int r = fstat(f->fd, &s);
+  if (f->lz) {
+    return io61_lz_size(f);
+  } else if (f->memory) {
+    return io61_mem_size(f);
+  } else if (f->rdwr) {
+    return io61_rdwr_size(f);
+  }
+  int r = f->inputs ? -1 : fstat(f->fd, &s);
   if (r >= 0 && S_ISREG(s.st_mode)) {
     return s.st_size;
   } else {
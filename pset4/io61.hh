@@ -1,33 +1,209 @@
 #ifndef IO61_HH
 #define IO61_HH
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
+#include <cstdint>
 #include <vector>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/uio.h>
+#if __has_include(<sys/single_threaded.h>)
+#include <sys/single_threaded.h>
+#define IO61_HAVE_SINGLE_THREADED 1
+#endif
 
 struct io61_file;
 
-io61_file* io61_fdopen(int fd, int mode);
+// io61_fastpath
+//    The first base of every io61_file: the buffer state that the inline
+//    byte functions below may use without calling into the library.
+//    `cbuf` holds the file bytes [beg_tag, end_tag), and the file
+//    position is `pos_tag`. A read may take the byte at `pos_tag` while
+//    `pos_tag < end_tag`; a write may append while the buffer holds fewer
+//    than `bufcap` bytes. Everything else, and every file whose fields
+//    stay zero, goes through the out-of-line functions.
+struct io61_fastpath {
+    char* cbuf = nullptr;       // the buffer in use
+    off_t beg_tag = 0;          // file offset of `cbuf[0]`
+    off_t end_tag = 0;          // end of buffered data
+    off_t pos_tag = 0;          // current position
+    off_t bufcap = 0;           // bytes of `cbuf` that writes may use
+    unsigned long requests = 0; // io61 calls on the file
+};
+
+// io61_fast(f)
+//    Return the io61_fastpath base of `f`. io61_file is incomplete here,
+//    so this cannot be a static_cast; instead every implementation makes
+//    io61_fastpath the first base of its io61_file, and checks that it
+//    sits at offset 0 with IO61_CHECK_FASTPATH.
+inline io61_fastpath* io61_fast(io61_file* f) {
+    return reinterpret_cast<io61_fastpath*>(f);
+}
+
+#define IO61_CHECK_FASTPATH(T)                                          \
+    _Pragma("GCC diagnostic push")                                      \
+    _Pragma("GCC diagnostic ignored \"-Winvalid-offsetof\"")            \
+    static_assert(offsetof(T, cbuf) == 0,                               \
+                  #T " must start with its io61_fastpath base");        \
+    _Pragma("GCC diagnostic pop")
+
+io61_file* io61_fdopen(int fd, int mode, const char* backend = nullptr);
 io61_file* io61_open_check(const char* filename, int mode);
+io61_file* io61_open_concat(const std::vector<const char*>& filenames,
+                            int ahead = 4);
+io61_file* io61_memopen(const char* data, size_t sz, int mode,
+                        bool memfd = false);
+const char* io61_memdata(io61_file* f, size_t* sz);
+int io61_fileno(io61_file* f);
+io61_file* io61_memload(const std::vector<const char*>& filenames);
+int io61_memsave(io61_file* f, const char* filename);
+int io61_stream(io61_file* f, int timeout_ms, size_t flush_size = 0,
+                long flush_us = -1);
+int io61_setvbuf(io61_file* f, size_t size);
+int io61_size_hint(io61_file* f, off_t size);
 int io61_close(io61_file* f);
 
+void io61_lock(io61_file* f);
+void io61_unlock(io61_file* f);
+inline bool io61_single_threaded();
+
 off_t io61_filesize(io61_file* f);
 
 int io61_seek(io61_file* f, off_t pos);
 
-int io61_readc(io61_file* f);
-int io61_writec(io61_file* f, int ch);
+int io61_readc_slow(io61_file* f);
+int io61_writec_slow(io61_file* f, int ch);
+inline int io61_readc_unlocked(io61_file* f);
+inline int io61_writec_unlocked(io61_file* f, int ch);
+inline int io61_readc(io61_file* f);
+inline int io61_writec(io61_file* f, int ch);
 
 ssize_t io61_read(io61_file* f, char* buf, size_t sz);
 ssize_t io61_write(io61_file* f, const char* buf, size_t sz);
 
+ssize_t io61_readline(io61_file* f, const char** line);
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt);
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt);
+ssize_t io61_pread(io61_file* f, char* buf, size_t sz, off_t off);
+ssize_t io61_pwrite(io61_file* f, const char* buf, size_t sz, off_t off);
+
+inline ssize_t io61_read_unlocked(io61_file* f, char* buf, size_t sz);
+inline ssize_t io61_write_unlocked(io61_file* f, const char* buf, size_t sz);
+
 int io61_flush(io61_file* f);
 
+ssize_t io61_copy(io61_file* in, io61_file* out, size_t n);
+
+void io61_checksum_start(io61_file* f);
+uint32_t io61_checksum(io61_file* f);
+uint32_t io61_crc32c(uint32_t crc, const void* buf, size_t sz);
+
 void io61_profile_begin();
 void io61_profile_end();
+void io61_profile_note(const char* key, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+
+// io61_readc_unlocked(f), io61_writec_unlocked(f, ch)
+//    Byte-at-a-time I/O on a file that only the caller uses, or whose
+//    lock the caller holds. A byte that the buffer can supply or take
+//    costs a few instructions; the rest goes to io61_readc_slow or
+//    io61_writec_slow, which refill or drain the buffer. Return values
+//    are as for io61_readc and io61_writec.
+
+inline int io61_readc_unlocked(io61_file* f) {
+    auto fp = io61_fast(f);
+    ++fp->requests;
+    if (fp->pos_tag < fp->end_tag) {
+        return (unsigned char) fp->cbuf[fp->pos_tag++ - fp->beg_tag];
+    }
+    return io61_readc_slow(f);
+}
+
+inline int io61_writec_unlocked(io61_file* f, int ch) {
+    auto fp = io61_fast(f);
+    ++fp->requests;
+    if (fp->end_tag - fp->beg_tag < fp->bufcap) {
+        fp->cbuf[fp->pos_tag - fp->beg_tag] = ch;
+        ++fp->pos_tag;
+        ++fp->end_tag;
+        return 0;
+    }
+    return io61_writec_slow(f, ch);
+}
+
+// io61_read_unlocked(f, buf, sz), io61_write_unlocked(f, buf, sz)
+//    Bulk versions of the above: a transfer that fits in the buffer is a
+//    memcpy, and anything else is an io61_read or io61_write call.
+
+inline ssize_t io61_read_unlocked(io61_file* f, char* buf, size_t sz) {
+    auto fp = io61_fast(f);
+    if (sz <= size_t(fp->end_tag - fp->pos_tag)) {
+        ++fp->requests;
+        memcpy(buf, &fp->cbuf[fp->pos_tag - fp->beg_tag], sz);
+        fp->pos_tag += sz;
+        return sz;
+    }
+    return io61_read(f, buf, sz);
+}
+
+inline ssize_t io61_write_unlocked(io61_file* f, const char* buf, size_t sz) {
+    auto fp = io61_fast(f);
+    // a window of read/write data may hold more than `bufcap` bytes
+    off_t room = fp->bufcap - (fp->end_tag - fp->beg_tag);
+    if (room >= 0 && sz <= size_t(room)) {
+        ++fp->requests;
+        memcpy(&fp->cbuf[fp->pos_tag - fp->beg_tag], buf, sz);
+        fp->pos_tag += sz;
+        fp->end_tag += sz;
+        return sz;
+    }
+    return io61_write(f, buf, sz);
+}
+
+// io61_single_threaded()
+//    Return true while the process has only one thread. No other thread
+//    can then use a file, so the io61 functions skip its lock. This never
+//    becomes true again once a second thread has started.
+
+inline bool io61_single_threaded() {
+#if IO61_HAVE_SINGLE_THREADED
+    return __libc_single_threaded;
+#else
+    return false;
+#endif
+}
+
+// io61_readc(f), io61_writec(f, ch)
+//    Read or write a single character. Every io61 function may be called
+//    on a file that other threads are using; these hold the file's lock
+//    (io61_lock) around the unlocked versions once the process has
+//    threads. A thread that does many byte operations in a row can take
+//    the lock itself and use the unlocked versions directly.
+
+inline int io61_readc(io61_file* f) {
+    if (io61_single_threaded()) {
+        return io61_readc_unlocked(f);
+    }
+    io61_lock(f);
+    int ch = io61_readc_unlocked(f);
+    io61_unlock(f);
+    return ch;
+}
+
+inline int io61_writec(io61_file* f, int ch) {
+    if (io61_single_threaded()) {
+        return io61_writec_unlocked(f, ch);
+    }
+    io61_lock(f);
+    int r = io61_writec_unlocked(f, ch);
+    io61_unlock(f);
+    return r;
+}
 
 
 struct io61_arguments {
@@ -35,6 +211,12 @@ struct io61_arguments {
     size_t block_size;          // `-b` option: block size. Default 0
     size_t stride;              // `-t` option: stride. Default 1024
     bool lines;                 // `-l` option: read by lines. Default false
+    bool copy;                  // `-k` option: copy with io61_copy. Default false
+    bool verify;                // `-c` option: compare checksums. Default false
+    bool memory;                // `-m` option: files in memory. Default false
+    bool stream;                // `-p` option: pipes in stream mode. Default false
+    bool flush;                 // `-f` option: flush after each block. Default false
+    size_t threads;             // `-j` option: threads. Default 1
     const char* output_file;    // `-o` option: output file. Default nullptr
     const char* input_file;     // input file. Default nullptr
     std::vector<const char*> input_files;   // all input files
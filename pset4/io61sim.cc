@@ -0,0 +1,469 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "tool61.hh"
+
+// Usage: ./io61sim [-c CONFIGS] [-v] [TRACEFILE...]
+//    Replays access traces recorded with $IO61_TRACE (see io61_trace in
+//    io61.cc) against candidate cache configurations, and reports for
+//    each the system calls and bytes that its reads and writes would
+//    cost. Traces come from the TRACEFILEs, or from standard input.
+//
+//    A CONFIG is SLOTSxSIZE[+POLICY]: SLOTS cached blocks of SIZE bytes
+//    each, kept in least-recently-used order. A read miss fills its block
+//    with one read call. POLICY is seqK, which reads K blocks in that
+//    call when the miss follows the block that last missed, or aheadK,
+//    which always does; K is at most SLOTS. Writes mark exact byte ranges
+//    of their blocks dirty; a block is written back, one write call per
+//    dirty range, when it is evicted, and every dirty block is written
+//    back when the file closes, with adjacent ranges of consecutive
+//    blocks coalesced into one call. A write miss on a read/write file
+//    fills its block first, unless it covers the block; on a write-only
+//    file it does not.
+//
+//    The output is CSV, one row per configuration with the totals over
+//    every traced file, and with `-v` one more row per file. hit_rate is
+//    the fraction of block accesses that hit the cache. Lists are
+//    comma-separated; sizes take k, m, and g suffixes.
+//
+//    Default: -c 1x4k,1x8k,1x64k,8x4k,...,64x64k+seq4, every combination
+//    of 1, 8, or 64 slots, 4k, 8k, or 64k blocks, and no prefetch or seq4.
+
+
+// op, trace
+//    One file's trace: how it was opened and its records, still
+//    run-length encoded.
+
+struct op {
+    bool seeking;
+    long long seek;     // position change before the transfer
+    char op;            // 'c', 'C', 'r', 'w', or 0 for a seek alone
+    long long n;        // bytes per transfer
+    unsigned long count;
+};
+
+struct trace {
+    std::string id;
+    std::string mode;   // "r", "w", or "rw"
+    long long size;     // -1 if not a regular file
+    long long pos;
+    std::vector<op> ops;
+};
+
+
+// read_traces(fp, traces, order)
+//    Add the records in `fp` to `traces`, keyed by file id; `order` lists
+//    the ids in the order they opened. Exits on a malformed record.
+
+static void read_traces(FILE* fp, const char* name,
+                        std::map<std::string, trace>& traces,
+                        std::vector<std::string>& order) {
+    char line[256];
+    unsigned lineno = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        ++lineno;
+        std::vector<std::string> w;
+        for (char* s = strtok(line, " \n"); s; s = strtok(nullptr, " \n")) {
+            w.push_back(s);
+        }
+        auto bad = [&] {
+            fprintf(stderr, "%s:%u: bad trace record\n", name, lineno);
+            exit(1);
+        };
+        if (w.empty()) {
+            continue;
+        } else if (w.size() < 2) {
+            bad();
+        }
+        if (w[1] == "open") {
+            if (w.size() != 5 || traces.count(w[0])
+                || (w[2] != "r" && w[2] != "w" && w[2] != "rw")) {
+                bad();
+            }
+            char* size_end;
+            char* pos_end;
+            long long size = strtoll(w[3].c_str(), &size_end, 0);
+            long long pos = strtoll(w[4].c_str(), &pos_end, 0);
+            if (*size_end || *pos_end) {
+                bad();
+            }
+            trace& t = traces[w[0]];
+            t.id = w[0];
+            t.mode = w[2];
+            t.size = size;
+            t.pos = pos;
+            order.push_back(w[0]);
+            continue;
+        }
+        auto it = traces.find(w[0]);
+        if (it == traces.end()) {
+            bad();
+        } else if (w[1] == "close") {
+            continue;
+        }
+        op o = {false, 0, 0, 0, 1};
+        for (size_t i = 1; i != w.size(); ++i) {
+            const char* s = w[i].c_str();
+            char* end = nullptr;
+            if ((s[0] == 'c' || s[0] == 'C') && !s[1] && !o.op) {
+                o.op = s[0];
+                o.n = 1;
+                continue;
+            } else if (s[0] == '@' && i == 1) {
+                o.seeking = true;
+                o.seek = strtoll(s + 1, &end, 0);
+            } else if ((s[0] == 'r' || s[0] == 'w') && !o.op) {
+                o.op = s[0];
+                o.n = strtoll(s + 1, &end, 0);
+            } else if (s[0] == 'x') {
+                o.count = strtoul(s + 1, &end, 0);
+            }
+            if (!end || *end || end == s + 1) {
+                bad();
+            }
+        }
+        it->second.ops.push_back(o);
+    }
+}
+
+
+// config
+//    One cache configuration to simulate.
+
+struct config {
+    std::string name;
+    size_t slots;
+    size_t size;
+    enum { NONE, SEQ, AHEAD } policy;
+    size_t depth;       // blocks read per prefetching miss
+};
+
+static config parse_config(const std::string& s) {
+    config c;
+    c.name = s;
+    const char* rest;
+    c.slots = parse_size("io61sim", s, &rest);
+    if (*rest != 'x') {
+        fprintf(stderr, "io61sim: bad configuration '%s'\n", s.c_str());
+        exit(1);
+    }
+    std::string tail = rest + 1;
+    size_t plus = tail.find('+');
+    c.size = parse_size("io61sim", tail.substr(0, plus));
+    c.policy = config::NONE;
+    c.depth = 1;
+    if (plus != std::string::npos) {
+        std::string p = tail.substr(plus + 1);
+        if (p.compare(0, 3, "seq") == 0) {
+            c.policy = config::SEQ;
+            c.depth = parse_size("io61sim", p.substr(3));
+        } else if (p.compare(0, 5, "ahead") == 0) {
+            c.policy = config::AHEAD;
+            c.depth = parse_size("io61sim", p.substr(5));
+        } else {
+            c.depth = 0;
+        }
+    }
+    if (c.slots == 0 || c.size == 0 || c.depth == 0) {
+        fprintf(stderr, "io61sim: bad configuration '%s'\n", s.c_str());
+        exit(1);
+    }
+    c.depth = std::min(c.depth, c.slots);
+    return c;
+}
+
+
+// counts
+//    What a replay cost.
+
+struct counts {
+    unsigned long long requests = 0;
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+    unsigned long long read_calls = 0;
+    unsigned long long read_bytes = 0;
+    unsigned long long write_calls = 0;
+    unsigned long long write_bytes = 0;
+
+    void add(const counts& x) {
+        requests += x.requests;
+        hits += x.hits;
+        misses += x.misses;
+        read_calls += x.read_calls;
+        read_bytes += x.read_bytes;
+        write_calls += x.write_calls;
+        write_bytes += x.write_bytes;
+    }
+};
+
+
+// cache
+//    The simulated cache of one file.
+
+struct cache {
+    struct slot {
+        long long block = -1;
+        unsigned long long used = 0;            // LRU stamp
+        std::map<size_t, size_t> dirty;         // start -> end in block
+    };
+
+    const config& c;
+    counts& n;
+    bool fill_writes;   // whether a write miss reads its block first
+    long long size;     // file size, which writes extend
+    std::vector<slot> slots;
+    std::unordered_map<long long, size_t> index;  // block -> slot
+    size_t mru = 0;
+    unsigned long long clock = 0;
+    long long last_miss = -2;
+
+    cache(const config& c_, counts& n_, bool fill_writes_, long long size_)
+        : c(c_), n(n_), fill_writes(fill_writes_), size(size_),
+          slots(c_.slots) {
+    }
+
+    // write back the dirty ranges of `s`
+    void writeback(slot& s) {
+        for (auto& r : s.dirty) {
+            ++n.write_calls;
+            n.write_bytes += r.second - r.first;
+        }
+        s.dirty.clear();
+    }
+
+    // return the least recently used slot, emptied, for `block`
+    slot& take(long long block) {
+        size_t i = 0;
+        for (size_t j = 1; j != slots.size(); ++j) {
+            if (slots[j].used < slots[i].used) {
+                i = j;
+            }
+        }
+        slot& s = slots[i];
+        writeback(s);
+        if (s.block >= 0) {
+            index.erase(s.block);
+        }
+        s.block = block;
+        index[block] = i;
+        s.used = ++clock;
+        mru = i;
+        return s;
+    }
+
+    // read `nblocks` blocks from `block` with one call, at most to EOF
+    void fill(long long block, size_t nblocks) {
+        long long start = block * c.size;
+        long long end = std::min<long long>(start + nblocks * c.size, size);
+        ++n.read_calls;
+        n.read_bytes += std::max(end - start, 0LL);
+        for (size_t i = 1; i < nblocks && start + i * c.size < size_t(end);
+             ++i) {
+            if (!index.count(block + i)) {
+                take(block + i);
+            }
+        }
+    }
+
+    // access byte range [lo, hi) of `block`
+    void access(long long block, size_t lo, size_t hi, bool writing) {
+        slot* s = &slots[mru];
+        if (s->block != block) {
+            auto it = index.find(block);
+            s = it == index.end() ? nullptr : &slots[it->second];
+        }
+        if (s) {
+            ++n.hits;
+            mru = s - slots.data();
+        } else {
+            ++n.misses;
+            size_t depth = c.policy == config::AHEAD
+                               || (c.policy == config::SEQ
+                                   && block == last_miss + 1)
+                           ? c.depth : 1;
+            last_miss = block;
+            s = &take(block);
+            // a write of the whole block need not read it
+            if (!writing || (fill_writes && hi - lo < c.size)) {
+                fill(block, depth);
+            }
+            mru = s - slots.data();
+        }
+        s->used = ++clock;
+        if (writing) {
+            auto it = s->dirty.lower_bound(lo);
+            if (it != s->dirty.begin() && std::prev(it)->second >= lo) {
+                --it;
+                lo = it->first;
+            }
+            while (it != s->dirty.end() && it->first <= hi) {
+                hi = std::max(hi, it->second);
+                it = s->dirty.erase(it);
+            }
+            s->dirty[lo] = hi;
+        }
+    }
+
+    // a transfer of `len` bytes at `pos`
+    void transfer(long long pos, long long len, bool writing) {
+        if (writing) {
+            size = std::max(size, pos + len);
+        } else {
+            len = std::min(len, size - pos);
+        }
+        if (len <= 0) {
+            // a read at end of file still asks the kernel
+            ++n.read_calls;
+            return;
+        }
+        for (long long b = pos / c.size; b * (long long) c.size < pos + len;
+             ++b) {
+            long long start = b * c.size;
+            size_t lo = std::max(pos, start) - start;
+            size_t hi = std::min<long long>(pos + len, start + c.size) - start;
+            access(b, lo, hi, writing);
+        }
+    }
+
+    // write back everything, coalescing across consecutive blocks
+    void close() {
+        std::vector<slot*> v;
+        for (auto& s : slots) {
+            if (!s.dirty.empty()) {
+                v.push_back(&s);
+            }
+        }
+        std::sort(v.begin(), v.end(), [](slot* a, slot* b) {
+            return a->block < b->block;
+        });
+        long long run_end = -1;
+        for (slot* s : v) {
+            long long base = s->block * c.size;
+            for (auto& r : s->dirty) {
+                if (base + (long long) r.first != run_end) {
+                    ++n.write_calls;
+                }
+                n.write_bytes += r.second - r.first;
+                run_end = base + r.second;
+            }
+            s->dirty.clear();
+        }
+    }
+};
+
+
+// replay(t, c, n)
+//    Replay trace `t` against configuration `c`, adding its costs to `n`.
+
+static void replay(const trace& t, const config& c, counts& n) {
+    long long size = t.size;
+    if (size < 0) {
+        // a pipe ends where its reader stopped
+        size = 0;
+        long long pos = t.pos;
+        for (auto& o : t.ops) {
+            for (unsigned long i = 0; i != o.count; ++i) {
+                pos += o.seek + (o.op ? o.n : 0);
+                size = std::max(size, pos);
+            }
+        }
+    }
+    cache k(c, n, t.mode == "rw", size);
+    long long pos = t.pos;
+    for (auto& o : t.ops) {
+        bool writing = o.op == 'C' || o.op == 'w';
+        for (unsigned long i = 0; i != o.count; ++i) {
+            pos += o.seek;
+            if (o.op) {
+                ++n.requests;
+                k.transfer(pos, o.n, writing);
+                pos += o.n;
+            }
+        }
+    }
+    k.close();
+}
+
+
+static void print_row(const config& c, const char* file, const counts& n) {
+    unsigned long long accesses = n.hits + n.misses;
+    printf("%s,%s,%llu,%.4f,%llu,%llu,%llu,%llu\n", c.name.c_str(), file,
+           n.requests, accesses ? (double) n.hits / accesses : 0.0,
+           n.read_calls, n.read_bytes, n.write_calls, n.write_bytes);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: ./io61sim [-c CONFIGS] [-v] [TRACEFILE...]\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> confnames;
+    for (const char* slots : {"1", "8", "64"}) {
+        for (const char* size : {"4k", "8k", "64k"}) {
+            for (const char* policy : {"", "+seq4"}) {
+                confnames.push_back(std::string(slots) + "x" + size + policy);
+            }
+        }
+    }
+    bool verbose = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:v")) != -1) {
+        switch (opt) {
+        case 'c':
+            confnames = split(optarg);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage();
+        }
+    }
+    std::vector<config> configs;
+    for (auto& s : confnames) {
+        configs.push_back(parse_config(s));
+    }
+
+    std::map<std::string, trace> traces;
+    std::vector<std::string> order;
+    if (optind == argc) {
+        read_traces(stdin, "<stdin>", traces, order);
+    }
+    for (int i = optind; i != argc; ++i) {
+        FILE* fp = fopen(argv[i], "r");
+        if (!fp) {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+            exit(1);
+        }
+        read_traces(fp, argv[i], traces, order);
+        fclose(fp);
+    }
+    if (order.empty()) {
+        fprintf(stderr, "io61sim: no trace records\n");
+        exit(1);
+    }
+
+    printf("config,file,requests,hit_rate,read_calls,read_bytes,"
+           "write_calls,write_bytes\n");
+    for (auto& c : configs) {
+        counts total;
+        for (auto& id : order) {
+            counts n;
+            replay(traces[id], c, n);
+            if (verbose) {
+                print_row(c, id.c_str(), n);
+            }
+            total.add(n);
+        }
+        print_row(c, "all", total);
+    }
+}
@@ -0,0 +1,39 @@
+#include "io61.hh"
+#include <cerrno>
+
+// Usage: ./linecat61 [-s SIZE] [-o OUTFILE] [FILE]
+//    Copies the input FILE to OUTFILE one line at a time, using
+//    io61_readline.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_arguments args(argc, argv, "s:o:i:");
+
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+
+    int status = 0;
+    while (args.input_size > 0) {
+        const char* line;
+        ssize_t amount = io61_readline(inf, &line);
+        if (amount < 0) {
+            fprintf(stderr, "linecat61: %s\n", strerror(errno));
+            status = 1;
+        }
+        if (amount <= 0) {
+            break;
+        }
+        if ((size_t) amount > args.input_size) {
+            amount = args.input_size;
+        }
+        io61_write(outf, line, amount);
+        args.input_size -= amount;
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    io61_profile_end();
+    return status;
+}
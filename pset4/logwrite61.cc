@@ -0,0 +1,86 @@
+#include "io61.hh"
+#include <ctime>
+#include <thread>
+
+// Usage: ./logwrite61 [-s SIZE] [-b BLOCKSIZE] [-j THREADS] [-o OUTFILE]
+//    Has THREADS threads append log records to one shared output file
+//    until it holds SIZE bytes, rounded down to whole records, to measure
+//    how writers contend for a file as their number grows. Default SIZE
+//    is 8 MiB, BLOCKSIZE (the record size, at least 32) is 64, and
+//    THREADS is 1, in which case the main thread writes and the process
+//    has no other threads. Each record names its thread and its number
+//    within that thread and ends in a newline, so sorting the output
+//    gives the same file however the threads' records interleaved. The
+//    profile record notes the thread count as "threads" and the mean
+//    time per record as "ns_per_record".
+
+static double now_ns() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+// write_records(f, thread, nrecords, record_size)
+//    Append records 0 through `nrecords - 1` of thread `thread` to `f`.
+//    Only the record number and fill letter change from one record to
+//    the next, so formatting costs little beside the write.
+
+static void write_records(io61_file* f, size_t thread, size_t nrecords,
+                          size_t record_size) {
+    char* buf = new char[record_size];
+    int n = snprintf(buf, record_size, "thread %03zu record %09zu ",
+                     thread, (size_t) 0);
+    buf[record_size - 1] = '\n';
+    for (size_t i = 0; i != nrecords; ++i) {
+        for (size_t x = i, d = n - 2; d != (size_t) n - 11; --d, x /= 10) {
+            buf[d] = '0' + x % 10;
+        }
+        memset(buf + n, 'a' + i % 26, record_size - n - 1);
+        if (io61_write(f, buf, record_size) != (ssize_t) record_size) {
+            fprintf(stderr, "logwrite61: write error\n");
+            exit(1);
+        }
+    }
+    delete[] buf;
+}
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_arguments args(argc, argv, "s:b:j:o:");
+    size_t size = args.input_size != (size_t) -1 ? args.input_size
+                                                  : 8 << 20;
+    size_t record_size = args.block_size ? args.block_size : 64;
+    if (record_size < 32) {
+        args.usage();
+        exit(1);
+    }
+    size_t nthreads = args.threads;
+    size_t nrecords = size / record_size;
+
+    io61_profile_begin();
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+
+    // Thread `t` writes every `nthreads`th record
+    double start = now_ns();
+    if (nthreads == 1) {
+        write_records(outf, 0, nrecords, record_size);
+    } else {
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t != nthreads; ++t) {
+            size_t n = nrecords / nthreads + (t < nrecords % nthreads);
+            threads.emplace_back(write_records, outf, t, n, record_size);
+        }
+        for (auto& th : threads) {
+            th.join();
+        }
+    }
+    io61_flush(outf);
+    double elapsed = now_ns() - start;
+
+    io61_close(outf);
+    io61_profile_note("threads", "%zu", nthreads);
+    io61_profile_note("ns_per_record", "%.1f",
+                      nrecords ? elapsed / nrecords : 0.0);
+    io61_profile_end();
+}
@@ -4,6 +4,17 @@
 #include <ctime>
 #include <csignal>
 #include <sys/wait.h>
+#include <algorithm>
+
+// Usage: ./pipeexchange61 [-p]
+//    Exchanges batches of requests and responses between two processes
+//    over a pair of pipes, and reports the round-trip latency of each
+//    message: the time from the request's io61_write to the end of its
+//    response, as percentiles on standard output and as "latency_us" in
+//    the profile record. With `-p`, the pipes are in stream mode
+//    (io61_stream): reads take partial messages as they arrive and
+//    writes are flushed by the library instead of by explicit
+//    io61_flush calls.
 
 struct message_set {
     int request_batch;
@@ -22,6 +33,34 @@ static const struct message_set messages[] = {
     { 20, 10000, 10000 }
 };
 
+// the message table runs this many times, so that the latency
+// percentiles rest on enough samples
+static const int nrounds = 10;
+
+static bool stream_mode = false;
+
+static double now_us() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+// read_message(f, buf, sz)
+//    Read a whole `sz`-byte message from `f`. In stream mode io61_read
+//    returns whatever has arrived, so this collects the pieces.
+
+static ssize_t read_message(io61_file* f, char* buf, size_t sz) {
+    size_t n = 0;
+    while (n < sz) {
+        ssize_t r = io61_read(f, buf + n, sz - n);
+        if (r <= 0) {
+            break;
+        }
+        n += r;
+    }
+    return n;
+}
+
 // Requester algorithm:
 //    for (i = 0; i < request_batch; ++i) {
 //        send request of size request_size;
@@ -63,30 +102,51 @@ void requester(io61_file* outf, io61_file* inf) {
     size_t requestid = 0;
     size_t responseid = 0;
     size_t id;
+    std::vector<double> sent, latency;
 
-    for (size_t mindex = 0; mindex < nmessages; ++mindex) {
-        const struct message_set* m = &messages[mindex];
-        printf("requester: phase %zd/%zd\n", mindex, nmessages);
-        for (int i = 0; i < m->request_batch; ++i) {
-            memcpy(buf, &requestid, sizeof(size_t));
-            ++requestid;
-            ssize_t r = io61_write(outf, buf, m->request_size);
-            assert((size_t) r == m->request_size);
-        }
-        int x = io61_flush(outf);
-        assert(x >= 0);
-        for (int i = 0; i < m->request_batch; ++i) {
-            ssize_t r = io61_read(inf, buf, m->response_size);
-            assert((size_t) r == m->response_size);
-            memcpy(&id, buf, sizeof(size_t));
-            assert(id == responseid);
-            ++responseid;
+    io61_profile_begin();
+    for (int round = 0; round < nrounds; ++round) {
+        printf("requester: round %d/%d\n", round, nrounds);
+        for (size_t mindex = 0; mindex < nmessages; ++mindex) {
+            const struct message_set* m = &messages[mindex];
+            for (int i = 0; i < m->request_batch; ++i) {
+                memcpy(buf, &requestid, sizeof(size_t));
+                ++requestid;
+                sent.push_back(now_us());
+                ssize_t r = io61_write(outf, buf, m->request_size);
+                assert((size_t) r == m->request_size);
+            }
+            if (!stream_mode) {
+                int x = io61_flush(outf);
+                assert(x >= 0);
+            }
+            for (int i = 0; i < m->request_batch; ++i) {
+                ssize_t r = read_message(inf, buf, m->response_size);
+                assert((size_t) r == m->response_size);
+                latency.push_back(now_us() - sent[responseid]);
+                memcpy(&id, buf, sizeof(size_t));
+                assert(id == responseid);
+                ++responseid;
+            }
         }
     }
 
+    std::sort(latency.begin(), latency.end());
+    auto pct = [&] (double p) {
+        return latency[std::min(latency.size() - 1,
+                                size_t(p * latency.size()))];
+    };
+    printf("requester: %zu round trips, latency p50 %.1fus p90 %.1fus "
+           "p99 %.1fus max %.1fus\n", latency.size(), pct(0.5), pct(0.9),
+           pct(0.99), latency.back());
+    io61_profile_note("latency_us",
+                      "{\"p50\":%.1f, \"p90\":%.1f, \"p99\":%.1f, "
+                      "\"max\":%.1f}",
+                      pct(0.5), pct(0.9), pct(0.99), latency.back());
     printf("requester: done!\n");
     io61_close(inf);
     io61_close(outf);
+    io61_profile_end();
     delete[] buf;
     exit(0);
 }
@@ -97,15 +157,19 @@ void responder(io61_file* outf, io61_file* inf) {
     char* buf = new char[maxsz];
     memset(buf, 0, maxsz);
 
-    for (size_t mindex = 0; mindex < nmessages; ++mindex) {
-        const struct message_set* m = &messages[mindex];
-        for (int i = 0; i < m->request_batch; ++i) {
-            ssize_t r = io61_read(inf, buf, m->request_size);
-            assert((size_t) r == m->request_size);
-            r = io61_write(outf, buf, m->response_size);
-            assert((size_t) r == m->response_size);
-            int x = io61_flush(outf);
-            assert(x >= 0);
+    for (int round = 0; round < nrounds; ++round) {
+        for (size_t mindex = 0; mindex < nmessages; ++mindex) {
+            const struct message_set* m = &messages[mindex];
+            for (int i = 0; i < m->request_batch; ++i) {
+                ssize_t r = read_message(inf, buf, m->request_size);
+                assert((size_t) r == m->request_size);
+                r = io61_write(outf, buf, m->response_size);
+                assert((size_t) r == m->response_size);
+                if (!stream_mode) {
+                    int x = io61_flush(outf);
+                    assert(x >= 0);
+                }
+            }
         }
     }
 
@@ -115,8 +179,22 @@ void responder(io61_file* outf, io61_file* inf) {
     exit(0);
 }
 
+// open_stream(fd, mode)
+//    Open one end of a pipe, in stream mode if `-p` was given. Stream
+//    writers also flush on their own once a response is 1ms old.
+
+static io61_file* open_stream(int fd, int mode) {
+    io61_file* f = io61_fdopen(fd, mode);
+    if (stream_mode) {
+        int r = io61_stream(f, -1, 0, 1000);
+        assert(r == 0);
+    }
+    return f;
+}
+
 int main(int argc, char* argv[]) {
-    (void) argc, (void) argv;
+    io61_arguments args(argc, argv, "p");
+    stream_mode = args.stream;
 
     // create a connected socket pair for communicating between processes
     int request_fds[2], response_fds[2];
@@ -125,14 +203,18 @@ int main(int argc, char* argv[]) {
         perror("pipe");
         exit(1);
     }
+    // a batch of 20 10000-byte requests is sent before any response is
+    // read, so the pipes must hold a whole batch or both sides block
+    fcntl(request_fds[1], F_SETPIPE_SZ, 1 << 20);
+    fcntl(response_fds[1], F_SETPIPE_SZ, 1 << 20);
 
     // fork two children
     pid_t p1 = fork();
     if (p1 == 0) {
         close(request_fds[0]);
         close(response_fds[1]);
-        requester(io61_fdopen(request_fds[1], O_WRONLY),
-                  io61_fdopen(response_fds[0], O_RDONLY));
+        requester(open_stream(request_fds[1], O_WRONLY),
+                  open_stream(response_fds[0], O_RDONLY));
     } else if (p1 < 0) {
         perror("fork");
         exit(1);
@@ -142,15 +224,15 @@ int main(int argc, char* argv[]) {
     if (p2 == 0) {
         close(request_fds[1]);
         close(response_fds[0]);
-        responder(io61_fdopen(response_fds[1], O_WRONLY),
-                  io61_fdopen(request_fds[0], O_RDONLY));
+        responder(open_stream(response_fds[1], O_WRONLY),
+                  open_stream(request_fds[0], O_RDONLY));
     } else if (p2 < 0) {
         perror("fork");
         exit(1);
     }
 
     time_t start_time = time(0);
-    while ((p1 > 0 || p2 > 0) && time(0) < start_time + 5) {
+    while ((p1 > 0 || p2 > 0) && time(0) < start_time + 30) {
         int status;
         if (p1 > 0 && waitpid(p1, &status, WNOHANG) == p1) {
             printf("requester exits with status %d\n",
@@ -162,6 +244,8 @@ int main(int argc, char* argv[]) {
                    WIFEXITED(status) ? WEXITSTATUS(status) : -1);
             p2 = -1;            /* child2 has died */
         }
+        // poll gently, so as not to take a CPU from the children
+        usleep(1000);
     }
 
     if (p1 > 0) {
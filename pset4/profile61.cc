@@ -1,16 +1,114 @@
 #include "io61.hh"
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <algorithm>
 #include <cerrno>
+#include <cstdarg>
+#include <mutex>
+#include <string>
+#include <vector>
+#if __x86_64__
+#include <nmmintrin.h>
+#endif
 
 // profile61.c
 //    The profile functions measure how much time and memory are used
 //    by your code. The io61_profile_end() function prints a simple
 //    report to standard error. The io61_parse_arguments() function
-//    parses common arguments into a structure.
+//    parses common arguments into a structure. The io61_crc32c()
+//    function checksums bytes for io61 implementations. io61_memload()
+//    and io61_memsave() move files in and out of memory for `-m`.
 
 static struct timeval tv_begin;
 
+// notes added by io61 implementations, printed by io61_profile_end()
+static std::vector<std::pair<std::string, std::string>> profile_notes;
+static std::mutex profile_lock;     // files may be closed by any thread
+
+
+// io61_profile_note(key, fmt, ...)
+//    Add a JSON value, formatted printf-style, to the report under `key`.
+//    Each key is printed as an array of all values noted for it, in order.
+
+void io61_profile_note(const char* key, const char* fmt, ...) {
+    va_list val;
+    va_start(val, fmt);
+    int len = vsnprintf(nullptr, 0, fmt, val);
+    va_end(val);
+    std::string buf(len, '\0');
+    va_start(val, fmt);
+    vsnprintf(&buf[0], len + 1, fmt, val);
+    va_end(val);
+
+    std::lock_guard<std::mutex> guard(profile_lock);
+    for (auto& n : profile_notes) {
+        if (n.first == key) {
+            n.second += ",";
+            n.second += buf;
+            return;
+        }
+    }
+    profile_notes.emplace_back(key, buf);
+}
+
+// io61_crc32c(crc, buf, sz)
+//    Return the CRC32C (Castagnoli) checksum of `crc`'s bytes followed by
+//    the `sz` bytes at `buf`, where `crc` is the checksum of the bytes
+//    before (0 for none). Uses the SSE4.2 `crc32` instruction when the
+//    CPU has it, and a byte table otherwise.
+
+static uint32_t crc32c_table(uint32_t crc, const unsigned char* p,
+                             size_t sz) {
+    static const auto table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i != 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k != 8; ++k) {
+                c = (c >> 1) ^ (c & 1 ? 0x82F63B78 : 0);
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    for (; sz != 0; --sz, ++p) {
+        crc = table[(crc ^ *p) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if __x86_64__
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char* p,
+                             size_t sz) {
+    for (; sz != 0 && (uintptr_t(p) & 7) != 0; --sz, ++p) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    uint64_t c = crc;
+    for (; sz >= 8; sz -= 8, p += 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    crc = c;
+    for (; sz != 0; --sz, ++p) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+uint32_t io61_crc32c(uint32_t crc, const void* buf, size_t sz) {
+    auto p = reinterpret_cast<const unsigned char*>(buf);
+#if __x86_64__
+    static const bool sse42 = __builtin_cpu_supports("sse4.2");
+    if (sse42) {
+        return ~crc32c_sse42(~crc, p, sz);
+    }
+#endif
+    return ~crc32c_table(~crc, p, sz);
+}
+
 void io61_profile_begin() {
     int r = gettimeofday(&tv_begin, 0);
     assert(r >= 0);
@@ -32,11 +130,16 @@ void io61_profile_end() {
     timeradd(&usage.ru_stime, &cusage.ru_stime, &usage.ru_stime);
 
     char buf[1000];
-    int len = sprintf(buf, "{\"time\":%ld.%06ld, \"utime\":%ld.%06ld, \"stime\":%ld.%06ld, \"maxrss\":%ld}\n",
-                      tv_end.tv_sec, (long) tv_end.tv_usec,
-                      usage.ru_utime.tv_sec, (long) usage.ru_utime.tv_usec,
-                      usage.ru_stime.tv_sec, (long) usage.ru_stime.tv_usec,
-                      usage.ru_maxrss + cusage.ru_maxrss);
+    sprintf(buf, "{\"time\":%ld.%06ld, \"utime\":%ld.%06ld, \"stime\":%ld.%06ld, \"maxrss\":%ld",
+            tv_end.tv_sec, (long) tv_end.tv_usec,
+            usage.ru_utime.tv_sec, (long) usage.ru_utime.tv_usec,
+            usage.ru_stime.tv_sec, (long) usage.ru_stime.tv_usec,
+            usage.ru_maxrss + cusage.ru_maxrss);
+    std::string report = buf;
+    for (auto& n : profile_notes) {
+        report += ", \"" + n.first + "\":[" + n.second + "]";
+    }
+    report += "}\n";
 
     // Print the report to file descriptor 100 if it's available. Our
     // `check.pl` test harness uses this file descriptor.
@@ -45,8 +148,80 @@ void io61_profile_end() {
     if (fd == STDERR_FILENO) {
         fflush(stderr);
     }
-    ssize_t nwritten = write(fd, buf, len);
-    assert(nwritten == len);
+    ssize_t nwritten = write(fd, report.data(), report.size());
+    assert(nwritten == (ssize_t) report.size());
+}
+
+
+// io61_memload(filenames)
+//    Read the named files (or standard input, if there are none) into
+//    memory with plain system calls, and return a read-only
+//    io61_memopen file of their contents. Exits on error.
+
+io61_file* io61_memload(const std::vector<const char*>& filenames) {
+    std::string data;
+    size_t nfiles = std::max(filenames.size(), size_t(1));
+    for (size_t i = 0; i != nfiles; ++i) {
+        const char* fn = filenames.empty() ? nullptr : filenames[i];
+        int fd = fn ? open(fn, O_RDONLY) : STDIN_FILENO;
+        if (fd < 0) {
+            fprintf(stderr, "%s: %s\n", fn, strerror(errno));
+            exit(1);
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            data.reserve(data.size() + st.st_size);
+        }
+        char buf[65536];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) != 0) {
+            if (n > 0) {
+                data.append(buf, n);
+            } else if (errno != EINTR) {
+                fprintf(stderr, "%s: %s\n", fn ? fn : "<stdin>",
+                        strerror(errno));
+                exit(1);
+            }
+        }
+        if (fn) {
+            close(fd);
+        }
+    }
+    io61_file* f = io61_memopen(data.data(), data.size(), O_RDONLY);
+    assert(f);
+    return f;
+}
+
+
+// io61_memsave(f, filename)
+//    Write the contents of memory file `f` to `filename` (or standard
+//    output, if `filename` is null) with plain system calls, then close
+//    `f`. Returns 0 on success and -1 on error.
+
+int io61_memsave(io61_file* f, const char* filename) {
+    size_t sz = 0;
+    const char* data = io61_memdata(f, &sz);
+    int fd = filename ? open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)
+        : STDOUT_FILENO;
+    int r = data && fd >= 0 ? 0 : -1;
+    while (r == 0 && sz != 0) {
+        ssize_t n = write(fd, data, sz);
+        if (n > 0) {
+            data += n;
+            sz -= n;
+        } else if (n < 0 && errno != EINTR) {
+            r = -1;
+        }
+    }
+    if (r < 0) {
+        fprintf(stderr, "%s: %s\n", filename ? filename : "<stdout>",
+                strerror(errno));
+    }
+    if (filename && fd >= 0) {
+        close(fd);
+    }
+    io61_close(f);
+    return r;
 }
 
 
@@ -55,6 +230,12 @@ io61_arguments::io61_arguments(int argc, char** argv, const char* opts_) {
     block_size = 0;
     stride = 1024;
     lines = false;
+    copy = false;
+    verify = false;
+    memory = false;
+    stream = false;
+    flush = false;
+    threads = 1;
     output_file = input_file = nullptr;
     opts = opts_;
     program_name = argv[0];
@@ -81,9 +262,30 @@ io61_arguments::io61_arguments(int argc, char** argv, const char* opts_) {
                 goto usage;
             }
             break;
+        case 'j':
+            threads = (size_t) strtoul(optarg, &endptr, 0);
+            if (threads == 0 || endptr == optarg || *endptr) {
+                goto usage;
+            }
+            break;
         case 'l':
             lines = true;
             break;
+        case 'k':
+            copy = true;
+            break;
+        case 'c':
+            verify = true;
+            break;
+        case 'm':
+            memory = true;
+            break;
+        case 'p':
+            stream = true;
+            break;
+        case 'f':
+            flush = true;
+            break;
         case 'r': {
             unsigned long seed = strtoul(optarg, &endptr, 0);
             if (endptr == optarg || *endptr) {
@@ -139,9 +341,27 @@ void io61_arguments::usage() {
     if (strchr(opts, 't')) {
         fprintf(stderr, " [-t STRIDE]");
     }
+    if (strchr(opts, 'j')) {
+        fprintf(stderr, " [-j THREADS]");
+    }
     if (strchr(opts, 'l')) {
         fprintf(stderr, " [-l]");
     }
+    if (strchr(opts, 'k')) {
+        fprintf(stderr, " [-k]");
+    }
+    if (strchr(opts, 'c')) {
+        fprintf(stderr, " [-c]");
+    }
+    if (strchr(opts, 'm')) {
+        fprintf(stderr, " [-m]");
+    }
+    if (strchr(opts, 'p')) {
+        fprintf(stderr, " [-p]");
+    }
+    if (strchr(opts, 'f')) {
+        fprintf(stderr, " [-f]");
+    }
     if (strchr(opts, 'o')) {
         fprintf(stderr, " [-o OUTFILE]");
     }
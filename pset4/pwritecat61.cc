@@ -0,0 +1,63 @@
+#include "io61.hh"
+#include <vector>
+
+// Usage: ./pwritecat61 [-b MAXBLOCKSIZE] [-r RANDOMSEED] [-o OUTFILE] [FILE]
+//    Copies the input FILE to OUTFILE with io61_pread and io61_pwrite.
+//    The file is cut into pieces of random size between 0 and
+//    MAXBLOCKSIZE (which defaults to 4096), and the pieces are copied in
+//    random order. OUTFILE is flushed after every 64 pieces, so empty
+//    pieces make zero-length writes that reach the disk before their
+//    neighbors do. The resulting output file should be the same as the
+//    input.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    srandom(83419);
+    io61_arguments args(argc, argv, "b:r:o:i:");
+    size_t max_blocksize = args.block_size ? args.block_size : 4096;
+
+    // Allocate buffer, open files, measure file size
+    char* buf = new char[max_blocksize];
+
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    off_t size = io61_filesize(inf);
+    if (size < 0) {
+        fprintf(stderr, "pwritecat61: can't get size of input file\n");
+        exit(1);
+    }
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+    if (io61_seek(outf, 0) < 0) {
+        fprintf(stderr, "pwritecat61: output file is not seekable\n");
+        exit(1);
+    }
+
+    // Cut the file into pieces, then shuffle them
+    std::vector<std::pair<off_t, size_t>> pieces;
+    for (off_t off = 0; off < size; ) {
+        size_t m = random() % (max_blocksize + 1);
+        m = std::min(m, (size_t) (size - off));
+        pieces.emplace_back(off, m);
+        off += m;
+    }
+    for (size_t i = pieces.size(); i > 1; --i) {
+        std::swap(pieces[i - 1], pieces[random() % i]);
+    }
+
+    // Copy file data
+    for (size_t i = 0; i != pieces.size(); ++i) {
+        auto& p = pieces[i];
+        ssize_t amount = io61_pread(inf, buf, p.second, p.first);
+        if (amount < 0 || io61_pwrite(outf, buf, amount, p.first) != amount
+            || (i % 64 == 63 && io61_flush(outf) < 0)) {
+            fprintf(stderr, "pwritecat61: copy error\n");
+            exit(1);
+        }
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    io61_profile_end();
+    delete[] buf;
+}
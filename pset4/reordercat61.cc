@@ -46,6 +46,8 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "reordercat61: input file size not a multiple of block size\n");
         exit(1);
     }
+    // the output ends up as large as the input
+    io61_size_hint(outf, args.input_size);
 
     size_t* blockpos = new size_t[nblocks];
     for (size_t i = 0; i < nblocks; ++i) {
@@ -0,0 +1,72 @@
+#include "io61.hh"
+#include <ctime>
+
+// Usage: ./rmw61 [-s SIZE] [-b BLOCKSIZE] [-r RANDOMSEED] FILE
+//    Updates FILE in place through one read/write io61_file: reads
+//    BLOCKSIZE bytes (default 64) at a random offset, shifts each
+//    lowercase letter among them to the next letter, and writes them
+//    back where they came from, until SIZE bytes (default the size of
+//    FILE) have been updated. Blocks overlap, so later updates read the
+//    bytes of earlier ones that may not have been written to FILE yet.
+//    The profile record notes the mean time per update as
+//    "ns_per_update".
+
+static double now_ns() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    srandom(83419);
+    io61_arguments args(argc, argv, "s:b:r:");
+    if (!args.input_file) {
+        args.usage();
+        exit(1);
+    }
+    size_t blocksize = args.block_size ? args.block_size : 64;
+
+    // Allocate buffer, open file
+    char* buf = new char[blocksize];
+
+    io61_profile_begin();
+    io61_file* f = io61_open_check(args.input_file, O_RDWR);
+    off_t filesize = io61_filesize(f);
+    if (filesize < (off_t) blocksize) {
+        fprintf(stderr, "%s: smaller than a block\n", args.input_file);
+        exit(1);
+    }
+    size_t size = args.input_size != (size_t) -1 ? args.input_size
+                                                  : filesize;
+    size_t nupdates = size / blocksize;
+
+    // Update random blocks
+    double start = now_ns();
+    for (size_t i = 0; i != nupdates; ++i) {
+        off_t off = random() % (filesize - blocksize + 1);
+        if (io61_seek(f, off) < 0
+            || io61_read(f, buf, blocksize) != (ssize_t) blocksize) {
+            fprintf(stderr, "rmw61: read error\n");
+            exit(1);
+        }
+        for (size_t j = 0; j != blocksize; ++j) {
+            if (buf[j] >= 'a' && buf[j] <= 'z') {
+                buf[j] = buf[j] == 'z' ? 'a' : buf[j] + 1;
+            }
+        }
+        if (io61_seek(f, off) < 0
+            || io61_write(f, buf, blocksize) != (ssize_t) blocksize) {
+            fprintf(stderr, "rmw61: write error\n");
+            exit(1);
+        }
+    }
+    io61_flush(f);
+    double elapsed = now_ns() - start;
+
+    io61_close(f);
+    io61_profile_note("ns_per_update", "%.1f",
+                      nupdates ? elapsed / nupdates : 0.0);
+    io61_profile_end();
+    delete[] buf;
+}
@@ -1,27 +1,45 @@
 #include "io61.hh"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
 #include <climits>
+#include <mutex>
 #include <cerrno>
+#include <string>
 
 // slow-io61.c
 //    This is a copy of the handout version of io61.c.
 
 
 // io61_file
-//    Data structure for io61 file wrappers.
+//    Data structure for io61 file wrappers. The io61_fastpath base stays
+//    empty, so every byte goes through io61_readc_slow and io61_writec_slow.
 
-struct io61_file {
+struct io61_file : io61_fastpath {
     int fd;
+    std::string line;           // buffer for io61_readline
+    std::vector<std::string> inputs;    // io61_open_concat files
+    size_t next_input = 0;
+    bool crc_on = false;        // whether to checksum transferred bytes
+    uint32_t crc = 0;           // running CRC32C, if `crc_on`
+    void* map = nullptr;        // io61_memdata mapping
+    size_t map_size = 0;
+    bool stream = false;        // io61_stream mode
+    int stream_timeout = -1;
+    std::recursive_mutex lock;  // keeps each call's bytes together
 };
+IO61_CHECK_FASTPATH(io61_file);
 
 
 // io61_fdopen(fd, mode)
 //    Return a new io61_file for file descriptor `fd`. `mode` is
-//    either O_RDONLY for a read-only file or O_WRONLY for a
-//    write-only file. You need not support read/write files.
+//    O_RDONLY for a read-only file, O_WRONLY for a write-only file, or
+//    O_RDWR for a read/write file. `backend` is ignored; this file is a
+//    backend of its own.
 
-io61_file* io61_fdopen(int fd, int mode) {
+io61_file* io61_fdopen(int fd, int mode, const char* backend) {
+    (void) backend;
     assert(fd >= 0);
     io61_file* f = new io61_file;
     f->fd = fd;
@@ -35,23 +53,70 @@ io61_file* io61_fdopen(int fd, int mode) {
 
 int io61_close(io61_file* f) {
     io61_flush(f);
-    int r = close(f->fd);
+    int r = f->fd >= 0 ? close(f->fd) : 0;
+    if (f->map) {
+        munmap(f->map, f->map_size);
+    }
     delete f;
     return r;
 }
 
 
-// io61_readc(f)
+// io61_lock(f), io61_unlock(f)
+//    Take or release the lock of `f`, which io61_readc, io61_writec,
+//    io61_read, and io61_write hold while they work.
+
+void io61_lock(io61_file* f) {
+    f->lock.lock();
+}
+
+void io61_unlock(io61_file* f) {
+    f->lock.unlock();
+}
+
+
+// io61_next_input(f)
+//    Move a stream from io61_open_concat on to its next file, skipping
+//    files that cannot be opened. Returns false if no files remain.
+
+static bool io61_next_input(io61_file* f) {
+    while (f->next_input < f->inputs.size()) {
+        if (f->fd >= 0) {
+            close(f->fd);
+        }
+        const char* name = f->inputs[f->next_input++].c_str();
+        f->fd = open(name, O_RDONLY);
+        if (f->fd >= 0) {
+            return true;
+        }
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    }
+    return false;
+}
+
+
+// io61_readc_slow(f)
 //    Read a single (unsigned) character from `f` and return it. Returns EOF
 //    (which is -1) on error or end-of-file.
 
-int io61_readc(io61_file* f) {
+int io61_readc_slow(io61_file* f) {
     unsigned char buf[1];
-    if (read(f->fd, buf, 1) == 1) {
-        return buf[0];
-    } else {
+    pollfd p = { f->fd, POLLIN, 0 };
+    if (f->stream && poll(&p, 1, f->stream_timeout) == 0) {
+        errno = EAGAIN;
         return EOF;
     }
+    while (true) {
+        ssize_t n = f->fd >= 0 ? read(f->fd, buf, 1) : 0;
+        if (n == 1) {
+            if (f->crc_on) {
+                f->crc = io61_crc32c(f->crc, buf, 1);
+            }
+            return buf[0];
+        } else if (n < 0 || !io61_next_input(f)) {
+            return EOF;
+        }
+    }
 }
 
 
@@ -63,10 +128,19 @@ int io61_readc(io61_file* f) {
 //    were read.
 
 ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
+    std::lock_guard<std::recursive_mutex> guard(f->lock);
     size_t nread = 0;
+    pollfd p = { f->fd, POLLIN, 0 };
     while (nread != sz) {
+        // a stream returns once nothing more is ready
+        if (f->stream && nread != 0 && poll(&p, 1, 0) == 0) {
+            break;
+        }
+        errno = 0;
         int ch = io61_readc(f);
-        if (ch == EOF) {
+        if (ch == EOF && f->stream && nread == 0 && errno == EAGAIN) {
+            return -1;
+        } else if (ch == EOF) {
             break;
         }
         buf[nread] = ch;
@@ -81,14 +155,17 @@ ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
 }
 
 
-// io61_writec(f)
+// io61_writec_slow(f)
 //    Write a single character `ch` to `f`. Returns 0 on success or
 //    -1 on error.
 
-int io61_writec(io61_file* f, int ch) {
+int io61_writec_slow(io61_file* f, int ch) {
     unsigned char buf[1];
     buf[0] = ch;
     if (write(f->fd, buf, 1) == 1) {
+        if (f->crc_on) {
+            f->crc = io61_crc32c(f->crc, buf, 1);
+        }
         return 0;
     } else {
         return -1;
@@ -102,6 +179,7 @@ int io61_writec(io61_file* f, int ch) {
 //    an error occurred before any characters were written.
 
 ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
+    std::lock_guard<std::recursive_mutex> guard(f->lock);
     size_t nwritten = 0;
     while (nwritten != sz) {
         if (io61_writec(f, buf[nwritten]) == -1) {
@@ -128,6 +206,90 @@ int io61_flush(io61_file* f) {
 }
 
 
+// io61_copy(in, out, n)
+//    Copy up to `n` characters from `in` to `out`. Returns the number of
+//    characters copied, or -1 if an error occurred before any were copied.
+
+ssize_t io61_copy(io61_file* in, io61_file* out, size_t n) {
+    size_t ncopied = 0;
+    while (ncopied != n) {
+        int ch = io61_readc(in);
+        if (ch == EOF || io61_writec(out, ch) == -1) {
+            break;
+        }
+        ++ncopied;
+    }
+    return ncopied;
+}
+
+
+// io61_readline(f, line)
+//    Read the next line from `f`, including its newline if any, and set
+//    `*line` to point at it. Returns the line's length, or 0 at end of
+//    file. `*line` is valid until the next call on `f`.
+
+ssize_t io61_readline(io61_file* f, const char** line) {
+    f->line.clear();
+    int ch;
+    while ((ch = io61_readc(f)) != EOF) {
+        f->line.push_back(ch);
+        if (ch == '\n') {
+            break;
+        }
+    }
+    *line = f->line.data();
+    return f->line.size();
+}
+
+
+// io61_readv(f, iov, iovcnt), io61_writev(f, iov, iovcnt)
+//    Read or write the `iovcnt` buffers of `iov` in order. Return the
+//    number of characters transferred, or -1 if an error occurred before
+//    any were.
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nread = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        ssize_t n = io61_read(f, (char*) iov[i].iov_base, iov[i].iov_len);
+        if (n <= 0) {
+            break;
+        }
+        nread += n;
+        if ((size_t) n != iov[i].iov_len) {
+            break;
+        }
+    }
+    return nread;
+}
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nwritten = 0;
+    for (int i = 0; i != iovcnt; ++i) {
+        ssize_t n = io61_write(f, (const char*) iov[i].iov_base,
+                               iov[i].iov_len);
+        if (n < 0) {
+            return nwritten ? (ssize_t) nwritten : -1;
+        }
+        nwritten += n;
+    }
+    return nwritten;
+}
+
+
+// io61_pread(f, buf, sz, off), io61_pwrite(f, buf, sz, off)
+//    Read or write `sz` characters at offset `off` without changing the
+//    file pointer. Return the number of characters transferred, or -1 on
+//    error.
+
+ssize_t io61_pread(io61_file* f, char* buf, size_t sz, off_t off) {
+    return pread(f->fd, buf, sz, off);
+}
+
+ssize_t io61_pwrite(io61_file* f, const char* buf, size_t sz, off_t off) {
+    return pwrite(f->fd, buf, sz, off);
+}
+
+
 // io61_seek(f, pos)
 //    Change the file pointer for file `f` to `pos` bytes into the file.
 //    Returns 0 on success and -1 on failure.
@@ -142,6 +304,136 @@ int io61_seek(io61_file* f, off_t pos) {
 }
 
 
+// io61_checksum_start(f), io61_checksum(f)
+//    Start a running CRC32C checksum of the bytes read from or written to
+//    `f` from now on, or return the checksum so far (0 if none was
+//    started). Positional I/O is not included.
+
+void io61_checksum_start(io61_file* f) {
+    f->crc_on = true;
+    f->crc = 0;
+}
+
+uint32_t io61_checksum(io61_file* f) {
+    return f->crc;
+}
+
+
+// io61_open_concat(filenames, ahead)
+//    Return a read-only io61_file that reads the named files one after
+//    another. `ahead` is ignored; each file is opened when it is reached.
+
+io61_file* io61_open_concat(const std::vector<const char*>& filenames,
+                            int ahead) {
+    (void) ahead;
+    if (filenames.size() < 2) {
+        return io61_open_check(filenames.empty() ? nullptr : filenames[0],
+                               O_RDONLY);
+    }
+    io61_file* f = new io61_file;
+    f->fd = -1;
+    for (const char* fn : filenames) {
+        f->inputs.push_back(fn);
+    }
+    return f;
+}
+
+
+// io61_memopen(data, sz, mode, memfd)
+//    Return a new io61_file whose contents live in memory, starting as
+//    a copy of the `sz` bytes at `data`. This version always uses a
+//    memfd, so every access is still a system call.
+
+io61_file* io61_memopen(const char* data, size_t sz, int mode, bool memfd) {
+    (void) memfd;
+    int fd = memfd_create("io61", 0);
+    if (fd < 0) {
+        return nullptr;
+    }
+    if (write(fd, data, sz) != (ssize_t) sz || lseek(fd, 0, SEEK_SET) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    return io61_fdopen(fd, mode & O_ACCMODE);
+}
+
+
+// io61_memdata(f, sz)
+//    Return the contents of memory file `f`, setting `*sz` to their
+//    size. They are mapped until the next call or io61_close.
+
+const char* io61_memdata(io61_file* f, size_t* sz) {
+    struct stat st;
+    if (f->map) {
+        munmap(f->map, f->map_size);
+        f->map = nullptr;
+    }
+    if (f->fd < 0 || fstat(f->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return nullptr;
+    }
+    f->map_size = st.st_size;
+    if (st.st_size != 0) {
+        f->map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, f->fd, 0);
+        if (f->map == MAP_FAILED) {
+            f->map = nullptr;
+            return nullptr;
+        }
+    }
+    *sz = f->map_size;
+    return f->map ? (const char*) f->map : "";
+}
+
+
+// io61_fileno(f)
+//    Return the file descriptor of `f`, or -1 if it has none.
+
+int io61_fileno(io61_file* f) {
+    return f->fd;
+}
+
+
+// io61_stream(f, timeout_ms, flush_size, flush_us)
+//    Put `f`, a pipe or socket, in stream mode: reads return what is
+//    available, waiting at most `timeout_ms` for the first byte. Writes
+//    are not buffered, so the flush settings are ignored.
+
+int io61_stream(io61_file* f, int timeout_ms, size_t flush_size,
+                long flush_us) {
+    (void) flush_size, (void) flush_us;
+    if (f->fd < 0 || lseek(f->fd, 0, SEEK_CUR) >= 0) {
+        errno = ESPIPE;
+        return -1;
+    }
+    f->stream = true;
+    f->stream_timeout = timeout_ms;
+    return 0;
+}
+
+
+// io61_setvbuf(f, size)
+//    This implementation has no buffer to size, so does nothing.
+
+int io61_setvbuf(io61_file* f, size_t size) {
+    (void) f, (void) size;
+    return 0;
+}
+
+
+// io61_size_hint(f, size)
+//    Every write here is its own system call anyway, so this only checks
+//    its arguments. Returns 0, or -1 with errno EINVAL if `size` is
+//    negative.
+
+int io61_size_hint(io61_file* f, off_t size) {
+    (void) f;
+    if (size < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+
 // You shouldn't need to change these functions.
 
 // io61_open_check(filename, mode)
@@ -173,7 +465,7 @@ io61_file* io61_open_check(const char* filename, int mode) {
 
 off_t io61_filesize(io61_file* f) {
     struct stat s;
-    int r = fstat(f->fd, &s);
+    int r = f->inputs.empty() ? fstat(f->fd, &s) : -1;
     if (r >= 0 && S_ISREG(s.st_mode)) {
         return s.st_size;
     } else {
@@ -1,30 +1,191 @@
 #include "io61.hh"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <stdio_ext.h>
+#include <time.h>
 #include <climits>
+#include <algorithm>
 #include <cerrno>
+#include <string>
 
 // stdio-io61.c
 //    This version of io61.c is a simple wrapper on stdio. Can you beat it?
 
 
 // io61_file
-//    Data structure for io61 file wrappers.
+//    Data structure for io61 file wrappers. The io61_fastpath base stays
+//    empty, so every byte goes through io61_readc_slow and io61_writec_slow.
 
-struct io61_file {
+struct io61_file : io61_fastpath {
     FILE* f;
+    char* line = nullptr;       // buffer for io61_readline
+    size_t linecap = 0;
+    char* vbuf = nullptr;       // buffer given by io61_setvbuf
+    bool crc_on = false;        // whether to checksum transferred bytes
+    uint32_t crc = 0;           // running CRC32C, if `crc_on`
+    bool memory = false;        // io61_memopen file on a stdio memory stream
+    bool writing = false;       // opened for writing
+    bool rdwr = false;          // opened for reading and writing
+    char last = 0;              // `rdwr`: last transfer, 'r' or 'w'
+    char* mem = nullptr;        // the stream's memory
+    size_t mem_size = 0;        // its size, or its position for writers
+    size_t mem_high = 0;        // writers: the size before the last seek
+    void* map = nullptr;        // io61_memdata mapping of a memfd
+    size_t map_size = 0;
+    bool stream = false;        // io61_stream mode
+    int stream_timeout = -1;
+    size_t flush_size = 0;
+    long long flush_ns = -1;
+    long long pending_ns = 0;   // when the oldest buffered byte was written
 };
+IO61_CHECK_FASTPATH(io61_file);
+
+
+// io61_crc_add(f, buf, n)
+//    Add `n` transferred bytes at `buf` to the running checksum of `f`.
+
+static void io61_crc_add(io61_file* f, const void* buf, size_t n) {
+    if (f->crc_on && n != 0) {
+        f->crc = io61_crc32c(f->crc, buf, n);
+    }
+}
+
+
+// io61_turn(f, dir)
+//    Prepare read/write file `f` for a transfer in direction `dir`, 'r'
+//    or 'w'. C requires a seek between output and input, and between
+//    input and output; a seek to the current position serves.
+
+static void io61_turn(io61_file* f, char dir) {
+    if (f->rdwr && f->last != dir) {
+        if (f->last) {
+            fseeko(f->f, 0, SEEK_CUR);
+        }
+        f->last = dir;
+    }
+}
+
+
+// io61_stream_ready(f), io61_stream_take(f, buf, sz)
+//    Return whether `f` has bytes to read without blocking, and read into
+//    `buf` up to `sz` of the bytes it has. glibc's FILE shows how many
+//    bytes it buffers. Elsewhere, these read with the descriptor made
+//    nonblocking, and a byte that io61_stream_ready peeks is pushed back.
+
+#ifdef __GLIBC__
+static bool io61_stream_ready(io61_file* f) {
+    return f->f->_IO_read_ptr != f->f->_IO_read_end;
+}
+
+static size_t io61_stream_take(io61_file* f, char* buf, size_t sz) {
+    size_t avail = f->f->_IO_read_end - f->f->_IO_read_ptr;
+    return fread(buf, 1, std::min(sz, avail), f->f);
+}
+#else
+// run `fn` on `f`'s FILE with its descriptor nonblocking, and forget the
+// error of a read that would have blocked
+template <typename F>
+static auto io61_nonblocking(io61_file* f, F fn) {
+    int fd = fileno(f->f);
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    auto r = fn();
+    int err = errno;
+    fcntl(fd, F_SETFL, flags);
+    if (ferror(f->f) && (err == EAGAIN || err == EWOULDBLOCK)) {
+        clearerr(f->f);
+    }
+    return r;
+}
+
+static bool io61_stream_ready(io61_file* f) {
+    int ch = io61_nonblocking(f, [&] { return fgetc(f->f); });
+    return ch != EOF && ungetc(ch, f->f) != EOF;
+}
+
+static size_t io61_stream_take(io61_file* f, char* buf, size_t sz) {
+    return io61_nonblocking(f, [&] { return fread(buf, 1, sz, f->f); });
+}
+#endif
+
+
+// io61_stream_wait(f), io61_stream_check(f)
+//    Stream mode (see io61_stream): wait for a reader to have bytes,
+//    flushing stream-mode writers if it would block, and flush a writer
+//    that has buffered enough bytes or held them long enough.
+
+static std::vector<io61_file*> stream_writers;
+
+static long long io61_now_ns() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static bool io61_stream_wait(io61_file* f) {
+    if (io61_stream_ready(f)) {
+        return true;
+    }
+    bool pending = false;
+    for (io61_file* w : stream_writers) {
+        pending = pending || __fpending(w->f) != 0;
+    }
+    if (!pending && f->stream_timeout < 0) {
+        return true;
+    }
+    pollfd p = { fileno(f->f), POLLIN, 0 };
+    if (pending) {
+        if (poll(&p, 1, 0) > 0) {
+            return true;
+        }
+        for (io61_file* w : stream_writers) {
+            fflush(w->f);
+        }
+    }
+    int r;
+    while ((r = poll(&p, 1, f->stream_timeout)) < 0 && errno == EINTR) {
+    }
+    if (r == 0) {
+        errno = EAGAIN;
+        return false;
+    }
+    return true;
+}
+
+static void io61_stream_check(io61_file* f) {
+    size_t buffered = __fpending(f->f);
+    if (buffered == 0) {
+        f->pending_ns = 0;
+        return;
+    }
+    long long now = io61_now_ns();
+    if (f->pending_ns == 0) {
+        f->pending_ns = now;
+    }
+    if ((f->flush_size && buffered >= f->flush_size)
+        || (f->flush_ns >= 0 && now - f->pending_ns >= f->flush_ns)) {
+        fflush(f->f);
+        f->pending_ns = 0;
+    }
+}
 
 
 // io61_fdopen(fd, mode)
 //    Return a new io61_file for file descriptor `fd`. `mode` is
-//    either O_RDONLY for a read-only file or O_WRONLY for a
-//    write-only file. You need not support read/write files.
+//    O_RDONLY for a read-only file, O_WRONLY for a write-only file, or
+//    O_RDWR for a read/write file. `backend` is ignored; this file is a
+//    backend of its own.
 
-io61_file* io61_fdopen(int fd, int mode) {
+io61_file* io61_fdopen(int fd, int mode, const char* backend) {
+    (void) backend;
     assert(fd >= 0);
     io61_file* f = new io61_file;
-    f->f = fdopen(fd, mode == O_RDONLY ? "r" : "w");
+    const char* how = mode == O_RDONLY ? "r" : mode == O_WRONLY ? "w" : "r+";
+    f->f = fdopen(fd, how);
+    f->writing = mode != O_RDONLY;
+    f->rdwr = mode == O_RDWR;
     return f;
 }
 
@@ -34,18 +195,51 @@ io61_file* io61_fdopen(int fd, int mode) {
 
 int io61_close(io61_file* f) {
     io61_flush(f);
+    if (f->stream) {
+        stream_writers.erase(std::remove(stream_writers.begin(),
+                                         stream_writers.end(), f),
+                             stream_writers.end());
+    }
     int r = fclose(f->f);
+    free(f->mem);
+    if (f->map) {
+        munmap(f->map, f->map_size);
+    }
+    free(f->line);
+    delete[] f->vbuf;
     delete f;
     return r;
 }
 
 
-// io61_readc(f)
+// io61_lock(f), io61_unlock(f)
+//    Take or release the lock of `f`, which is its FILE's lock: every
+//    stdio call holds it while it works.
+
+void io61_lock(io61_file* f) {
+    flockfile(f->f);
+}
+
+void io61_unlock(io61_file* f) {
+    funlockfile(f->f);
+}
+
+
+// io61_readc_slow(f)
 //    Read a single (unsigned) character from `f` and return it. Returns EOF
 //    (which is -1) on error or end-of-file.
 
-int io61_readc(io61_file* f) {
-    return fgetc(f->f);
+int io61_readc_slow(io61_file* f) {
+    if (f->stream && !io61_stream_wait(f)) {
+        return EOF;
+    }
+    io61_turn(f, 'r');
+    int ch = fgetc(f->f);
+    if (ch != EOF) {
+        unsigned char c = ch;
+        io61_crc_add(f, &c, 1);
+    }
+    return ch;
 }
 
 
@@ -57,7 +251,25 @@ int io61_readc(io61_file* f) {
 //    were read.
 
 ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
-    size_t n = fread(buf, 1, sz, f->f);
+    size_t n;
+    if (f->stream && sz != 0) {
+        // one byte refills the FILE with a single read; then take only
+        // what that brought
+        if (!io61_stream_wait(f)) {
+            return -1;
+        }
+        int ch = fgetc(f->f);
+        if (ch == EOF) {
+            return ferror(f->f) ? -1 : 0;
+        }
+        buf[0] = ch;
+        n = 1 + io61_stream_take(f, buf + 1, sz - 1);
+        io61_crc_add(f, buf, n);
+        return n;
+    }
+    io61_turn(f, 'r');
+    n = fread(buf, 1, sz, f->f);
+    io61_crc_add(f, buf, n);
     if (n != 0 || sz == 0 || !ferror(f->f)) {
         return (ssize_t) n;
     } else {
@@ -66,12 +278,21 @@ ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
 }
 
 
-// io61_writec(f)
+// io61_writec_slow(f)
 //    Write a single character `ch` to `f`. Returns 0 on success or
 //    -1 on error.
 
-int io61_writec(io61_file* f, int ch) {
-    return fputc(ch, f->f);
+int io61_writec_slow(io61_file* f, int ch) {
+    io61_turn(f, 'w');
+    int r = fputc(ch, f->f);
+    if (r != EOF) {
+        unsigned char c = ch;
+        io61_crc_add(f, &c, 1);
+    }
+    if (f->stream) {
+        io61_stream_check(f);
+    }
+    return r;
 }
 
 
@@ -81,7 +302,12 @@ int io61_writec(io61_file* f, int ch) {
 //    an error occurred before any characters were written.
 
 ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
+    io61_turn(f, 'w');
     size_t n = fwrite(buf, 1, sz, f->f);
+    io61_crc_add(f, buf, n);
+    if (f->stream) {
+        io61_stream_check(f);
+    }
     if (n != 0 || sz == 0 || !ferror(f->f)) {
         return (ssize_t) n;
     } else {
@@ -100,15 +326,384 @@ int io61_flush(io61_file* f) {
 }
 
 
+// io61_copy(in, out, n)
+//    Copy up to `n` characters from `in` to `out`. Returns the number of
+//    characters copied, or -1 if an error occurred before any were copied.
+
+ssize_t io61_copy(io61_file* in, io61_file* out, size_t n) {
+    char buf[BUFSIZ];
+    size_t ncopied = 0;
+    io61_turn(in, 'r');
+    io61_turn(out, 'w');
+    while (ncopied != n) {
+        size_t m = n - ncopied < sizeof(buf) ? n - ncopied : sizeof(buf);
+        m = fread(buf, 1, m, in->f);
+        io61_crc_add(in, buf, m);
+        size_t w = m == 0 ? 0 : fwrite(buf, 1, m, out->f);
+        io61_crc_add(out, buf, w);
+        if (m == 0 || w != m) {
+            break;
+        }
+        ncopied += m;
+    }
+    if (ncopied != 0 || n == 0 || !(ferror(in->f) || ferror(out->f))) {
+        return ncopied;
+    } else {
+        return -1;
+    }
+}
+
+
+// io61_readline(f, line)
+//    Read the next line from `f`, including its newline if any, and set
+//    `*line` to point at it. Returns the line's length, or 0 at end of
+//    file. Returns -1 if an error occurred before any characters were
+//    read. `*line` is valid until the next call on `f`.
+
+ssize_t io61_readline(io61_file* f, const char** line) {
+    io61_turn(f, 'r');
+    ssize_t n = getline(&f->line, &f->linecap, f->f);
+    *line = f->line;
+    if (n < 0) {
+        return ferror(f->f) ? -1 : 0;
+    }
+    io61_crc_add(f, f->line, n);
+    return n;
+}
+
+
+// io61_readv(f, iov, iovcnt), io61_writev(f, iov, iovcnt)
+//    Read or write the `iovcnt` buffers of `iov` in order. Return the
+//    number of characters transferred, or -1 if an error occurred before
+//    any were.
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nread = 0;
+    flockfile(f->f);
+    io61_turn(f, 'r');
+    for (int i = 0; i != iovcnt; ++i) {
+        size_t n = fread(iov[i].iov_base, 1, iov[i].iov_len, f->f);
+        io61_crc_add(f, iov[i].iov_base, n);
+        nread += n;
+        if (n != iov[i].iov_len) {
+            break;
+        }
+    }
+    funlockfile(f->f);
+    if (nread != 0 || !ferror(f->f)) {
+        return nread;
+    } else {
+        return -1;
+    }
+}
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nwritten = 0;
+    // the buffers are one record, which other threads must not split
+    flockfile(f->f);
+    io61_turn(f, 'w');
+    for (int i = 0; i != iovcnt; ++i) {
+        size_t n = fwrite(iov[i].iov_base, 1, iov[i].iov_len, f->f);
+        io61_crc_add(f, iov[i].iov_base, n);
+        nwritten += n;
+        if (n != iov[i].iov_len) {
+            break;
+        }
+    }
+    funlockfile(f->f);
+    if (nwritten != 0 || !ferror(f->f)) {
+        return nwritten;
+    } else {
+        return -1;
+    }
+}
+
+
+// io61_pread(f, buf, sz, off), io61_pwrite(f, buf, sz, off)
+//    Read or write `sz` characters at offset `off` without changing the
+//    file pointer. Return the number of characters transferred, or -1 on
+//    error.
+
+ssize_t io61_pread(io61_file* f, char* buf, size_t sz, off_t off) {
+    // the seeks there and back must not be split by another thread
+    flockfile(f->f);
+    off_t pos = ftello(f->f);
+    if (pos == -1 || fseeko(f->f, off, SEEK_SET) == -1) {
+        funlockfile(f->f);
+        return -1;
+    }
+    size_t n = fread(buf, 1, sz, f->f);
+    bool error = n == 0 && ferror(f->f);
+    fseeko(f->f, pos, SEEK_SET);
+    f->last = 0;
+    funlockfile(f->f);
+    return error ? -1 : (ssize_t) n;
+}
+
+ssize_t io61_pwrite(io61_file* f, const char* buf, size_t sz, off_t off) {
+    flockfile(f->f);
+    off_t pos = ftello(f->f);
+    if (pos == -1 || fseeko(f->f, off, SEEK_SET) == -1) {
+        funlockfile(f->f);
+        return -1;
+    }
+    size_t n = fwrite(buf, 1, sz, f->f);
+    bool error = n == 0 && sz != 0;
+    fseeko(f->f, pos, SEEK_SET);
+    f->last = 0;
+    funlockfile(f->f);
+    return error ? -1 : (ssize_t) n;
+}
+
+
 // io61_seek(f, pos)
 //    Change the file pointer for file `f` to `pos` bytes into the file.
 //    Returns 0 on success and -1 on failure.
 
 int io61_seek(io61_file* f, off_t pos) {
+    if (f->memory && f->writing) {
+        // a memory stream's size follows its position
+        fflush(f->f);
+        f->mem_high = std::max(f->mem_high, f->mem_size);
+    }
+    f->last = 0;
     return fseek(f->f, pos, SEEK_SET);
 }
 
 
+// io61_checksum_start(f), io61_checksum(f)
+//    Start a running CRC32C checksum of the bytes read from or written to
+//    `f` from now on, or return the checksum so far (0 if none was
+//    started). Positional I/O is not included.
+
+void io61_checksum_start(io61_file* f) {
+    f->crc_on = true;
+    f->crc = 0;
+}
+
+uint32_t io61_checksum(io61_file* f) {
+    return f->crc;
+}
+
+
+// io61_concat
+//    The files behind a stream from io61_open_concat, which stdio reads
+//    through fopencookie: the names of the files and the one being read.
+
+struct io61_concat {
+    std::vector<std::string> names;
+    size_t next = 0;
+    int fd = -1;
+};
+
+static ssize_t io61_concat_read(void* cookie, char* buf, size_t sz) {
+    io61_concat* c = (io61_concat*) cookie;
+    while (true) {
+        if (c->fd >= 0) {
+            ssize_t n = read(c->fd, buf, sz);
+            if (n != 0) {
+                return n;
+            }
+            close(c->fd);
+            c->fd = -1;
+        }
+        if (c->next == c->names.size()) {
+            return 0;
+        }
+        const char* name = c->names[c->next++].c_str();
+        c->fd = open(name, O_RDONLY);
+        if (c->fd < 0) {
+            fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        }
+    }
+}
+
+static int io61_concat_close(void* cookie) {
+    io61_concat* c = (io61_concat*) cookie;
+    int r = c->fd >= 0 ? close(c->fd) : 0;
+    delete c;
+    return r;
+}
+
+
+// io61_open_concat(filenames, ahead)
+//    Return a read-only io61_file that reads the named files one after
+//    another. `ahead` is ignored; each file is opened when it is reached.
+
+io61_file* io61_open_concat(const std::vector<const char*>& filenames,
+                            int ahead) {
+    (void) ahead;
+    if (filenames.size() < 2) {
+        return io61_open_check(filenames.empty() ? nullptr : filenames[0],
+                               O_RDONLY);
+    }
+    io61_concat* c = new io61_concat;
+    for (const char* fn : filenames) {
+        c->names.push_back(fn);
+    }
+    cookie_io_functions_t fns = {
+        io61_concat_read, nullptr, nullptr, io61_concat_close
+    };
+    io61_file* f = new io61_file;
+    f->f = fopencookie(c, "r", fns);
+    return f;
+}
+
+
+// io61_memopen(data, sz, mode, memfd)
+//    Return a new io61_file whose contents live in memory, starting as
+//    a copy of the `sz` bytes at `data`. Without `memfd`, this is a
+//    stdio memory stream: fmemopen for reading, open_memstream for
+//    writing. With it, the bytes are in a memfd, read and written
+//    through a stdio FILE like any other file.
+
+io61_file* io61_memopen(const char* data, size_t sz, int mode, bool memfd) {
+    io61_file* f = new io61_file;
+    f->writing = (mode & O_ACCMODE) != O_RDONLY;
+    if (memfd) {
+        int fd = memfd_create("io61", 0);
+        if (fd < 0 || write(fd, data, sz) != (ssize_t) sz
+            || lseek(fd, 0, SEEK_SET) != 0
+            || !(f->f = fdopen(fd, f->writing ? "w" : "r"))) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            delete f;
+            return nullptr;
+        }
+        return f;
+    }
+    f->memory = true;
+    if (f->writing) {
+        f->f = open_memstream(&f->mem, &f->mem_size);
+        if (f->f && (fwrite(data, 1, sz, f->f) != sz
+                     || fseeko(f->f, 0, SEEK_SET) != 0)) {
+            fclose(f->f);
+            f->f = nullptr;
+        }
+        f->mem_high = sz;
+    } else {
+        f->mem = (char*) malloc(sz + 1);
+        memcpy(f->mem, data, sz);
+        f->mem_size = sz;
+        f->f = f->mem ? fmemopen(f->mem, sz, "r") : nullptr;
+    }
+    if (!f->f) {
+        free(f->mem);
+        delete f;
+        return nullptr;
+    }
+    return f;
+}
+
+
+// io61_memdata(f, sz)
+//    Return the contents of memory file `f`, setting `*sz` to their
+//    size, after flushing it. A memfd's contents are mapped. Returns
+//    nullptr for other files.
+
+const char* io61_memdata(io61_file* f, size_t* sz) {
+    fflush(f->f);
+    if (f->memory) {
+        f->mem_high = f->writing ? std::max(f->mem_high, f->mem_size)
+            : f->mem_size;
+        *sz = f->mem_high;
+        return f->mem;
+    }
+    struct stat st;
+    if (f->map) {
+        munmap(f->map, f->map_size);
+        f->map = nullptr;
+    }
+    if (fstat(fileno(f->f), &st) < 0 || !S_ISREG(st.st_mode)) {
+        return nullptr;
+    }
+    f->map_size = st.st_size;
+    if (st.st_size != 0) {
+        f->map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED,
+                      fileno(f->f), 0);
+        if (f->map == MAP_FAILED) {
+            f->map = nullptr;
+            return nullptr;
+        }
+    }
+    *sz = f->map_size;
+    return f->map ? (const char*) f->map : "";
+}
+
+
+// io61_fileno(f)
+//    Return the file descriptor of `f`, or -1 if it has none.
+
+int io61_fileno(io61_file* f) {
+    return fileno(f->f);
+}
+
+
+// io61_stream(f, timeout_ms, flush_size, flush_us)
+//    Put `f`, a pipe or socket, in stream mode: reads return what is
+//    available, waiting at most `timeout_ms` for the first byte, and
+//    writes flush by size or age. See io61.cc.
+
+int io61_stream(io61_file* f, int timeout_ms, size_t flush_size,
+                long flush_us) {
+    if (f->memory || lseek(fileno(f->f), 0, SEEK_CUR) >= 0) {
+        errno = ESPIPE;
+        return -1;
+    }
+    f->stream = true;
+    f->stream_timeout = timeout_ms;
+    f->flush_size = flush_size;
+    f->flush_ns = flush_us < 0 ? -1 : flush_us * 1000LL;
+    if (f->writing
+        && std::find(stream_writers.begin(), stream_writers.end(), f)
+               == stream_writers.end()) {
+        stream_writers.push_back(f);
+    }
+    return 0;
+}
+
+
+// io61_setvbuf(f, size)
+//    Give `f` a stdio buffer of `size` bytes (at least 1). Returns 0 on
+//    success, or -1 with errno EINVAL for a memory file or a `size` over
+//    1 GiB.
+
+int io61_setvbuf(io61_file* f, size_t size) {
+    if (f->memory || size > (size_t(1) << 30)) {
+        errno = EINVAL;
+        return -1;
+    }
+    size = std::max(size, size_t(1));
+    char* buf = new char[size];
+    if (setvbuf(f->f, buf, _IOFBF, size) != 0) {
+        delete[] buf;
+        errno = EINVAL;
+        return -1;
+    }
+    delete[] f->vbuf;
+    f->vbuf = buf;
+    return 0;
+}
+
+
+// io61_size_hint(f, size)
+//    Preallocate `size` bytes for write-only file `f`, without changing
+//    its size, where the file system allows. Returns 0 on success, or -1
+//    with errno EINVAL if `size` is negative or `f` is not write-only.
+
+int io61_size_hint(io61_file* f, off_t size) {
+    if (size < 0 || !f->writing || f->rdwr) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!f->memory) {
+        fallocate(fileno(f->f), FALLOC_FL_KEEP_SIZE, 0, size);
+    }
+    return 0;
+}
+
+
 // You shouldn't need to change these functions.
 
 // io61_open_check(filename, mode)
@@ -139,6 +734,14 @@ io61_file* io61_open_check(const char* filename, int mode) {
 //    well-defined size (for instance, if it is a pipe).
 
 off_t io61_filesize(io61_file* f) {
+    if (f->memory) {
+        size_t sz;
+        io61_memdata(f, &sz);
+        return sz;
+    } else if (f->rdwr && f->last == 'w') {
+        // read/write files count the writes they have buffered
+        fflush(f->f);
+    }
     struct stat s;
     int r = fstat(fileno(f->f), &s);
     if (r >= 0 && S_ISREG(s.st_mode)) {
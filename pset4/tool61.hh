@@ -0,0 +1,60 @@
+#ifndef TOOL61_HH
+#define TOOL61_HH
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// Helpers shared by the command-line tools, bench61 and io61sim.
+
+
+// split(s, sep)
+//    Return the fields of `s` separated by `sep`.
+
+inline std::vector<std::string> split(const char* s, char sep = ',') {
+    std::vector<std::string> v;
+    std::string cur;
+    for (; *s; ++s) {
+        if (*s == sep) {
+            v.push_back(cur);
+            cur.clear();
+        } else {
+            cur.push_back(*s);
+        }
+    }
+    v.push_back(cur);
+    return v;
+}
+
+
+// parse_size(prog, s, rest)
+//    Return the size `s` names, which may end in k, m, or g. If `rest` is
+//    given, set `*rest` to the text after the size; otherwise that text
+//    must be empty. Exits with a message from `prog` on a bad size.
+
+inline size_t parse_size(const char* prog, const std::string& s,
+                         const char** rest = nullptr) {
+    char* end;
+    size_t n = strtoul(s.c_str(), &end, 0);
+    switch (*end) {
+    case 'g': case 'G':
+        n <<= 10;
+        // fallthrough
+    case 'm': case 'M':
+        n <<= 10;
+        // fallthrough
+    case 'k': case 'K':
+        n <<= 10;
+        ++end;
+    }
+    if (end == s.c_str() || (*end && !rest)) {
+        fprintf(stderr, "%s: bad size '%s'\n", prog, s.c_str());
+        exit(1);
+    }
+    if (rest) {
+        *rest = end;
+    }
+    return n;
+}
+
+#endif
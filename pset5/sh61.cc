@@ -1,5 +1,6 @@
 #include "sh61.hh"
 #include <cerrno>
+#include <climits>
 #include <cstring>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -23,6 +24,8 @@ struct command {
   command();
   ~command();
   pid_t make_child(pid_t pgid, int in_fd, int out_fd, int close_fd);
+  bool open_redirections();
+  int run_builtin();
 };
 
 // command::command()
@@ -81,8 +84,147 @@ chain::~chain() {
   delete this->next_chain;
 }
 
+// BUILTINS
+
+// builtin_*(cmd)
+//    Run a builtin command and return its exit status. Builtins write to
+//    the shell's own stdout and stderr, so callers must flush them.
+
+int builtin_cd(command *cmd) {
+  const char *dir = getenv("HOME");
+  if (cmd->args.size() > 1) {
+    dir = cmd->args[1].c_str();
+  }
+  if (!dir) {
+    fprintf(stderr, "cd: HOME not set\n");
+    return 1;
+  }
+  if (chdir(dir) != 0) {
+    fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+int builtin_exit(command *cmd) {
+  int status = 0;
+  if (cmd->args.size() > 1) {
+    status = atoi(cmd->args[1].c_str());
+  }
+  fflush(stdout);
+  exit(status);
+}
+
+int builtin_true(command *cmd) {
+  (void)cmd;
+  return 0;
+}
+
+int builtin_false(command *cmd) {
+  (void)cmd;
+  return 1;
+}
+
+int builtin_echo(command *cmd) {
+  for (size_t i = 1; i < cmd->args.size(); ++i) {
+    fputs(cmd->args[i].c_str(), stdout);
+    fputc(i + 1 == cmd->args.size() ? '\n' : ' ', stdout);
+  }
+  if (cmd->args.size() == 1) {
+    fputc('\n', stdout);
+  }
+  return 0;
+}
+
+int builtin_pwd(command *cmd) {
+  (void)cmd;
+  char buf[PATH_MAX];
+  if (!getcwd(buf, sizeof(buf))) {
+    fprintf(stderr, "pwd: %s\n", strerror(errno));
+    return 1;
+  }
+  printf("%s\n", buf);
+  return 0;
+}
+
+// builtin dispatch table, searched by command name
+struct builtin {
+  const char *name;
+  int (*run)(command *cmd);
+};
+
+static const builtin builtins[] = {
+    {"cd", builtin_cd},       {"exit", builtin_exit}, {"true", builtin_true},
+    {"false", builtin_false}, {"echo", builtin_echo}, {"pwd", builtin_pwd},
+};
+
+// find_builtin(cmd)
+//    Return the builtin named by `cmd`'s first word, or nullptr if none.
+
+const builtin *find_builtin(command *cmd) {
+  if (cmd->args.empty()) {
+    return nullptr;
+  }
+  for (const builtin &b : builtins) {
+    if (cmd->args[0] == b.name) {
+      return &b;
+    }
+  }
+  return nullptr;
+}
+
 // COMMAND EXECUTION
 
+// command::open_redirections()
+//    Open this command's redirection files onto stdin, stdout, and stderr.
+//    Prints an error and returns false if a file cannot be opened.
+
+bool command::open_redirections() {
+  for (int i = 0; i < 3; ++i) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    if (i == 0) {
+      flags = O_RDONLY;
+    }
+    if (!this->redirs[i].empty()) {
+      const char *redir_str = this->redirs[i].c_str();
+      int new_fd = open(redir_str, flags, 0666);
+      if (new_fd == -1) {
+        fprintf(stderr, "%s: %s\n", redir_str, strerror(errno));
+        return false;
+      }
+      dup2(new_fd, i);
+      close(new_fd);
+    }
+  }
+  return true;
+}
+
+// command::run_builtin()
+//    Run the builtin command in `this` inside the shell process, without
+//    forking. Redirections are applied to the shell's own descriptors,
+//    which are saved first and restored afterwards. Returns the exit status.
+
+int command::run_builtin() {
+  int saved[3] = {-1, -1, -1};
+  for (int i = 0; i < 3; ++i) {
+    if (!this->redirs[i].empty()) {
+      saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+    }
+  }
+  int status = 1;
+  if (this->open_redirections()) {
+    status = find_builtin(this)->run(this);
+  }
+  fflush(stdout);
+  for (int i = 0; i < 3; ++i) {
+    if (saved[i] != -1) {
+      dup2(saved[i], i);
+      close(saved[i]);
+    }
+  }
+  return status;
+}
+
 // command::make_child(pgid)
 //    Create a single child process running the command in `this`.
 //    Sets `this->pid` to the pid of the child process and returns `this->pid`.
@@ -126,30 +268,19 @@ pid_t command::make_child(pid_t pgid, int in_fd, int out_fd, int close_fd) {
       dup2(out_fd, STDOUT_FILENO);
       close(out_fd);
     }
-    for (int i = 0; i < 3; ++i) {
-      int flags = O_WRONLY | O_CREAT | O_TRUNC;
-      if (i == 0) {
-        flags = O_RDONLY;
-      }
-      if (!this->redirs[i].empty()) {
-        const char *redir_str = this->redirs[i].c_str();
-        int new_fd = open(redir_str, flags, 0666);
-        if (new_fd == -1) {
-          fprintf(stderr, "%s: %s\n", redir_str, strerror(errno));
-          _exit(1);
-        }
-        dup2(new_fd, i);
-        close(new_fd);
-      }
+    if (!this->open_redirections()) {
+      _exit(1);
+    }
+    // builtins inside a pipeline run in the child
+    if (const builtin *b = find_builtin(this)) {
+      int status = b->run(this);
+      fflush(stdout);
+      _exit(status);
     }
     const char *in_args[this->args.size() + 1];
     for (size_t i = 0; i < this->args.size(); ++i) {
       in_args[i] = this->args[i].c_str();
     }
-    if (this->args[0] == "cd") {
-      int r = chdir(this->args[1].c_str());
-      _exit(r);
-    }
     in_args[this->args.size()] = nullptr;
     execvp(in_args[0], (char **)in_args);
     _exit(1);
@@ -159,9 +290,6 @@ pid_t command::make_child(pid_t pgid, int in_fd, int out_fd, int close_fd) {
     } else {
       setpgid(child_pid, pgid);
     }
-    if (this->args[0] == "cd") {
-      int z = chdir(this->args[1].c_str());
-    }
     this->pid = child_pid;
     return this->pid;
   }
@@ -209,9 +337,15 @@ void chain::run_pipelines() {
   pipeline *curr_pipeline = this->first_pipeline;
   int status;
   while (curr_pipeline != nullptr) {
-    pid_t last_pid = curr_pipeline->run_commands(this->is_background);
-    pid_t exited_pid = waitpid(last_pid, &status, 0);
-    assert(last_pid == exited_pid);
+    command *cmd = curr_pipeline->first_command;
+    if (cmd->next_cmd == nullptr && find_builtin(cmd)) {
+      // a builtin on its own runs in the shell, with no fork
+      status = W_EXITCODE(cmd->run_builtin(), 0);
+    } else {
+      pid_t last_pid = curr_pipeline->run_commands(this->is_background);
+      pid_t exited_pid = waitpid(last_pid, &status, 0);
+      assert(last_pid == exited_pid);
+    }
     if (WIFEXITED(status)) {
       if (WEXITSTATUS(status) == 0) {
         while (curr_pipeline != nullptr && curr_pipeline->is_or) {